@@ -5,7 +5,9 @@
 // Aggregator Configuration
 // ============================================================================
 
-// Aggregator identification
+// Aggregator identification (1-239, 240+ mark typed LoRa packets). This
+// and the settings marked in packet_schema.h's SETTINGS table are defaults
+// that downlink commands can change (DOWNLINK_COMMANDS).
 #define AGGREGATOR_ID           1
 #define AGGREGATOR_NAME         "Building_A_Floor_1"
 
@@ -16,14 +18,51 @@
 // Company ID for washing machine sensors (0xFFFF = testing)
 #define WASHING_MACHINE_COMPANY_ID  0xFFFF
 
-// Protocol version we accept
-#define PROTOCOL_VERSION        1
+// Sensor advertisement protocol versions 1 and 2 are accepted (see
+// parseSensorAdvertisement)
+
+// LoRa machine record format: RECORD_FORMAT_V1 (8 bytes) or
+// RECORD_FORMAT_V2 (6 bytes bit-packed, adds mean, machine type and flags)
+#ifndef RECORD_FORMAT
+#define RECORD_FORMAT           RECORD_FORMAT_V2
+#endif
 
 // BLE scan parameters
 #define BLE_SCAN_INTERVAL_MS    100     // How often to scan (ms)
 #define BLE_SCAN_WINDOW_MS      100     // Scan window duration (ms)
 #define BLE_SCAN_DURATION_SEC   0       // 0 = continuous scanning
 
+// Scan filtering. In whitelist mode the controller only reports known
+// sensor nodes; their MACs are learned from company-ID matches during
+// unfiltered discovery windows.
+#define BLE_FILTER_NONE         0
+#define BLE_FILTER_WHITELIST    1
+#define BLE_FILTER_MODE         BLE_FILTER_WHITELIST
+
+#define BLE_DISCOVERY_DURATION_MS   200000  // Longer than one sensor wake interval (180 s)
+#define BLE_DISCOVERY_INTERVAL_MS   3600000 // Look for new nodes every hour
+#define BLE_WHITELIST_MAX       12      // Controller whitelist capacity
+
+// Adaptive scan window: learn each node's wake period and phase, scan with
+// BLE_SCAN_WINDOW_MS around expected bursts and SCAN_NARROW_WINDOW_MS
+// in between to leave the 2.4 GHz path idle for coexistence
+#define SCAN_ADAPTIVE           1
+#define SCAN_NARROW_WINDOW_MS   20      // 20% duty between expected bursts
+#define SCAN_WAKE_GUARD_MS      3000    // Scan wide this long before/after a burst is due
+#define SCAN_BURST_GAP_MS       3000    // Silence that separates two wake bursts
+#define SCAN_MAX_PERIOD_MS      900000  // Longer gaps are not used for learning
+
+// BLE/LoRa coexistence: what the BLE scan does while LoRa transmits. The
+// TX current spike and the SPI bursts that load the packet desensitise
+// the 2.4 GHz receiver, so adverts heard during a send are mostly lost or
+// corrupted anyway. Pausing the scan for the send (and resuming right
+// after TX done) makes those gaps fixed and countable; narrowing keeps a
+// little reception. Scan windows given up are counted in telemetry.
+#define COEX_SCAN_KEEP          0       // Scan through LoRa TX
+#define COEX_SCAN_NARROW        1       // SCAN_NARROW_WINDOW_MS during TX
+#define COEX_SCAN_PAUSE         2       // No scan during TX
+#define COEX_TX_SCAN            COEX_SCAN_PAUSE
+
 // ============================================================================
 // LoRa Configuration (for Seeed WIO-SX1262)
 // ============================================================================
@@ -46,25 +85,232 @@
 #define LORA_TX_POWER           14      // dBm (max 14 for EU)
 #define LORA_PREAMBLE_LENGTH    8       // symbols
 #define LORA_SYNC_WORD          0x12    // Private network
+#define LORA_TX_COOLDOWN_MS     50      // Gap between packets for the receiver to re-arm
+#define LORA_TX_TIMEOUT_MARGIN_MS 100   // Added to time on air before a send is aborted
+#define LORA_HW_CRC             1       // Radio appends/checks a payload CRC
+
+// Radio backend (see radio.h): LORA_RADIO_SX126X drives the WIO-SX1262
+// natively, LORA_RADIO_SX127X goes through sandeepmistry/LoRa
+#ifndef LORA_RADIO
+#define LORA_RADIO              LORA_RADIO_SX126X
+#endif
+#define LORA_TCXO_VOLTAGE       0x02    // SX126x: 1.8 V TCXO on DIO3 (undefine for a crystal)
+#define LORA_DIO2_RF_SWITCH     1       // SX126x: DIO2 drives the antenna switch
 
 // ============================================================================
 // Data Forwarding Configuration
 // ============================================================================
 
-// How often to send aggregated data (0 = immediately on receive)
-#define FORWARD_INTERVAL_MS     0
+// Forwarding modes (the mode can also be changed at runtime)
+#define FORWARD_MODE_IMMEDIATE  0       // One packet per new reading
+#define FORWARD_MODE_BATCHED    1       // Coalesce readings within BATCH_DEADLINE_MS
+#define FORWARD_MODE_INTERVAL   2       // All cached sensors every FORWARD_INTERVAL_MS
+#define FORWARD_MODE_EVENTS     3       // State changes only, all sensors every EVENT_HEARTBEAT_MS
+
+#define FORWARD_MODE            FORWARD_MODE_IMMEDIATE
+
+// Batched mode: the first new reading starts the deadline, everything that
+// arrives before it goes out in one aggregated packet (earlier if full)
+#define BATCH_DEADLINE_MS       2000
+
+// How often to send aggregated data in interval mode
+#define FORWARD_INTERVAL_MS     30000
+
+// Events mode: heartbeat of all cached sensors, keeps the server's offline
+// timeout (5 minutes) from firing on machines that stay in one state
+#define EVENT_HEARTBEAT_MS      120000
+
+// Edge classification of running/stopped per machine. A machine starts
+// running at EDGE_RUN_RMS_X100 and only counts as stopped after staying
+// below EDGE_STOP_RMS_X100 for EDGE_STOP_HOLD_MS, so drum pauses within a
+// cycle are no state change. With EDGE_CLASSIFIER the state is also sent
+// in the v2 record flags and the server uses it instead of the raw RMS;
+// without it state changes are plain crossings of EDGE_RUN_RMS_X100.
+#define EDGE_CLASSIFIER         1
+#define EDGE_RUN_RMS_X100       50      // 0.5 m/s², matches server running_rms
+#define EDGE_STOP_RMS_X100      30      // 0.3 m/s²
+#define EDGE_STOP_HOLD_MS       90000
+
+// EU868 duty cycle (1% in the 868.0-868.6 MHz sub-band), sliding window.
+// In immediate mode the aggregator switches to paced aggregated packets
+// once DUTY_CYCLE_COALESCE_AT percent of the budget is used, and goes back
+// once usage falls to DUTY_CYCLE_RESUME_AT percent.
+#define DUTY_CYCLE_PERCENT          1
+#define DUTY_CYCLE_WINDOW_MS        3600000 // 1 hour
+#define DUTY_CYCLE_COALESCE_AT      50      // % of budget
+#define DUTY_CYCLE_RESUME_AT        25      // % of budget
+#define DUTY_CYCLE_COALESCE_MIN_MS  10000   // Minimum spacing of coalesced packets
+
+// Delta encoding of aggregated packets (interval and coalesced forwarding).
+// A keyframe carries all machines; following deltas only carry machines
+// whose RMS moved by more than DELTA_RMS_THRESHOLD_X100 or crossed the
+// running threshold.
+#define DELTA_ENCODING              1
+#define DELTA_RMS_THRESHOLD_X100    5       // 0.05 m/s²
+#define DELTA_RUNNING_RMS_X100      50      // 0.5 m/s², matches server running_rms
+#define DELTA_KEYFRAME_EVERY        10      // Deltas between keyframes
+
+// Multi-frame rounds: without delta encoding, the whole sensor set goes out
+// as frames of one round, each kept under the airtime target (at SF10: 13
+// machines per frame with v2 records, 10 with v1), and the server
+// reassembles the round
+#define MULTI_FRAME                 1
+#define FRAME_AIRTIME_TARGET_MS     1000
+
+// CRC-32 implementation for packet checksums (see crc32.h):
+// CRC32_IMPL_BITWISE, CRC32_IMPL_TABLE (1 KB flash table) or CRC32_IMPL_ROM
+#ifndef CRC32_IMPLEMENTATION
+#define CRC32_IMPLEMENTATION        CRC32_IMPL_TABLE
+#endif
 
 // Maximum machines per LoRa packet
 #define MAX_MACHINES_PER_PACKET 20
 
-// Timeout for considering a sensor offline (ms)
-#define SENSOR_TIMEOUT_MS       120000  // 2 minutes
+// Maximum machines per aggregator (max 254); aggregated sends are split
+// into one packet per MAX_MACHINES_PER_PACKET machines
+#define MAX_SENSORS             64
+
+// Silence after which a sensor counts as offline (ms). Nodes with a
+// learned wake period get OFFLINE_MISSED_WAKES periods (plus half a period
+// of slack) if that is longer. Expiry sends an offline event right away.
+#define SENSOR_TIMEOUT_MS       300000  // 5 minutes, matches server offline_minutes
+#define OFFLINE_MISSED_WAKES    2
+
+// Duplicate suppression: a sensor repeats the same reading many times per
+// broadcast window. Identical (machine, payload) copies within this window
+// are not forwarded again.
+#define DEDUP_HOLDOFF_MS        10000   // 10 seconds
+
+// Acknowledged state-change events: a machine the edge classifier sees
+// start or stop is sent at once as an events packet in every forwarding mode,
+// and the aggregator listens ACK_RX_WINDOW_MS for the bridge's ACK bitmap.
+// Unacknowledged events are resent after ACK_RETRY_BASE_MS, doubling per
+// attempt, up to ACK_MAX_RETRIES times. Steady-state readings are never
+// acknowledged.
+#define ACK_EVENTS              1
+#define ACK_RX_WINDOW_MS        2000    // After TX done, covers the bridge's turnaround
+#define ACK_RETRY_BASE_MS       5000
+#define ACK_MAX_RETRIES         4
+#define ACK_PENDING_MAX         8       // Machines with an unacknowledged event
+
+// Adaptive TX power: the bridge reports each ACKed packet's SNR, and the
+// aggregator lowers its power to what the best of the last ADR_HISTORY
+// reports needs to keep ADR_MARGIN_DB above the demodulation floor of
+// the spreading factor. ADR_MISSED_ACKS events in a row without any ACK
+// restore LORA_TX_POWER. Needs ACK_EVENTS. Spreading factor and channel
+// stay site-wide settings: the bridge receives on one SF and channel.
+#define ADR_ENABLED             1
+#define ADR_MIN_TX_POWER        2       // dBm
+#define ADR_MARGIN_DB           10      // Installation margin, as in LoRaWAN
+#define ADR_HISTORY             8       // ACKs considered
+#define ADR_MISSED_ACKS         3
+
+// Listen before talk: channel activity detection before every send. While
+// the channel is busy the aggregator backs off for a random time below
+// LBT_BACKOFF_MS (doubling per try), drawn from a generator seeded with
+// AGGREGATOR_ID so that neighbours do not pick the same delays. After
+// LBT_MAX_TRIES busy scans the packet goes out anyway.
+#define LBT_ENABLED             1
+#define LBT_CAD_TIMEOUT_MS      100     // CAD takes 4 symbols (~33 ms at SF10)
+#define LBT_BACKOFF_MS          400     // About one packet's airtime at SF10
+#define LBT_MAX_TRIES           4
+
+// TDMA: with TDMA_SLOTS > 0, sends only start in slot
+// (AGGREGATOR_ID - 1) % TDMA_SLOTS of a TDMA_SLOTS × TDMA_SLOT_MS frame,
+// so aggregators with different slots never overlap. The frame follows
+// the bridge clock carried in ACKs (needs ACK_EVENTS); until the first
+// ACK, and after TDMA_SYNC_MAX_AGE_MS without one, sends are unslotted.
+#define TDMA_SLOTS              0       // 0 = off, e.g. 15 for one slot per aggregator
+#define TDMA_SLOT_MS            1000
+#define TDMA_GUARD_MS           50      // Clock error allowance at each slot edge
+#define TDMA_SYNC_MAX_AGE_MS    3600000 // ~70 ms drift at 20 ppm
+
+// Downlink commands: telemetry packets are followed by an RX window like
+// the ACK window, and the bridge can answer them (and events packets) with
+// a command that changes a runtime setting or restarts the aggregator.
+// Settings are kept in NVS; the next telemetry packet (sent right away)
+// confirms the command ID.
+#define DOWNLINK_COMMANDS       1
+
+// Delta firmware updates over LoRa (see ota.h): the bridge starts one with
+// a downlink and answers each progress packet with the next patch chunk.
+// Requests are spaced so that the bridge's chunks stay within its own duty
+// cycle, at least OTA_REQUEST_MIN_INTERVAL_MS apart; at SF10 that moves
+// about 4 KB of compressed patch per hour.
+#define OTA_ENABLED             1
+#define OTA_REQUEST_MIN_INTERVAL_MS 5000
+#define OTA_CHUNK_RX_WINDOW_MS  4000    // Bridge turnaround plus a full chunk at SF10
+#define OTA_MAX_MISSED_CHUNKS   20      // Requests in a row without a chunk end the update
+
+// Relay for aggregators out of the bridge's range: between its own sends
+// the aggregator listens for their readings, events, frame and keyframe
+// packets and forwards the machine records in RELAYED packets with its
+// next aggregated round (after RELAY_MAX_HOLD_MS at the latest, events at
+// once). A newer record of a machine replaces the buffered one, so a
+// source costs one record per machine and round instead of a repeat of
+// every packet. The relay acknowledges the sources' events packets itself;
+// with a source the bridge hears too, that ACK collides with the bridge's
+// one in the same window (the source may get neither and resend), so only
+// list sources out of the bridge's range. The groups carry the source
+// sequence, the server drops what it heard directly. One hop only: RELAYED
+// packets are not relayed again. Delta packets cannot be merged without
+// their keyframe, sources must run without DELTA_ENCODING; telemetry and
+// offline reports stay local. All aggregators involved need the same
+// RECORD_FORMAT. The radio receives whenever it does not send, a few mA
+// more than idle.
+#define RELAY_ENABLED           0
+#define RELAY_SOURCES           {0}     // Aggregator IDs to relay, e.g. {7, 8}; {0} = any
+#define RELAY_MAX_RECORDS       32      // Machine records buffered for the next round
+#define RELAY_MAX_HOLD_MS       30000
+#define RELAY_RX_SLICE_MS       200     // Longest a BLE reading waits for the radio
+
+// State kept across resets. RTC memory survives software, watchdog and
+// panic resets: the sensor table, sequence counter and airtime budget come
+// back as they were. NVS (flash) survives power loss and only keeps the
+// learned node addresses and the airtime used, written when they change.
+#define PERSIST_ENABLED         1
+#define PERSIST_WARM_INTERVAL_MS 10000  // RTC copy of the sensor table
+#define PERSIST_NVS_INTERVAL_MS 900000  // Airtime to flash at most this often
+#define PERSIST_MAX_DOWNTIME_MS 60000   // Longer resets drop the sensor table
+
+// Health telemetry packet (counters since boot), sent with lowest priority
+#define TELEMETRY_ENABLED       1
+#define TELEMETRY_INTERVAL_MS   900000  // Every 15 minutes
+
+// LoRa TX task (owns the radio, fed by the BLE callback through a queue)
+#define TX_QUEUE_LENGTH         32      // Readings buffered while radio is busy
+#define TX_TASK_CORE            1       // NimBLE host runs on core 0
+#define TX_TASK_PRIORITY        2
+#define TX_TASK_STACK_SIZE      6144    // bytes, RX buffers and OTA flash calls
+
+// Power management: loop() and the TX task block until their next event,
+// the idle cores then drop to the lowest CPU clock and, with
+// POWER_LIGHT_SLEEP, to light sleep. Light sleep needs an ESP-IDF build
+// with CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE (stock
+// Arduino cores lack it, the aggregator then runs awake). USB serial
+// output stops while asleep.
+#define POWER_LIGHT_SLEEP       1
+#define POWER_MIN_CPU_MHZ       80      // Lowest clock BLE keeps working at
 
 // ============================================================================
 // Debug Configuration
 // ============================================================================
 
-#define DEBUG_SERIAL            1       // Enable serial debug output
+// Log level (see log.h): LOG_LEVEL_NONE, _ERROR, _WARN, _INFO or _DEBUG.
+// Levels above it compile out; per-reading messages are DEBUG.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL               LOG_LEVEL_INFO
+#endif
+#define LOG_RING_SIZE           64      // Deferred records (power of two)
+#define LOG_DRAIN_PER_LOOP      8       // Records formatted per loop() wakeup
 #define DEBUG_BAUD_RATE         115200
 
+// Wait for a USB serial monitor to attach before the banner; release
+// builds (env:xiao_esp32s3_release) start right away
+#ifdef RELEASE_BUILD
+#define SERIAL_STARTUP_DELAY_MS 0
+#else
+#define SERIAL_STARTUP_DELAY_MS 1000
+#endif
+
 #endif // CONFIG_H
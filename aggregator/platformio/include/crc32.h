@@ -0,0 +1,40 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+// ============================================================================
+// CRC-32 (IEEE 802.3, reflected 0xEDB88320), same result as Python's
+// binascii.crc32() / zlib.crc32()
+// ============================================================================
+
+#define CRC32_IMPL_BITWISE      0       // 8 shift steps per byte, no table
+#define CRC32_IMPL_TABLE        1       // 256-entry table in flash (1 KB)
+#define CRC32_IMPL_ROM          2       // ESP32 ROM crc32_le routine
+
+/*
+ * Incremental use, e.g. while a packet is being serialized:
+ *   uint32_t state = crc32Begin();
+ *   state = crc32Update(state, part1, len1);
+ *   state = crc32Update(state, part2, len2);
+ *   uint32_t crc = crc32Finish(state);
+ */
+inline uint32_t crc32Begin() {
+    return 0xFFFFFFFF;
+}
+
+inline uint32_t crc32Finish(uint32_t state) {
+    return ~state;
+}
+
+uint32_t crc32Update(uint32_t state, const uint8_t* data, size_t length);
+uint32_t crc32UpdateByte(uint32_t state, uint8_t value);
+
+// One-shot CRC-32 of a buffer
+inline uint32_t crc32(const uint8_t* data, size_t length) {
+    return crc32Finish(crc32Update(crc32Begin(), data, length));
+}
+
+#endif // CRC32_H
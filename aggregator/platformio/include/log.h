@@ -0,0 +1,87 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+#include "config.h"
+
+// ============================================================================
+// Leveled, deferred logging
+// ============================================================================
+
+#define LOG_LEVEL_NONE          0
+#define LOG_LEVEL_ERROR         1
+#define LOG_LEVEL_WARN          2
+#define LOG_LEVEL_INFO          3
+#define LOG_LEVEL_DEBUG         4
+
+#define LOG_MAX_ARGS            6
+
+/*
+ * LOG_ERROR/WARN/INFO/DEBUG(fmt, args...) store a binary record (format
+ * pointer + up to LOG_MAX_ARGS 32-bit arguments) in a lock-free ring
+ * buffer; logDrain() formats and prints them later from loop(). Macros
+ * above LOG_LEVEL compile to nothing, their arguments are not evaluated.
+ *
+ * Because formatting is deferred, the format must be a string literal and
+ * arguments must be integers, bools or pointers to string literals (%s).
+ * Floats are rejected at compile time. No trailing newline.
+ */
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...)  logDeferred(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...)  ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...)   logDeferred(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...)   ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...)   logDeferred(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...)   ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...)  logDeferred(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...)  ((void)0)
+#endif
+
+// Called after each queued record, e.g. to wake the task that drains the ring
+typedef void (*LogPendingHandler)();
+
+// Set up the ring, records pushed before are discarded
+void logBegin(LogPendingHandler pending = nullptr);
+
+// Queue one record, never blocks (dropped and counted if the ring is full)
+void logPush(uint8_t level, const char* format, const uint32_t* args, uint8_t argCount);
+
+// Print up to maxRecords queued records, returns how many were printed
+int logDrain(int maxRecords);
+
+template <typename T>
+inline uint32_t logArg(T value) {
+    static_assert(!std::is_floating_point<T>::value,
+                  "deferred log arguments must be integers, format fixed point instead");
+    static_assert(std::is_integral<T>::value || std::is_enum<T>::value,
+                  "deferred log arguments must be integers or string literals");
+    return (uint32_t)value;
+}
+
+inline uint32_t logArg(const char* literal) {
+    return (uint32_t)(uintptr_t)literal;
+}
+
+template <typename... Args>
+inline void logDeferred(uint8_t level, const char* format, Args... args) {
+    static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many deferred log arguments");
+    const uint32_t values[LOG_MAX_ARGS + 1] = {logArg(args)...};
+    logPush(level, format, values, sizeof...(Args));
+}
+
+#endif // LOG_H
@@ -0,0 +1,49 @@
+#ifndef OTA_H
+#define OTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+#include "packets.h"
+
+// ============================================================================
+// Delta firmware updates: a patch against the running image, streamed in
+// chunks, becomes the new image in the other OTA partition
+// ============================================================================
+
+/*
+ * Patch format (server/code/ota_patch.py): one zlib stream of operations
+ * that write the new image front to back,
+ *   OTA_OP_ADD     u32 base offset, u32 length, then length bytes, each
+ *                  added (mod 256) to the running image's byte there
+ *   OTA_OP_INSERT  u32 length, then length bytes of the new image as is
+ * all little-endian. Code a minor release moves around differs from the
+ * old one in few bytes, so ADD data is mostly zeros and compresses well.
+ */
+#define OTA_OP_ADD              0x01
+#define OTA_OP_INSERT           0x02
+
+// Whether the running image is `size` bytes with this CRC-32 (an update already applied)
+bool otaRunningImageIs(uint32_t size, uint32_t crc);
+
+/*
+ * Start an update: checks that the running image matches the patch's base
+ * (size and CRC-32) and opens the other OTA partition. Needs about 45 KB
+ * of heap until otaFinish() or otaAbort(). False if the update cannot
+ * start.
+ */
+bool otaBegin(const OtaBeginRecord& begin);
+
+// The next patch bytes, in order; false on a malformed patch or flash error
+bool otaWrite(const uint8_t* data, size_t length);
+
+// All patch bytes written: verify the image and boot into it next reset
+bool otaFinish();
+
+// Drop the update (the running image stays the boot image)
+void otaAbort();
+
+// This image came up: cancel the bootloader's rollback, if it has one
+void otaConfirmBoot();
+
+#endif // OTA_H
@@ -0,0 +1,284 @@
+#ifndef PACKET_SCHEMA_H
+#define PACKET_SCHEMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+// ============================================================================
+// LoRa packet schema: packet types and record layouts, the only place they
+// are described. packets.h generates the serializers from these tables and
+// scripts/gen_packet_schema.py the Python decoder tables (run on every
+// build). The script parses this file: one X(...) entry per line.
+// ============================================================================
+
+/*
+ * Typed packets: X(name, type byte, prefix bytes). The prefix is the part
+ * of the body before the records; its last byte is the record count.
+ */
+#define PACKET_TYPES(X) \
+    X(KEYFRAME,  0xF0, 2)   /* Full machine set: keyframe ID, count */ \
+    X(DELTA,     0xF1, 2)   /* Changes since a keyframe: keyframe ID, count, bitmaps */ \
+    X(READINGS,  0xF2, 1)   /* Plain list of machine records */ \
+    X(TELEMETRY, 0xF3, 0)   /* Aggregator health counters */ \
+    X(FRAME,     0xF4, 4)   /* One frame of a round: round ID, index, total, count */ \
+    X(OFFLINE,   0xF5, 1)   /* Machines that just went silent */ \
+    X(EVENTS,    0xF6, 1)   /* State-change readings, acknowledged by the bridge */ \
+    X(OTA_REQUEST, 0xF7, 0) /* Firmware update progress, asks for the next chunk */ \
+    X(ACK,       0xF8, 0)   /* Downlink: bridge -> aggregator ACK bitmap */ \
+    X(COMMAND,   0xF9, 0)   /* Downlink: change a setting or restart */ \
+    X(OTA_BEGIN, 0xFA, 0)   /* Downlink: start a firmware update */ \
+    X(OTA_CHUNK, 0xFB, 0)   /* Downlink: patch bytes, they fill the rest of the body */ \
+    X(RELAYED,   0xFC, 1)   /* Other aggregators' machine records: group count, groups */
+
+/*
+ * Record layouts: X(field, bits). Fields are unsigned and packed least
+ * significant bit first, little-endian; every layout fills whole bytes.
+ * Values are stored as quantized by packets.cpp (see the v2 encodings).
+ */
+#define MACHINE_RECORD_V1_FIELDS(X) \
+    X(machineId, 8) \
+    X(rmsX100, 16) \
+    X(freqX10, 16) \
+    X(batteryPercent, 8) \
+    X(ageMs, 16)            /* Since BLE receive, saturating */
+
+#define MACHINE_RECORD_V2_FIELDS(X) \
+    X(machineId, 8) \
+    X(rmsX100, 11)          /* Saturates at 20.47 m/s² */ \
+    X(freqCode, 8)          /* 0 = below 0.1 Hz, else 0.1 Hz × 2^((code - 1) / 24) */ \
+    X(batteryCode, 4)       /* 0-15 = 0-100 % */ \
+    X(meanX10, 8)           /* Saturates at 25.5 m/s² */ \
+    X(dryer, 1) \
+    X(ageCode, 5)           /* 0 = below 64 ms, else [64 ms × 2^(code - 1), × 2^code) */ \
+    X(flags, 3)             /* Low bits of SensorReading::flags */
+
+#define DELTA_RECORD_V1_FIELDS(X) \
+    X(rmsX100, 16) \
+    X(batteryPercent, 8) \
+    X(ageMs, 16)
+
+#define DELTA_RECORD_V2_FIELDS(X) \
+    X(rmsX100, 11) \
+    X(batteryCode, 4) \
+    X(reserved, 1) \
+    X(ageCode, 5) \
+    X(flags, 3)
+
+#define OFFLINE_RECORD_FIELDS(X) \
+    X(machineId, 8) \
+    X(silentS, 16)          /* Since last heard, saturating */
+
+// RELAYED groups: this header and `count` machine records of one source
+// packet. Ages include the time in the relay.
+#define RELAY_GROUP_FIELDS(X) \
+    X(sourceId, 8)          /* Aggregator the records came from */ \
+    X(sourceSeq, 16)        /* Its packet that carried them, for dedup at the server */ \
+    X(count, 8)             /* Machine count, | RECORD_V2_FLAG for v2 records */
+
+// Counters since boot
+#define TELEMETRY_FIELDS(X) \
+    X(uptimeS, 32) \
+    X(advertsSeen, 32) \
+    X(advertsMatched, 32) \
+    X(dedupHits, 32) \
+    X(cacheFullDrops, 32) \
+    X(txQueueDrops, 32) \
+    X(txQueueDepth, 8) \
+    X(txQueueHighWater, 8) \
+    X(airtimeWindowMs, 32)  /* In the duty cycle window */ \
+    X(airtimeTotalMs, 32) \
+    X(packetsSent, 32) \
+    X(callbackP50Us, 16)    /* Callback latency percentiles, saturating */ \
+    X(callbackP90Us, 16) \
+    X(callbackP99Us, 16) \
+    X(callbackMaxUs, 16) \
+    X(minFreeHeap, 32) \
+    X(txTimeouts, 16) \
+    X(activeSensors, 8) \
+    X(commandId, 8)         /* Last downlink command applied, 0 = none */ \
+    X(missedScanWindows, 32) /* BLE scan windows given up to LoRa TX */ \
+    X(missedDueWindows, 32) /* Of those, while a node's burst was due */ \
+    X(relayedRecords, 32)   /* Other aggregators' machine records forwarded */ \
+    X(relayMerged, 32)      /* Of theirs, replaced by a newer one or heard twice */ \
+    X(txStackFree, 16)      /* Least TX task stack left since boot, bytes */
+
+// ACK body; the header's sequence field carries the latest sequence received
+#define ACK_FIELDS(X) \
+    X(receivedBitmap, 16)   /* Bit i set = sequence - 1 - i received */ \
+    X(bridgeClockMs, 32)    /* When the ACK was sent, TDMA reference; ACK_CLOCK_UNKNOWN if none */ \
+    X(snrX4, 8)             /* Of the acknowledged packet, i8, 127 = unknown */ \
+    X(rssiNeg, 8)           /* Of the acknowledged packet, negated dBm */
+
+// Downlinks below carry the bridge's latest sequence of the aggregator in
+// the header like an ACK; only the aggregator ID in byte 1 matters
+
+// One setting per command; repeats of the last command ID are not applied again
+#define COMMAND_FIELDS(X) \
+    X(commandId, 8)         /* 1-255, confirmed in telemetry */ \
+    X(setting, 8)           /* SETTINGS code */ \
+    X(value, 32)
+
+/*
+ * Runtime settings: X(name, code, min, max). Settings marked restart are
+ * stored at once and take effect after the next restart. A bound may name
+ * a config.h define.
+ */
+#define SETTINGS(X) \
+    X(RESTART,             0, 0, 0)     /* Not a setting: save state and restart */ \
+    X(AGGREGATOR_ID,       1, 1, 239)   /* Restart */ \
+    X(FORWARD_MODE,        2, 0, 3)     /* FORWARD_MODE_* */ \
+    X(FORWARD_INTERVAL_MS, 3, 5000, 86400000) \
+    X(SPREADING_FACTOR,    4, 7, 12)    /* Restart; the bridge must be changed too */ \
+    X(TX_POWER,            5, 2, LORA_TX_POWER) /* dBm, ceiling for ADR; the EU limit */
+
+// Delta firmware update (see ota.h)
+#define OTA_BEGIN_FIELDS(X) \
+    X(sessionId, 8)         /* 1-255, names the update in chunks and requests */ \
+    X(patchSize, 32)        /* Compressed patch bytes to transfer */ \
+    X(baseSize, 32)         /* Running image the patch applies to */ \
+    X(baseCrc, 32) \
+    X(imageSize, 32)        /* Image the patch produces */ \
+    X(imageCrc, 32)
+
+#define OTA_CHUNK_FIELDS(X) \
+    X(sessionId, 8) \
+    X(offset, 32)           /* Patch offset of the first data byte */
+
+#define OTA_REQUEST_FIELDS(X) \
+    X(sessionId, 8) \
+    X(status, 8)            /* OTA_STATUSES code */ \
+    X(offset, 32)           /* Patch bytes received so far, the next chunk starts here */
+
+// Update states: X(name, code)
+#define OTA_STATUSES(X) \
+    X(RECEIVING, 0) \
+    X(DONE, 1)              /* Image verified, restarting into it */ \
+    X(FAILED, 2)            /* Base mismatch or a bad image, update dropped */
+
+// ============================================================================
+// Sizes, checked at compile time
+// ============================================================================
+
+#define SCHEMA_FIELD_BITS(name, width)  + (width)
+#define SCHEMA_SIZE(FIELDS)             ((0 FIELDS(SCHEMA_FIELD_BITS)) / 8)
+
+#define SCHEMA_PACKET_TYPE(name, code, prefix)      PACKET_TYPE_##name = code,
+#define SCHEMA_PACKET_PREFIX(name, code, prefix)    PACKET_PREFIX_##name = prefix,
+
+#define SCHEMA_SETTING(name, code, min, max)        SETTING_##name = code,
+#define SCHEMA_OTA_STATUS(name, code)               OTA_STATUS_##name = code,
+
+enum : uint8_t { PACKET_TYPES(SCHEMA_PACKET_TYPE) };
+enum : uint8_t { PACKET_TYPES(SCHEMA_PACKET_PREFIX) };
+enum : uint8_t { SETTINGS(SCHEMA_SETTING) };
+enum : uint8_t { OTA_STATUSES(SCHEMA_OTA_STATUS) };
+
+#define TYPED_HEADER_SIZE       4
+#define PACKET_CRC_SIZE         4
+#define LORA_MAX_PAYLOAD        255
+#define ACK_CLOCK_UNKNOWN       0xFFFFFFFF  // bridgeClockMs of a relay without TDMA sync
+
+// Machine record formats (RECORD_FORMAT). Packets with v2 records set
+// RECORD_V2_FLAG in their machine count byte.
+#define RECORD_FORMAT_V1        1       // id, rms, freq, battery, age
+#define RECORD_FORMAT_V2        2       // Bit-packed, adds mean, type, flags
+#define RECORD_V2_FLAG          0x80
+
+#if RECORD_FORMAT == RECORD_FORMAT_V2
+#define MACHINE_RECORD_FIELDS   MACHINE_RECORD_V2_FIELDS
+#define DELTA_RECORD_FIELDS     DELTA_RECORD_V2_FIELDS
+#else
+#define MACHINE_RECORD_FIELDS   MACHINE_RECORD_V1_FIELDS
+#define DELTA_RECORD_FIELDS     DELTA_RECORD_V1_FIELDS
+#endif
+
+#define MACHINE_RECORD_SIZE     SCHEMA_SIZE(MACHINE_RECORD_FIELDS)
+#define DELTA_RECORD_SIZE       SCHEMA_SIZE(DELTA_RECORD_FIELDS)
+#define OFFLINE_RECORD_SIZE     SCHEMA_SIZE(OFFLINE_RECORD_FIELDS)
+#define RELAY_GROUP_SIZE        SCHEMA_SIZE(RELAY_GROUP_FIELDS)
+#define DELTA_BITMAP_SIZE       ((MAX_MACHINES_PER_PACKET + 7) / 8)
+
+constexpr size_t typedPacketSize(size_t bodySize) {
+    return TYPED_HEADER_SIZE + bodySize + PACKET_CRC_SIZE;
+}
+
+// Largest packet of each type (MAX_MACHINES_PER_PACKET records)
+constexpr size_t READINGS_PACKET_MAX =
+    typedPacketSize(PACKET_PREFIX_READINGS + MAX_MACHINES_PER_PACKET * MACHINE_RECORD_SIZE);
+constexpr size_t KEYFRAME_PACKET_MAX =
+    typedPacketSize(PACKET_PREFIX_KEYFRAME + MAX_MACHINES_PER_PACKET * MACHINE_RECORD_SIZE);
+constexpr size_t DELTA_PACKET_MAX =
+    typedPacketSize(PACKET_PREFIX_DELTA + 2 * DELTA_BITMAP_SIZE + MAX_MACHINES_PER_PACKET * DELTA_RECORD_SIZE);
+constexpr size_t OFFLINE_PACKET_MAX =
+    typedPacketSize(PACKET_PREFIX_OFFLINE + MAX_MACHINES_PER_PACKET * OFFLINE_RECORD_SIZE);
+constexpr size_t RELAYED_PACKET_MAX =     // Every record from another source
+    typedPacketSize(PACKET_PREFIX_RELAYED + MAX_MACHINES_PER_PACKET * (RELAY_GROUP_SIZE + MACHINE_RECORD_SIZE));
+constexpr size_t TELEMETRY_PACKET_SIZE = typedPacketSize(SCHEMA_SIZE(TELEMETRY_FIELDS));
+constexpr size_t ACK_PACKET_SIZE = typedPacketSize(SCHEMA_SIZE(ACK_FIELDS));
+constexpr size_t COMMAND_PACKET_SIZE = typedPacketSize(SCHEMA_SIZE(COMMAND_FIELDS));
+constexpr size_t OTA_BEGIN_PACKET_SIZE = typedPacketSize(SCHEMA_SIZE(OTA_BEGIN_FIELDS));
+constexpr size_t OTA_REQUEST_PACKET_SIZE = typedPacketSize(SCHEMA_SIZE(OTA_REQUEST_FIELDS));
+constexpr size_t OTA_CHUNK_DATA_MAX = LORA_MAX_PAYLOAD - typedPacketSize(SCHEMA_SIZE(OTA_CHUNK_FIELDS));
+
+static_assert((0 MACHINE_RECORD_V1_FIELDS(SCHEMA_FIELD_BITS)) % 8 == 0 &&
+              (0 MACHINE_RECORD_V2_FIELDS(SCHEMA_FIELD_BITS)) % 8 == 0 &&
+              (0 DELTA_RECORD_V1_FIELDS(SCHEMA_FIELD_BITS)) % 8 == 0 &&
+              (0 DELTA_RECORD_V2_FIELDS(SCHEMA_FIELD_BITS)) % 8 == 0 &&
+              (0 OFFLINE_RECORD_FIELDS(SCHEMA_FIELD_BITS)) % 8 == 0 &&
+              (0 RELAY_GROUP_FIELDS(SCHEMA_FIELD_BITS)) % 8 == 0 &&
+              (0 TELEMETRY_FIELDS(SCHEMA_FIELD_BITS)) % 8 == 0 &&
+              (0 ACK_FIELDS(SCHEMA_FIELD_BITS)) % 8 == 0 &&
+              (0 COMMAND_FIELDS(SCHEMA_FIELD_BITS)) % 8 == 0 &&
+              (0 OTA_BEGIN_FIELDS(SCHEMA_FIELD_BITS)) % 8 == 0 &&
+              (0 OTA_CHUNK_FIELDS(SCHEMA_FIELD_BITS)) % 8 == 0 &&
+              (0 OTA_REQUEST_FIELDS(SCHEMA_FIELD_BITS)) % 8 == 0, "Record layouts must fill whole bytes");
+static_assert(MAX_MACHINES_PER_PACKET < RECORD_V2_FLAG, "Machine count must leave the v2 flag bit free");
+static_assert(READINGS_PACKET_MAX <= LORA_MAX_PAYLOAD && KEYFRAME_PACKET_MAX <= LORA_MAX_PAYLOAD &&
+              DELTA_PACKET_MAX <= LORA_MAX_PAYLOAD && OFFLINE_PACKET_MAX <= LORA_MAX_PAYLOAD &&
+              RELAYED_PACKET_MAX <= LORA_MAX_PAYLOAD,
+              "MAX_MACHINES_PER_PACKET records do not fit in one LoRa packet");
+
+// ============================================================================
+// Time on air
+// ============================================================================
+
+// Modulation parameters that set the time on air
+struct LoRaProfile {
+    uint32_t bandwidthHz;
+    uint8_t spreadingFactor;
+    uint8_t codingRate;         // 4/x
+    uint16_t preambleLength;    // Symbols
+};
+
+// The configured modulation (LORA_* in config.h); the spreading factor in
+// use may differ, see loraProfile in settings.h
+constexpr LoRaProfile LORA_PROFILE = {
+    LORA_BANDWIDTH, LORA_SPREADING_FACTOR, LORA_CODING_RATE, LORA_PREAMBLE_LENGTH
+};
+
+constexpr uint32_t loraSymbolUs(const LoRaProfile& profile) {
+    return ((uint32_t)1 << profile.spreadingFactor) * 1000000UL / profile.bandwidthHz;
+}
+
+// Payload symbols for a numerator/denominator of the AN1200.13 formula
+constexpr int32_t loraPayloadSymbols(int32_t numerator, int32_t denominator, int32_t codingRate) {
+    return 8 + (numerator > 0 ? (numerator + denominator - 1) / denominator * codingRate : 0);
+}
+
+/*
+ * Time on air for a LoRa packet (Semtech AN1200.13), explicit header,
+ * payload CRC assumed on (worst case). The low data rate optimization is
+ * mandated above 16 ms symbols (SF11/12 at 125 kHz). The preamble is
+ * (n + 4.25) symbols, counted in quarter symbols to stay integer.
+ */
+constexpr uint32_t loraTimeOnAirMs(size_t payloadLength, const LoRaProfile& profile) {
+    return ((profile.preambleLength * 4 + 17 +
+             4 * (uint32_t)loraPayloadSymbols(
+                 8 * (int32_t)payloadLength - 4 * profile.spreadingFactor + 28 + 16,
+                 4 * (profile.spreadingFactor - 2 * (loraSymbolUs(profile) > 16000 ? 1 : 0)),
+                 profile.codingRate)) *
+            loraSymbolUs(profile) / 4 + 999) / 1000;
+}
+
+#endif // PACKET_SCHEMA_H
@@ -0,0 +1,241 @@
+#ifndef PACKETS_H
+#define PACKETS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+#include "crc32.h"
+#include "packet_schema.h"
+#include "sensors.h"
+
+// ============================================================================
+// LoRa packet encoding
+// ============================================================================
+
+// Typed LoRa packets: byte 0 >= 0xF0 marks the packet type, byte 1 is the
+// aggregator ID, bytes 2-3 the packet sequence number (little-endian), a
+// CRC-32 closes the packet. Legacy packets start with the aggregator ID
+// (1-239) directly; only the CircuitPython aggregator still sends those.
+// Types, layouts and sizes are in packet_schema.h.
+
+/*
+ * Serializes a packet into a caller-provided buffer and keeps the CRC-32
+ * running as bytes are appended. Writes past the capacity are dropped and
+ * flagged in `overflow`.
+ */
+struct PacketWriter {
+    uint8_t* buffer;
+    size_t capacity;
+    size_t length;
+    uint32_t crcState;
+    bool overflow;
+    uint32_t bitBuffer;         // Bits of a record not yet a whole byte
+    int bitCount;
+
+    PacketWriter(uint8_t* buf, size_t cap)
+        : buffer(buf), capacity(cap), length(0), crcState(crc32Begin()), overflow(false),
+          bitBuffer(0), bitCount(0) {}
+
+    void u8(uint8_t value) {
+        if (length >= capacity) {
+            overflow = true;
+            return;
+        }
+        buffer[length++] = value;
+        crcState = crc32UpdateByte(crcState, value);
+    }
+
+    void u16(uint16_t value) {
+        u8(value & 0xFF);
+        u8((value >> 8) & 0xFF);
+    }
+
+    void u32(uint32_t value) {
+        u16(value & 0xFFFF);
+        u16(value >> 16);
+    }
+
+    void bytes(const uint8_t* data, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            u8(data[i]);
+        }
+    }
+
+    // Append the low `width` bits (1-32) of a record field, see packet_schema.h
+    void bits(uint32_t value, int width) {
+        uint64_t pending = bitBuffer | (uint64_t)(value & (0xFFFFFFFFu >> (32 - width))) << bitCount;
+        int count = bitCount + width;
+        for (; count >= 8; count -= 8) {
+            u8(pending & 0xFF);
+            pending >>= 8;
+        }
+        bitBuffer = pending;
+        bitCount = count;
+    }
+
+    // Append the CRC-32 of everything written so far (not covered by itself)
+    uint32_t appendCrc32() {
+        uint32_t crc = crc32Finish(crcState);
+        for (int i = 0; i < 4; i++) {
+            if (length < capacity) {
+                buffer[length++] = (crc >> (8 * i)) & 0xFF;
+            } else {
+                overflow = true;
+            }
+        }
+        return crc;
+    }
+};
+
+// Reads record fields back out of a received packet, the writer's inverse
+struct PacketReader {
+    const uint8_t* data;
+    size_t length;
+    size_t position;
+    uint32_t bitBuffer;
+    int bitCount;
+
+    PacketReader(const uint8_t* buf, size_t len, size_t offset = 0)
+        : data(buf), length(len), position(offset), bitBuffer(0), bitCount(0) {}
+
+    // Past the end, missing bytes read as 0
+    uint32_t bits(int width) {
+        uint64_t pending = bitBuffer;
+        int count = bitCount;
+        for (; count < width; count += 8) {
+            pending |= (uint64_t)(position < length ? data[position++] : 0) << count;
+        }
+        bitBuffer = pending >> width;
+        bitCount = count - width;
+        return pending & (0xFFFFFFFFu >> (32 - width));
+    }
+};
+
+/*
+ * One struct per record layout with a uint32_t member per field, plus
+ * writeRecord()/readRecord() that pack them as the schema says
+ */
+#define SCHEMA_FIELD_MEMBER(name, width)    uint32_t name;
+#define SCHEMA_FIELD_WRITE(name, width)     writer.bits(record.name, width);
+#define SCHEMA_FIELD_READ(name, width)      record.name = reader.bits(width);
+
+#define SCHEMA_RECORD(Type, FIELDS) \
+    struct Type { \
+        FIELDS(SCHEMA_FIELD_MEMBER) \
+    }; \
+    inline void writeRecord(PacketWriter& writer, const Type& record) { \
+        FIELDS(SCHEMA_FIELD_WRITE) \
+    } \
+    inline void readRecord(PacketReader& reader, Type& record) { \
+        FIELDS(SCHEMA_FIELD_READ) \
+    }
+
+SCHEMA_RECORD(MachineRecord, MACHINE_RECORD_FIELDS)
+SCHEMA_RECORD(DeltaRecord, DELTA_RECORD_FIELDS)
+SCHEMA_RECORD(OfflineRecord, OFFLINE_RECORD_FIELDS)
+SCHEMA_RECORD(RelayGroupRecord, RELAY_GROUP_FIELDS)
+SCHEMA_RECORD(TelemetryRecord, TELEMETRY_FIELDS)
+SCHEMA_RECORD(AckRecord, ACK_FIELDS)
+SCHEMA_RECORD(CommandRecord, COMMAND_FIELDS)
+SCHEMA_RECORD(OtaBeginRecord, OTA_BEGIN_FIELDS)
+SCHEMA_RECORD(OtaChunkRecord, OTA_CHUNK_FIELDS)
+SCHEMA_RECORD(OtaRequestRecord, OTA_REQUEST_FIELDS)
+
+/*
+ * The packet senders below build a packet and hand it to
+ * transmitLoRaPacket(), which the firmware implements on top of the duty
+ * cycle budget and the radio (a host build can count bytes instead). It
+ * returns false when the packet was held back, and advances
+ * packetSequence for every packet put on air. Senders and
+ * transmitLoRaPacket() must only be called from one task.
+ */
+bool transmitLoRaPacket(const uint8_t* packet, size_t length);
+
+// Sequence number of the next packet put on air, wraps at 65535
+extern uint16_t packetSequence;
+
+/*
+ * Aggregator ID for the typed header and the modulation whose time on air
+ * the senders return. Both only change with a restart, setup() passes
+ * them once (a host build its own). Until then config.h's values apply.
+ */
+void packetsBegin(uint8_t aggregatorId, const LoRaProfile& profile);
+
+// Bytes 0-3 of every typed packet, carrying the current packetSequence
+void writeTypedHeader(PacketWriter& writer, uint8_t packetType);
+
+uint16_t saturate16(uint32_t value);
+
+/*
+ * Send a set of readings in one packet. At most MAX_MACHINES_PER_PACKET
+ * readings are sent, their ages relative to nowMs. Returns the packet's
+ * time on air (also when the duty cycle held it back).
+ */
+uint32_t sendReadingsLoRaPacket(const SensorReading* readings, int count, uint32_t nowMs);
+
+/*
+ * Send readings of machines that changed state as an events packet (same
+ * body as readings), which the bridge acknowledges. The packet carries the
+ * packetSequence at the time of the call. Returns true if it went on air.
+ */
+bool sendEventsLoRaPacket(const SensorReading* readings, int count, uint32_t nowMs);
+
+#if MULTI_FRAME
+/*
+ * Send a complete set of readings as one round of frames, each sized to
+ * the airtime target. The server collects the frames of a round and
+ * delivers the full set. Returns the total time on air.
+ */
+uint32_t sendReadingFrames(const SensorReading* readings, int count, uint32_t nowMs);
+#endif
+
+#if DELTA_ENCODING
+/*
+ * Keyframe the server holds for one group of MAX_MACHINES_PER_PACKET cache
+ * slots; that group's deltas are relative to it (TX task only). Keyframe
+ * IDs come from one counter so the server can tell the groups apart.
+ */
+struct DeltaState {
+    bool valid;
+    uint8_t keyframeId;
+    int count;
+    uint8_t machineIds[MAX_MACHINES_PER_PACKET];
+    uint16_t sentRmsX100[MAX_MACHINES_PER_PACKET];     // Last value the server got
+    uint8_t sentFlags[MAX_MACHINES_PER_PACKET];        // Flags that came with it
+    int deltasSinceKeyframe;
+};
+
+#define SENSOR_GROUPS   ((MAX_SENSORS + MAX_MACHINES_PER_PACKET - 1) / MAX_MACHINES_PER_PACKET)
+
+extern DeltaState deltaStates[SENSOR_GROUPS];
+
+/*
+ * Send only what changed since the group's last keyframe (RMS or record
+ * flags, e.g. the edge state). Falls back to a
+ * keyframe when a machine is not part of it, or every DELTA_KEYFRAME_EVERY
+ * packets. Returns the time on air.
+ */
+uint32_t sendDeltaLoRaPacket(DeltaState& state, const SensorReading* readings, int count, uint32_t nowMs);
+#endif
+
+// Report machines that went offline, with their seconds of silence
+void sendOfflineLoRaPacket(const uint8_t* machineIds, const uint16_t* silentSec, int count);
+
+#if RELAY_ENABLED
+// A machine record heard from another aggregator, waiting to be relayed
+struct RelayedRecord {
+    uint8_t sourceId;
+    uint16_t sourceSeq;     // Packet that carried it
+    uint32_t receivedMs;    // Its age grows by the time held here
+    MachineRecord record;
+};
+
+/*
+ * Send relayed records in RELAYED packets of up to MAX_MACHINES_PER_PACKET
+ * records, one group per run of records with the same source and source
+ * sequence (sort them by both). Returns the total time on air.
+ */
+uint32_t sendRelayedLoRaPackets(const RelayedRecord* records, int count, uint32_t nowMs);
+#endif
+
+#endif // PACKETS_H
@@ -0,0 +1,67 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+#include "sensors.h"
+
+// ============================================================================
+// State kept across resets: RTC memory (warm resets) and NVS (power loss)
+// ============================================================================
+
+#define PERSIST_AIRTIME_BUCKETS 60      // Duty-cycle window, one bucket per minute
+
+// BLE address of a sensor node
+struct NodeAddress {
+    uint8_t addr[6];
+    uint8_t type;
+};
+
+// Learned sensor node addresses (the scan whitelist)
+struct PersistedNodes {
+    int count;
+    NodeAddress addresses[BLE_WHITELIST_MAX];
+};
+
+// TX task state; times are millis() values
+struct PersistedRuntime {
+    uint16_t packetSequence;
+    uint32_t airtimeMs[PERSIST_AIRTIME_BUCKETS];    // Newest bucket first
+    int sensorCount;
+    SensorData sensors[MAX_SENSORS];                // Slot by slot
+};
+
+// Where persistLoadRuntime() found its data
+enum PersistSource {
+    PERSIST_NONE,       // Nothing saved, a cold start
+    PERSIST_NVS,        // After power loss: airtime only
+    PERSIST_RTC         // After a reset: everything
+};
+
+// Open the NVS namespace, before any other call
+void persistBegin();
+
+/*
+ * Load the state saved before the last reset. From RTC memory, times are
+ * moved into this boot's millis() by how long the reset took (the system
+ * time keeps running through it); if that is unknown or longer than
+ * PERSIST_MAX_DOWNTIME_MS, the sensor table is left empty. From NVS only
+ * the airtime sum is known and is counted as used in the newest bucket.
+ */
+PersistSource persistLoadRuntime(PersistedRuntime& runtime);
+
+/*
+ * Save the state to RTC memory (a copy and a CRC, cheap enough for every
+ * packet). The airtime sum also goes to NVS when it changed, at most once
+ * per PERSIST_NVS_INTERVAL_MS.
+ */
+void persistSaveRuntime(const PersistedRuntime& runtime);
+
+// Load the learned addresses (RTC memory, else NVS), false if there are none
+bool persistLoadNodes(PersistedNodes& nodes);
+
+// Save the learned addresses; NVS is only written when the set changed
+void persistSaveNodes(const PersistedNodes& nodes);
+
+#endif // PERSIST_H
@@ -0,0 +1,52 @@
+#ifndef RADIO_H
+#define RADIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+#include "packet_schema.h"
+
+// ============================================================================
+// LoRa radio interface, implemented by one backend selected with LORA_RADIO
+// ============================================================================
+
+#define LORA_RADIO_SX127X       0       // sandeepmistry/LoRa, SX1276/78 register map
+#define LORA_RADIO_SX126X       1       // Native SX1261/62 command interface (WIO-SX1262)
+
+// Called in ISR context when a send, a channel scan or a reception has
+// finished, must only wake a task
+typedef void (*RadioIrqHandler)();
+
+/*
+ * Reset and configure the radio for `profile` at txPower dBm (pins,
+ * frequency and sync word from the LORA_* settings in config.h) and leave
+ * it in standby. SPI must already be started. Returns false if the chip
+ * does not respond.
+ */
+bool radioBegin(RadioIrqHandler irq, const LoRaProfile& profile, int8_t txPower);
+
+// Change the output power (dBm) between packets, e.g. for ADR
+void radioSetTxPower(int8_t dbm);
+
+// Start sending a packet and return at once, completion raises irq
+bool radioStartTransmit(const uint8_t* data, size_t length);
+
+// After irq (or a timeout): clear the interrupt and go back to standby
+void radioEndTransmit();
+
+// Start listening and return at once, a received packet raises irq
+bool radioStartReceive();
+
+// After irq: copy the packet out, returns its length or -1 (none, bad CRC)
+int radioReadPacket(uint8_t* buffer, size_t capacity);
+
+// Stop listening (after a packet or when the window is over), back to standby
+void radioEndReceive();
+
+// Start channel activity detection (a few symbols), completion raises irq
+bool radioStartChannelScan();
+
+// After irq (or a timeout): true if a LoRa preamble was detected, back to standby
+bool radioEndChannelScan();
+
+#endif // RADIO_H
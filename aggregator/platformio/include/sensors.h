@@ -0,0 +1,112 @@
+#ifndef SENSORS_H
+#define SENSORS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "config.h"
+
+// ============================================================================
+// Sensor readings: advertisement parsing and the shared sensor cache
+// ============================================================================
+
+struct SensorData {
+    uint8_t machineId;
+    uint8_t machineType;        // 1 = washer, 2 = dryer (0 = not sent, protocol v1)
+    uint16_t rmsX100;           // RMS acceleration × 100
+    uint16_t meanX100;          // Mean acceleration magnitude × 100 (protocol v2)
+    uint16_t freqX10;           // Dominant frequency × 10
+    uint8_t batteryPercent;
+    uint8_t flags;
+    uint32_t lastSeenMs;
+    uint32_t wakeStartMs;       // First advertisement of the current wake burst
+    uint32_t wakePeriodMs;      // Learned wake interval, 0 until known
+    bool valid;
+};
+
+/*
+ * One cache slot, shared between the BLE callback (the only writer) and
+ * the TX task (reader). `data` is protected by a seqlock: the writer makes
+ * `seq` odd while it updates the slot, readers copy the data and retry if
+ * `seq` was odd or changed meanwhile. The writer never waits on a reader.
+ */
+struct SensorSlot {
+    std::atomic<uint32_t> seq;
+    SensorData data;
+
+    // Dedup state, only touched by the writer
+    uint32_t payloadHash;       // Hash of the last forwarded reading
+    uint32_t lastForwardMs;     // When that reading was forwarded
+};
+
+// Store data from up to MAX_SENSORS sensors. Slots are handed out in order,
+// so slots [0, sensorCount) form the dense list readers walk.
+extern SensorSlot sensorCache[MAX_SENSORS];
+extern std::atomic<int> sensorCount;    // Slots in use so far (high-water mark)
+
+#define SLOT_NONE       0xFF
+
+// Parsed reading handed from the BLE callback to the TX task
+struct SensorReading {
+    uint8_t machineId;
+    uint8_t machineType;
+    uint16_t rmsX100;
+    uint16_t meanX100;
+    uint16_t freqX10;
+    uint8_t batteryPercent;
+    uint8_t flags;
+    uint8_t slot;               // sensorCache slot, set by updateSensorCache()
+    uint32_t receivedMs;        // BLE receive time, sent as age
+};
+
+// Reading flags: bit 0 comes from the sensor, bits 1-2 carry the edge state
+#define READING_FLAG_LOW_BATTERY    0x01
+#define READING_FLAG_EDGE_KNOWN     0x02    // Bit 2 is the classified state
+#define READING_FLAG_EDGE_RUNNING   0x04
+#define READING_FLAGS_EDGE          (READING_FLAG_EDGE_KNOWN | READING_FLAG_EDGE_RUNNING)
+
+// Result of storing a reading in the cache
+enum CacheUpdate {
+    CACHE_NEW,          // Stored, worth forwarding
+    CACHE_REPEAT,       // Stored, same payload as forwarded inside DEDUP_HOLDOFF_MS
+    CACHE_FULL          // Not stored, no free slot
+};
+
+// Empty all slots (before the BLE scan starts)
+void resetSensorCache();
+
+// Refill slots [0, count) from a saved copy (before the BLE scan starts).
+// Dedup state is not kept: the next reading of each machine is forwarded.
+void restoreSensorCache(const SensorData* slots, int count);
+
+// Consistent copy of a slot, never observes a half-written entry
+SensorData readSensorSlot(const SensorSlot& slot);
+
+// How long a node may stay silent before it counts as offline
+uint32_t sensorExpiryMs(const SensorData& data);
+
+// Parse our manufacturer data out of a raw advertisement payload
+// (receivedMs and slot are left to the caller)
+bool parseSensorAdvertisement(const uint8_t* payload, size_t length, SensorReading& out);
+
+/*
+ * Store a reading received at `now`, set its slot and decide whether it is
+ * worth forwarding. Must only be called from one task (the BLE callback).
+ */
+CacheUpdate updateSensorCache(SensorReading& reading, uint32_t now);
+
+// Forget every machine's classified state
+void resetEdgeClassifiers();
+
+/*
+ * Feed a reading to its machine's running/stopped classifier (see
+ * EDGE_RUN_RMS_X100) and set the reading's edge flags. Returns true if the
+ * machine changed state; the first reading of a machine only sets it.
+ * Must only be called from one task (the TX task), like setEdgeFlags().
+ */
+bool classifyReading(SensorReading& reading);
+
+// Set the edge flags of a reading built from the cache
+void setEdgeFlags(SensorReading& reading);
+
+#endif // SENSORS_H
@@ -0,0 +1,39 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+#include "packet_schema.h"
+
+// ============================================================================
+// Runtime settings: config.h defaults, overridden by downlink commands
+// ============================================================================
+
+struct Settings {
+    uint8_t aggregatorId;
+    uint8_t forwardMode;            // FORWARD_MODE_*
+    uint32_t forwardIntervalMs;
+    uint8_t spreadingFactor;
+    int8_t txPower;                 // dBm
+    uint8_t commandId;              // Last command applied, 0 = none
+};
+
+// In effect since boot (restart settings stay at their boot value)
+extern Settings settings;
+
+// Modulation in use: LORA_PROFILE with settings.spreadingFactor
+extern LoRaProfile loraProfile;
+
+// Load the stored settings (NVS), config.h defaults if there are none
+void settingsBegin();
+
+/*
+ * Store a SETTINGS value from command commandId and, unless it only takes
+ * effect after a restart, put it in effect. The command ID is remembered
+ * even if the value is rejected (false: unknown setting or out of range),
+ * so a repeated command is not applied again.
+ */
+bool settingsApply(uint8_t setting, uint32_t value, uint8_t commandId);
+
+#endif // SETTINGS_H
@@ -0,0 +1,191 @@
+"""
+Generate the Python side of the LoRa packet schema
+
+Reads the packet types and record layouts from include/packet_schema.h and
+the modulation from include/config.h, and writes one module with the
+decoder tables for the server and the WiFi bridge. Runs before every
+PlatformIO build (extra_scripts) and can be run by hand:
+
+    python scripts/gen_packet_schema.py
+"""
+
+import os
+import re
+
+try:
+    Import("env")  # noqa: F821 (PlatformIO runs this as an SCons script)
+    PROJECT_DIR = env.subst("$PROJECT_DIR")  # noqa: F821
+except NameError:
+    PROJECT_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SCHEMA_HEADER = os.path.join(PROJECT_DIR, "include", "packet_schema.h")
+CONFIG_HEADER = os.path.join(PROJECT_DIR, "include", "config.h")
+OUTPUTS = (
+    os.path.join(PROJECT_DIR, "..", "..", "server", "code", "packet_schema.py"),
+    os.path.join(PROJECT_DIR, "..", "..", "wifi_bridge", "circuitpython", "lib", "packet_schema.py"),
+)
+
+# X-macro table name -> Python name of the generated layout
+LAYOUTS = (
+    ("MACHINE_RECORD_V1_FIELDS", "MACHINE_RECORD_V1"),
+    ("MACHINE_RECORD_V2_FIELDS", "MACHINE_RECORD_V2"),
+    ("DELTA_RECORD_V1_FIELDS", "DELTA_RECORD_V1"),
+    ("DELTA_RECORD_V2_FIELDS", "DELTA_RECORD_V2"),
+    ("OFFLINE_RECORD_FIELDS", "OFFLINE_RECORD"),
+    ("RELAY_GROUP_FIELDS", "RELAY_GROUP"),
+    ("TELEMETRY_FIELDS", "TELEMETRY"),
+    ("ACK_FIELDS", "ACK"),
+    ("COMMAND_FIELDS", "COMMAND"),
+    ("OTA_BEGIN_FIELDS", "OTA_BEGIN"),
+    ("OTA_CHUNK_FIELDS", "OTA_CHUNK"),
+    ("OTA_REQUEST_FIELDS", "OTA_REQUEST"),
+)
+
+RADIO_SETTINGS = (
+    "LORA_FREQUENCY", "LORA_BANDWIDTH", "LORA_SPREADING_FACTOR",
+    "LORA_CODING_RATE", "LORA_PREAMBLE_LENGTH", "LORA_SYNC_WORD",
+)
+
+HELPERS = '''
+
+def layout_len(layout):
+    """Bytes of one record"""
+    return sum(bits for _, bits in layout) // 8
+
+
+def unpack_record(layout, data, offset=0):
+    """Fields of the record at offset, as a dict"""
+    value = int.from_bytes(bytes(data[offset:offset + layout_len(layout)]), "little")
+    fields = {}
+    for name, bits in layout:
+        fields[name] = value & ((1 << bits) - 1)
+        value >>= bits
+    return fields
+
+
+def pack_record(layout, fields):
+    """Bytes of one record, missing fields are 0"""
+    value = 0
+    shift = 0
+    for name, bits in layout:
+        value |= (fields.get(name, 0) & ((1 << bits) - 1)) << shift
+        shift += bits
+    return value.to_bytes(shift // 8, "little")
+
+
+MACHINE_RECORD = {1: MACHINE_RECORD_V1, 2: MACHINE_RECORD_V2}
+DELTA_RECORD = {1: DELTA_RECORD_V1, 2: DELTA_RECORD_V2}
+# *_LEN: bytes of one record (or body); *_PACKET_LEN: whole packet with
+# header and CRC, like *_PACKET_SIZE in packet_schema.h
+MACHINE_RECORD_LEN = {version: layout_len(layout) for version, layout in MACHINE_RECORD.items()}
+DELTA_RECORD_LEN = {version: layout_len(layout) for version, layout in DELTA_RECORD.items()}
+OFFLINE_RECORD_LEN = layout_len(OFFLINE_RECORD)
+RELAY_GROUP_LEN = layout_len(RELAY_GROUP)
+TELEMETRY_LEN = layout_len(TELEMETRY)
+ACK_LEN = layout_len(ACK)
+COMMAND_LEN = layout_len(COMMAND)
+OTA_BEGIN_LEN = layout_len(OTA_BEGIN)
+OTA_REQUEST_LEN = layout_len(OTA_REQUEST)
+TELEMETRY_PACKET_LEN = TYPED_HEADER_LEN + TELEMETRY_LEN + CRC_LEN
+ACK_PACKET_LEN = TYPED_HEADER_LEN + ACK_LEN + CRC_LEN
+COMMAND_PACKET_LEN = TYPED_HEADER_LEN + COMMAND_LEN + CRC_LEN
+OTA_BEGIN_PACKET_LEN = TYPED_HEADER_LEN + OTA_BEGIN_LEN + CRC_LEN
+OTA_REQUEST_PACKET_LEN = TYPED_HEADER_LEN + OTA_REQUEST_LEN + CRC_LEN
+OTA_CHUNK_DATA_MAX = LORA_MAX_PAYLOAD - TYPED_HEADER_LEN - layout_len(OTA_CHUNK) - CRC_LEN
+
+# Bridge -> aggregator packets; heard on the air they come from a relay
+# acknowledging its sources (or another bridge), byte 1 is the receiver
+DOWNLINK_PACKET_TYPES = (PACKET_TYPE_ACK, PACKET_TYPE_COMMAND, PACKET_TYPE_OTA_BEGIN, PACKET_TYPE_OTA_CHUNK)
+'''
+
+
+def snake_case(name):
+    return re.sub(r"(?<!^)(?=[A-Z])", "_", name).lower()
+
+
+def x_macro_tables(source):
+    """#define NAME(X) tables -> list of X(...) argument tuples"""
+    tables = {}
+    for match in re.finditer(r"#define (\w+)\(X\)((?:[^\n]*\\\n)*[^\n]*)", source):
+        body = re.sub(r"/\*.*?\*/", "", match.group(2))
+        tables[match.group(1)] = [
+            tuple(arg.strip() for arg in args.split(","))
+            for args in re.findall(r"X\(([^)]*)\)", body)
+        ]
+    return tables
+
+
+def defines(source):
+    return dict(re.findall(r"^#define\s+(\w+)\s+([^\s/]+)", source, re.MULTILINE))
+
+
+def generate():
+    with open(SCHEMA_HEADER, encoding="utf-8") as f:
+        schema = f.read()
+    with open(CONFIG_HEADER, encoding="utf-8") as f:
+        config = defines(f.read())
+    tables = x_macro_tables(schema)
+    constants = defines(schema)
+
+    lines = [
+        '"""',
+        "LoRa packet schema, generated from aggregator/platformio/include/packet_schema.h",
+        "and config.h by aggregator/platformio/scripts/gen_packet_schema.py. Do not edit.",
+        '"""',
+        "",
+    ]
+    for name, code, _ in tables["PACKET_TYPES"]:
+        lines.append(f"PACKET_TYPE_{name} = {code}")
+    lines.append("PACKET_TYPE_MIN = 0x%02X" % min(int(code, 0) for _, code, _ in tables["PACKET_TYPES"]))
+    lines += [
+        "",
+        "# Body bytes before the records, the last of them is the record count",
+        "PACKET_PREFIX_LEN = {",
+    ]
+    for name, _, prefix in tables["PACKET_TYPES"]:
+        lines.append(f"    PACKET_TYPE_{name}: {prefix},")
+    lines += [
+        "}",
+        "",
+        f"TYPED_HEADER_LEN = {constants['TYPED_HEADER_SIZE']}",
+        f"CRC_LEN = {constants['PACKET_CRC_SIZE']}",
+        f"RECORD_V2_FLAG = {constants['RECORD_V2_FLAG']}",
+        f"LORA_MAX_PAYLOAD = {constants['LORA_MAX_PAYLOAD']}",
+        f"ACK_CLOCK_UNKNOWN = {constants['ACK_CLOCK_UNKNOWN']}",
+        "",
+        "# Record layouts: (field, bits), least significant bit first, little-endian",
+    ]
+    for table, layout in LAYOUTS:
+        lines.append(f"{layout} = (")
+        for field, bits in tables[table]:
+            lines.append(f'    ("{snake_case(field)}", {bits}),')
+        lines.append(")")
+    lines += ["", "# Downlink command settings and their accepted ranges"]
+    for name, code, _, _ in tables["SETTINGS"]:
+        lines.append(f"SETTING_{name} = {code}")
+    lines.append("SETTING_RANGES = {")
+    for name, _, low, high in tables["SETTINGS"]:
+        lines.append(f"    SETTING_{name}: ({config.get(low, low)}, {config.get(high, high)}),")
+    lines += ["}", "", "# Firmware update states in OTA_REQUEST packets"]
+    for name, code in tables["OTA_STATUSES"]:
+        lines.append(f"OTA_STATUS_{name} = {code}")
+    lines += ["", "# LoRa modulation (config.h)"]
+    for setting in RADIO_SETTINGS:
+        lines.append(f"{setting} = {config[setting]}")
+
+    return "\n".join(lines) + "\n" + HELPERS
+
+
+def write_outputs():
+    module = generate()
+    for path in OUTPUTS:
+        path = os.path.normpath(path)
+        if os.path.exists(path):
+            with open(path, encoding="utf-8") as f:
+                if f.read() == module:
+                    continue
+        with open(path, "w", encoding="utf-8") as f:
+            f.write(module)
+        print(f"Generated {path}")
+
+
+write_outputs()
@@ -0,0 +1,109 @@
+/*
+ * Deferred log ring buffer (see log.h)
+ *
+ * Bounded multi-producer ring, one consumer (loop()). Each slot carries a
+ * sequence number: a producer claims position p with a CAS on writeIndex
+ * when slot.seq == p, fills it and publishes seq = p + 1; the consumer
+ * takes it if seq == p + 1 and frees it for the next lap with
+ * seq = p + LOG_RING_SIZE. Producers on either core never wait on the
+ * consumer or each other.
+ */
+
+#include "log.h"
+
+#include <Arduino.h>
+#include <atomic>
+
+#define LOG_RING_MASK   (LOG_RING_SIZE - 1)
+
+static_assert((LOG_RING_SIZE & LOG_RING_MASK) == 0, "LOG_RING_SIZE must be a power of two");
+
+struct LogRecord {
+    const char* format;
+    uint32_t timestampMs;
+    uint32_t args[LOG_MAX_ARGS];
+    uint8_t level;
+};
+
+struct LogSlot {
+    std::atomic<uint32_t> seq;
+    LogRecord record;
+};
+
+static LogSlot logRing[LOG_RING_SIZE];
+static std::atomic<uint32_t> logWriteIndex(0);
+static uint32_t logReadIndex = 0;               // Consumer only
+static std::atomic<uint32_t> logDropped(0);
+static bool logRingReady = false;
+static LogPendingHandler logPending = nullptr;
+
+void logBegin(LogPendingHandler pending) {
+    logPending = pending;
+    for (uint32_t i = 0; i < LOG_RING_SIZE; i++) {
+        logRing[i].seq.store(i, std::memory_order_relaxed);
+    }
+    logRingReady = true;
+}
+
+void logPush(uint8_t level, const char* format, const uint32_t* args, uint8_t argCount) {
+    if (!logRingReady) {
+        return;
+    }
+
+    uint32_t pos = logWriteIndex.load(std::memory_order_relaxed);
+    LogSlot* slot;
+    for (;;) {
+        slot = &logRing[pos & LOG_RING_MASK];
+        int32_t diff = (int32_t)(slot->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (logWriteIndex.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            logDropped.fetch_add(1, std::memory_order_relaxed);  // Full
+            return;
+        } else {
+            pos = logWriteIndex.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->record.format = format;
+    slot->record.timestampMs = millis();
+    slot->record.level = level;
+    for (int i = 0; i < LOG_MAX_ARGS; i++) {
+        slot->record.args[i] = i < argCount ? args[i] : 0;
+    }
+    slot->seq.store(pos + 1, std::memory_order_release);
+
+    if (logPending != nullptr) {
+        logPending();
+    }
+}
+
+int logDrain(int maxRecords) {
+    static const char levelTags[] = {'-', 'E', 'W', 'I', 'D'};
+
+    uint32_t dropped = logDropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+        Serial.printf("[%8u] W: %u log records dropped\n", (unsigned)millis(), (unsigned)dropped);
+    }
+
+    int printed = 0;
+    while (printed < maxRecords) {
+        LogSlot& slot = logRing[logReadIndex & LOG_RING_MASK];
+        if (slot.seq.load(std::memory_order_acquire) != logReadIndex + 1) {
+            break;  // Empty, or the producer has not published yet
+        }
+
+        LogRecord record = slot.record;
+        slot.seq.store(logReadIndex + LOG_RING_SIZE, std::memory_order_release);
+        logReadIndex++;
+
+        Serial.printf("[%8u] %c: ", (unsigned)record.timestampMs, levelTags[record.level]);
+        Serial.printf(record.format, record.args[0], record.args[1], record.args[2],
+                      record.args[3], record.args[4], record.args[5]);
+        Serial.println();
+        printed++;
+    }
+    return printed;
+}
@@ -12,277 +12,2151 @@
 #include <Arduino.h>
 #include <NimBLEDevice.h>
 #include <SPI.h>
-#include <LoRa.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+#include <atomic>
 #include "config.h"
+#include "radio.h"
+#include "log.h"
+#include "ota.h"
+#include "packets.h"
+#include "persist.h"
+#include "sensors.h"
+#include "settings.h"
 
-// CRC-32 calculation
-uint32_t crc32(const uint8_t* data, size_t length) {
-    uint32_t crc = 0xFFFFFFFF;
-    for (size_t i = 0; i < length; i++) {
-        crc ^= data[i];
-        for (int j = 0; j < 8; j++) {
-            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+#if POWER_LIGHT_SLEEP
+#include <driver/gpio.h>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#endif
+
+// ============================================================================
+// Data Structures
+// ============================================================================
+
+// How the TX task turns readings into LoRa packets (see FORWARD_MODE in config.h)
+enum ForwardMode {
+    FORWARD_IMMEDIATE = FORWARD_MODE_IMMEDIATE,
+    FORWARD_BATCHED = FORWARD_MODE_BATCHED,
+    FORWARD_INTERVAL = FORWARD_MODE_INTERVAL,
+    FORWARD_EVENTS = FORWARD_MODE_EVENTS
+};
+
+// Bounded queue between BLE callback (producer) and TX task (consumer).
+// The callback never waits on it: when full, the reading is dropped.
+QueueHandle_t txQueue = nullptr;
+TaskHandle_t txTaskHandle = nullptr;
+volatile uint32_t txQueueDrops = 0;
+
+// ============================================================================
+// Telemetry Counters
+// ============================================================================
+
+/*
+ * Log2 histogram of durations in µs: bucket i counts [2^i, 2^(i+1)).
+ * Single writer; readers may see a sample half added, fine for telemetry.
+ */
+#define LATENCY_BUCKETS     16
+
+struct LatencyHistogram {
+    volatile uint32_t buckets[LATENCY_BUCKETS];
+    volatile uint32_t maxUs;
+    
+    void add(uint32_t us) {
+        int bucket = us == 0 ? 0 : 31 - __builtin_clz(us);
+        buckets[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+        if (us > maxUs) {
+            maxUs = us;
+        }
+    }
+    
+    // Upper bound of the bucket holding the given percentile (0 if empty)
+    uint32_t percentileUs(uint32_t percent) const {
+        uint32_t total = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            total += buckets[i];
+        }
+        if (total == 0) {
+            return 0;
+        }
+        
+        uint32_t rank = (total * percent + 99) / 100;
+        uint32_t seen = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            seen += buckets[i];
+            if (seen >= rank) {
+                return ((uint32_t)2 << i) - 1;
+            }
+        }
+        return maxUs;
+    }
+};
+
+// Cumulative since boot. Each counter has a single writer (noted below),
+// 32-bit stores are atomic on the ESP32 so readers never see torn values.
+struct Telemetry {
+    // BLE callback
+    volatile uint32_t advertisementsSeen;
+    volatile uint32_t advertisementsMatched;
+    volatile uint32_t cacheFullDrops;
+    volatile uint32_t dedupHits;
+    volatile uint32_t txQueueHighWater;
+    LatencyHistogram callbackLatency;
+    
+    // TX task
+    volatile uint32_t packetsSent;
+    volatile uint32_t airtimeTotalMs;
+    volatile uint32_t missedScanWindows;
+    volatile uint32_t missedDueWindows;
+    volatile uint32_t relayedRecords;
+    volatile uint32_t relayMerged;
+};
+
+Telemetry telemetry = {};
+
+// ============================================================================
+// BLE Scan Callback
+// ============================================================================
+
+#if BLE_FILTER_MODE == BLE_FILTER_WHITELIST
+// Sensor node addresses learned by the callback, added to the controller
+// whitelist from loop() (the whitelist can only change while not scanning)
+QueueHandle_t learnQueue = nullptr;
+volatile bool whitelistOverflow = false;   // More nodes than BLE_WHITELIST_MAX
+#endif
+
+class WashingMachineScanCallbacks : public NimBLEScanCallbacks {
+    #if BLE_FILTER_MODE == BLE_FILTER_WHITELIST
+    // Addresses already handed to loop(), only touched by the NimBLE task
+    NodeAddress knownAddresses[BLE_WHITELIST_MAX];
+    int knownAddressCount = 0;
+    
+    void learnAddress(const NimBLEAddress& address) {
+        const uint8_t* addr = address.getVal();
+        for (int i = 0; i < knownAddressCount; i++) {
+            if (memcmp(knownAddresses[i].addr, addr, 6) == 0) {
+                return;
+            }
+        }
+        if (knownAddressCount >= BLE_WHITELIST_MAX) {
+            whitelistOverflow = true;
+            return;
+        }
+        
+        NodeAddress& learned = knownAddresses[knownAddressCount++];
+        memcpy(learned.addr, addr, 6);
+        learned.type = address.getType();
+        xQueueSend(learnQueue, &learned, 0);
+    }
+    #endif
+    
+    
+    void onResult(const NimBLEAdvertisedDevice* advertisedDevice) override {
+        uint32_t startUs = micros();
+        telemetry.advertisementsSeen++;
+        handleAdvertisement(advertisedDevice);
+        telemetry.callbackLatency.add(micros() - startUs);
+    }
+    
+    void handleAdvertisement(const NimBLEAdvertisedDevice* advertisedDevice) {
+        // Parse straight from the raw advertisement (no heap allocation)
+        const std::vector<uint8_t>& payload = advertisedDevice->getPayload();
+        SensorReading reading;
+        if (!parseSensorAdvertisement(payload.data(), payload.size(), reading)) {
+            return;
+        }
+        reading.receivedMs = millis();
+        telemetry.advertisementsMatched++;
+        
+        #if BLE_FILTER_MODE == BLE_FILTER_WHITELIST
+        learnAddress(advertisedDevice->getAddress());
+        #endif
+        
+        LOG_DEBUG("Received from Machine %d: RMS=%u.%02u m/s², Freq=%u.%u Hz, Batt=%d%%",
+                  reading.machineId,
+                  reading.rmsX100 / 100, reading.rmsX100 % 100,
+                  reading.freqX10 / 10, reading.freqX10 % 10,
+                  reading.batteryPercent);
+        
+        // Update sensor cache; repeated copies of the same reading stop here
+        CacheUpdate update = updateSensorCache(reading, reading.receivedMs);
+        if (update == CACHE_FULL) {
+            telemetry.cacheFullDrops++;
+            LOG_WARN("Sensor cache full, machine %d not stored", reading.machineId);
+            return;
+        }
+        if (update == CACHE_REPEAT) {
+            telemetry.dedupHits++;
+            return;
+        }
+        
+        // Hand new readings to the TX task, never block here
+        if (xQueueSend(txQueue, &reading, 0) != pdTRUE) {
+            txQueueDrops++;
+            LOG_WARN("TX queue full, reading of machine %d dropped", reading.machineId);
+            return;
+        }
+        
+        uint32_t depth = uxQueueMessagesWaiting(txQueue);
+        if (depth > telemetry.txQueueHighWater) {
+            telemetry.txQueueHighWater = depth;
+        }
+    }
+    
+};
+
+// ============================================================================
+// BLE/LoRa Coexistence
+// ============================================================================
+
+/*
+ * The scan is driven from loop() (phases, adaptive window) and, around
+ * each LoRa send, from the TX task. scanLock serializes the two; while a
+ * send holds the scan paused, loop() only updates its parameters and the
+ * resume starts it with them.
+ */
+NimBLEScan* pBLEScan = nullptr;
+SemaphoreHandle_t scanLock = nullptr;
+bool scanRunning = false;           // Started in setup(), under scanLock
+bool scanYielded = false;           // Paused or narrowed for a LoRa send
+uint32_t scanYieldedMs = 0;
+volatile bool scanWide = false;     // Set by the adaptive scan window: a node's burst is due
+
+// Window the scan runs with outside LoRa sends
+uint32_t scanWindowMs() {
+    #if SCAN_ADAPTIVE
+    return scanWide ? BLE_SCAN_WINDOW_MS : SCAN_NARROW_WINDOW_MS;
+    #else
+    return BLE_SCAN_WINDOW_MS;
+    #endif
+}
+
+// (Re)start the scan so that new parameters take effect, unless a send
+// holds it paused (caller holds scanLock)
+void scanStartLocked() {
+    pBLEScan->stop();
+    if (!scanYielded || COEX_TX_SCAN == COEX_SCAN_NARROW) {
+        pBLEScan->start(BLE_SCAN_DURATION_SEC, false);
+    }
+}
+
+// Give the 2.4 GHz side up for a LoRa send (TX task)
+void scanYieldForTx() {
+    #if COEX_TX_SCAN != COEX_SCAN_KEEP
+    xSemaphoreTake(scanLock, portMAX_DELAY);
+    if (scanRunning) {
+        scanYielded = true;
+        scanYieldedMs = millis();
+        #if COEX_TX_SCAN == COEX_SCAN_NARROW
+        pBLEScan->setWindow(SCAN_NARROW_WINDOW_MS);
+        #endif
+        scanStartLocked();
+    }
+    xSemaphoreGive(scanLock);
+    #endif
+}
+
+// Send done: scan again right away and count the windows given up
+void scanResumeAfterTx() {
+    #if COEX_TX_SCAN != COEX_SCAN_KEEP
+    xSemaphoreTake(scanLock, portMAX_DELAY);
+    if (scanYielded) {
+        scanYielded = false;
+        #if COEX_TX_SCAN == COEX_SCAN_NARROW
+        pBLEScan->setWindow(scanWindowMs());
+        #endif
+        scanStartLocked();
+        
+        uint32_t windows = (millis() - scanYieldedMs + BLE_SCAN_INTERVAL_MS - 1) / BLE_SCAN_INTERVAL_MS;
+        telemetry.missedScanWindows += windows;
+        if (scanWide) {
+            telemetry.missedDueWindows += windows;
+        }
+    }
+    xSemaphoreGive(scanLock);
+    #endif
+}
+
+// ============================================================================
+// LoRa Functions
+// ============================================================================
+
+/*
+ * Radio state, driven only by the TX task:
+ *   RADIO_IDLE      ready for the next packet
+ *   RADIO_TX        endPacket(true) started a send, TX done comes on DIO1
+ *   RADIO_RX        listening for a downlink (ACK window), RX done comes on DIO1
+ *   RADIO_COOLDOWN  short gap after a packet so the receiver can re-arm
+ */
+enum RadioState {
+    RADIO_IDLE,
+    RADIO_TX,
+    RADIO_RX,
+    RADIO_COOLDOWN
+};
+
+volatile RadioState radioState = RADIO_IDLE;
+uint32_t radioStateMs = 0;           // When the current state was entered
+volatile uint32_t radioTxTimeouts = 0;  // TX done interrupts that never came
+
+void setRadioState(RadioState state) {
+    radioState = state;
+    radioStateMs = millis();
+}
+
+// DIO1 TX/RX done interrupt, only wakes the TX task
+void IRAM_ATTR onLoRaIrq() {
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(txTaskHandle, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+#if ADR_ENABLED
+static_assert(ACK_EVENTS, "ADR_ENABLED needs ACK_EVENTS, the ACKs carry the link SNR");
+#endif
+
+#if LBT_ENABLED
+// xorshift32 seeded with the aggregator ID in setup(): every ID draws its own backoff sequence
+uint32_t backoffState = 0;
+
+uint32_t backoffRandom() {
+    backoffState ^= backoffState << 13;
+    backoffState ^= backoffState >> 17;
+    backoffState ^= backoffState << 5;
+    return backoffState;
+}
+
+volatile uint32_t lbtBusyScans = 0;     // Channel found busy before a send
+
+// One channel activity detection, true if no other LoRa signal was heard
+bool channelClear() {
+    ulTaskNotifyTake(pdTRUE, 0);
+    if (!radioStartChannelScan()) {
+        return true;  // Cannot tell, do not hold the packet back
+    }
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LBT_CAD_TIMEOUT_MS));
+    return !radioEndChannelScan();
+}
+#endif
+
+#if TDMA_SLOTS
+static_assert(ACK_EVENTS, "TDMA_SLOTS needs ACK_EVENTS, the ACKs carry the bridge clock");
+
+// Bridge clock relative to millis(), learned from ACKs (TX task only)
+uint32_t tdmaOffsetMs = 0;
+uint32_t tdmaSyncedMs = 0;
+bool tdmaSynced = false;
+
+// An ACK arrived just now, sent when the bridge clock read bridgeMs
+void tdmaSync(uint32_t bridgeMs, uint32_t ackAirtimeMs) {
+    uint32_t now = millis();
+    tdmaOffsetMs = bridgeMs + ackAirtimeMs - now;
+    tdmaSyncedMs = now;
+    tdmaSynced = true;
+}
+
+// Ticks until a send of airtimeMs fits in our slot, 0 if it does now (or unsynced)
+TickType_t ticksUntilTxSlot(uint32_t airtimeMs) {
+    if (!tdmaSynced || millis() - tdmaSyncedMs > TDMA_SYNC_MAX_AGE_MS) {
+        return 0;
+    }
+    const uint32_t frameMs = TDMA_SLOTS * TDMA_SLOT_MS;
+    uint32_t slotStart = ((settings.aggregatorId - 1) % TDMA_SLOTS) * TDMA_SLOT_MS + TDMA_GUARD_MS;
+    uint32_t slotLength = TDMA_SLOT_MS - 2 * TDMA_GUARD_MS;
+    // Latest start that still ends in the slot; packets (nearly) as long as
+    // the slot may start up to one guard time late and run into the guard
+    uint32_t startWindow = airtimeMs + TDMA_GUARD_MS < slotLength ? slotLength - airtimeMs : TDMA_GUARD_MS;
+    uint32_t lastStart = slotStart + startWindow;
+    
+    uint32_t position = (millis() + tdmaOffsetMs) % frameMs;
+    if (position >= slotStart && position <= lastStart) {
+        return 0;
+    }
+    return pdMS_TO_TICKS((slotStart + frameMs - position) % frameMs);
+}
+#endif
+
+// Hold a send back until our TDMA slot and a free channel (as configured)
+void waitForTxTurn(uint32_t airtimeMs) {
+    for (int tries = 1; ; tries++) {
+        #if TDMA_SLOTS
+        TickType_t slotWait = ticksUntilTxSlot(airtimeMs);
+        if (slotWait > 0) {
+            vTaskDelay(slotWait);
+        }
+        #endif
+        #if LBT_ENABLED
+        if (channelClear()) {
+            return;
         }
+        lbtBusyScans++;
+        if (tries == LBT_MAX_TRIES) {
+            LOG_WARN("LoRa channel still busy after %d scans, sending anyway", tries);
+            return;
+        }
+        uint32_t windowMs = (uint32_t)LBT_BACKOFF_MS << (tries - 1);
+        vTaskDelay(pdMS_TO_TICKS(1 + backoffRandom() % windowMs));
+        #else
+        return;
+        #endif
+    }
+}
+
+enum TxResult {
+    TX_DONE,
+    TX_TIMED_OUT,       // Was on air, the TX done interrupt never came
+    TX_NOT_STARTED      // Nothing sent
+};
+
+/*
+ * Send a packet without polling the radio: the TX task sleeps until the
+ * TX done interrupt (or a timeout of airtime + margin if it is lost), so
+ * the core stays free for loop() and the NimBLE host meanwhile. A reply
+ * skips waitForTxTurn(), its receiver only listens for a short window.
+ */
+TxResult radioTransmit(const uint8_t* packet, size_t length, uint32_t airtimeMs, bool reply = false) {
+    if (radioState == RADIO_COOLDOWN) {
+        uint32_t elapsed = millis() - radioStateMs;
+        if (elapsed < LORA_TX_COOLDOWN_MS) {
+            vTaskDelay(pdMS_TO_TICKS(LORA_TX_COOLDOWN_MS - elapsed));
+        }
+        setRadioState(RADIO_IDLE);
+    }
+    
+    if (!reply) {
+        waitForTxTurn(airtimeMs);
+    }
+    
+    scanYieldForTx();
+    ulTaskNotifyTake(pdTRUE, 0);  // Discard a late TX done from an aborted send
+    if (!radioStartTransmit(packet, length)) {
+        scanResumeAfterTx();
+        LOG_ERROR("LoRa TX could not be started");
+        return TX_NOT_STARTED;
+    }
+    setRadioState(RADIO_TX);
+    
+    bool done = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(airtimeMs + LORA_TX_TIMEOUT_MARGIN_MS)) > 0;
+    radioEndTransmit();  // Also aborts a send whose TX done never came
+    scanResumeAfterTx();
+    if (!done) {
+        radioTxTimeouts++;
+        LOG_ERROR("LoRa TX done interrupt missing, send aborted");
+    }
+    
+    setRadioState(RADIO_COOLDOWN);
+    return done ? TX_DONE : TX_TIMED_OUT;
+}
+
+/*
+ * Listen for one packet for up to windowMs, sleeping like radioTransmit().
+ * Returns its length, or -1 if nothing (valid) arrived in time.
+ */
+int radioReceive(uint8_t* buffer, size_t capacity, uint32_t windowMs) {
+    ulTaskNotifyTake(pdTRUE, 0);
+    if (!radioStartReceive()) {
+        LOG_ERROR("LoRa RX could not be started");
+        return -1;
+    }
+    setRadioState(RADIO_RX);
+    
+    int length = -1;
+    if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(windowMs)) > 0) {
+        length = radioReadPacket(buffer, capacity);
+    }
+    radioEndReceive();
+    
+    setRadioState(RADIO_COOLDOWN);  // The sender re-arms its receiver too
+    return length;
+}
+
+bool initLoRa() {
+    // Configure SPI pins
+    SPI.begin(LORA_SCK_PIN, LORA_MISO_PIN, LORA_MOSI_PIN, LORA_CS_PIN);
+    
+    // Reset and configure the radio chip (backend selected by LORA_RADIO)
+    if (!radioBegin(onLoRaIrq, loraProfile, settings.txPower)) {
+        Serial.println("LoRa init failed!");
+        return false;
+    }
+    
+    Serial.println("LoRa initialized successfully");
+    Serial.printf("  Radio: %s\n", LORA_RADIO == LORA_RADIO_SX126X ? "SX126x" : "SX127x");
+    Serial.printf("  Frequency: %.1f MHz\n", LORA_FREQUENCY);
+    Serial.printf("  SF: %d, BW: %d kHz\n", loraProfile.spreadingFactor, LORA_BANDWIDTH / 1000);
+    
+    return true;
+}
+
+// ============================================================================
+// Duty Cycle Accounting
+// ============================================================================
+
+// Sliding one-hour airtime window in one-minute buckets
+#define DUTY_CYCLE_BUCKETS      60
+#define DUTY_CYCLE_BUCKET_MS    (DUTY_CYCLE_WINDOW_MS / DUTY_CYCLE_BUCKETS)
+#define DUTY_CYCLE_BUDGET_MS    (DUTY_CYCLE_WINDOW_MS / 100 * DUTY_CYCLE_PERCENT)
+
+// Only touched by the TX task
+uint32_t airtimeBuckets[DUTY_CYCLE_BUCKETS];
+uint32_t airtimeBucketEpoch = 0;    // Index of the current bucket since boot
+
+void dutyCycleAdvance() {
+    uint32_t epoch = millis() / DUTY_CYCLE_BUCKET_MS;
+    if (epoch - airtimeBucketEpoch >= DUTY_CYCLE_BUCKETS) {
+        memset(airtimeBuckets, 0, sizeof(airtimeBuckets));
+    } else {
+        while (airtimeBucketEpoch != epoch) {
+            airtimeBucketEpoch++;
+            airtimeBuckets[airtimeBucketEpoch % DUTY_CYCLE_BUCKETS] = 0;
+        }
+    }
+    airtimeBucketEpoch = epoch;
+}
+
+uint32_t dutyCycleUsedMs() {
+    dutyCycleAdvance();
+    uint32_t used = 0;
+    for (int i = 0; i < DUTY_CYCLE_BUCKETS; i++) {
+        used += airtimeBuckets[i];
+    }
+    return used;
+}
+
+bool dutyCycleAllows(uint32_t airtimeMs) {
+    return dutyCycleUsedMs() + airtimeMs <= DUTY_CYCLE_BUDGET_MS;
+}
+
+void dutyCycleRecord(uint32_t airtimeMs) {
+    dutyCycleAdvance();
+    airtimeBuckets[airtimeBucketEpoch % DUTY_CYCLE_BUCKETS] += airtimeMs;
+}
+
+#if PERSIST_ENABLED
+static_assert(PERSIST_AIRTIME_BUCKETS == DUTY_CYCLE_BUCKETS, "Saved airtime must match the window");
+
+// Buckets newest first, independent of this boot's epoch
+void dutyCycleExport(uint32_t* newestFirst) {
+    dutyCycleAdvance();
+    for (int k = 0; k < DUTY_CYCLE_BUCKETS; k++) {
+        newestFirst[k] = airtimeBuckets[(airtimeBucketEpoch + DUTY_CYCLE_BUCKETS - k) % DUTY_CYCLE_BUCKETS];
+    }
+}
+
+void dutyCycleImport(const uint32_t* newestFirst) {
+    airtimeBucketEpoch = millis() / DUTY_CYCLE_BUCKET_MS;
+    for (int k = 0; k < DUTY_CYCLE_BUCKETS; k++) {
+        airtimeBuckets[(airtimeBucketEpoch + DUTY_CYCLE_BUCKETS - k) % DUTY_CYCLE_BUCKETS] = newestFirst[k];
+    }
+}
+
+// ============================================================================
+// Warm Start
+// ============================================================================
+
+// Too big for the TX task's stack; setup() uses it before the task starts
+PersistedRuntime persistScratch;
+bool warmStart = false;             // Sensor table restored, report it right away
+
+// TX task: copy the state a reset would lose to RTC memory
+void persistRuntime() {
+    persistScratch.packetSequence = packetSequence;
+    dutyCycleExport(persistScratch.airtimeMs);
+    int count = sensorCount.load(std::memory_order_acquire);
+    for (int i = 0; i < count; i++) {
+        persistScratch.sensors[i] = readSensorSlot(sensorCache[i]);
+    }
+    persistScratch.sensorCount = count;
+    persistSaveRuntime(persistScratch);
+}
+#endif
+
+/*
+ * Transmit a finished packet if the duty-cycle budget allows it.
+ * Returns false (nothing sent) when it would exceed the budget or the
+ * radio did not start the send.
+ */
+bool transmitLoRaPacket(const uint8_t* packet, size_t length) {
+    uint32_t airtimeMs = loraTimeOnAirMs(length, loraProfile);
+    if (!dutyCycleAllows(airtimeMs)) {
+        LOG_WARN("Duty cycle budget exhausted (%u/%u ms), packet dropped",
+                 dutyCycleUsedMs(), DUTY_CYCLE_BUDGET_MS);
+        return false;
+    }
+    
+    if (radioTransmit(packet, length, airtimeMs) == TX_NOT_STARTED) {
+        return false;
+    }
+    dutyCycleRecord(airtimeMs);  // Counted even if timed out, the radio was on air
+    packetSequence++;            // Held back packets don't show up as lost
+    telemetry.packetsSent++;
+    telemetry.airtimeTotalMs += airtimeMs;
+    #if PERSIST_ENABLED
+    persistRuntime();            // A reset must not reuse this sequence number
+    #endif
+    return true;
+}
+
+// Airtime of the last aggregated round (all packets), used to pace coalesced sends
+uint32_t lastAggregatedAirtimeMs = 0;
+
+// ============================================================================
+// Downlink
+// ============================================================================
+
+#if DOWNLINK_COMMANDS
+static_assert(TELEMETRY_ENABLED, "DOWNLINK_COMMANDS needs TELEMETRY_ENABLED, telemetry confirms commands");
+
+/*
+ * Commands and update starts from the bridge (see packet_schema.h). They
+ * arrive in the RX windows after telemetry and events packets and are
+ * only stored there; the TX task applies them between sends.
+ */
+CommandRecord pendingCommand;
+bool commandPending = false;
+#if OTA_ENABLED
+OtaBeginRecord pendingOtaBegin;
+bool otaBeginPending = false;
+#endif
+
+// Keep a command or update start for the TX task, false for other packets
+bool storeDownlink(const uint8_t* packet, int length) {
+    PacketReader reader(packet, length, TYPED_HEADER_SIZE);
+    if (packet[0] == PACKET_TYPE_COMMAND && length == (int)COMMAND_PACKET_SIZE) {
+        readRecord(reader, pendingCommand);
+        commandPending = true;
+        return true;
+    }
+    #if OTA_ENABLED
+    if (packet[0] == PACKET_TYPE_OTA_BEGIN && length == (int)OTA_BEGIN_PACKET_SIZE) {
+        readRecord(reader, pendingOtaBegin);
+        otaBeginPending = true;
+        return true;
+    }
+    #endif
+    return false;
+}
+#endif
+
+// The CRC-32 closing a received packet of at least typedPacketSize(0) bytes matches
+bool packetCrcValid(const uint8_t* packet, int length) {
+    PacketReader crc(packet, length, length - PACKET_CRC_SIZE);
+    return crc.bits(32) == crc32(packet, length - PACKET_CRC_SIZE);
+}
+
+#if ACK_EVENTS || DOWNLINK_COMMANDS
+/*
+ * Listen out an RX window of windowMs for downlinks to this aggregator
+ * (valid CRC, our ID). Returns the length of the first packet of type
+ * `awaited`, or -1 if none came. Commands on the way are stored; with
+ * awaited 0 the first of them ends the window.
+ */
+int receiveDownlink(uint8_t* packet, uint8_t awaited, uint32_t windowMs) {
+    uint32_t windowStart = millis();
+    for (;;) {
+        uint32_t elapsed = millis() - windowStart;
+        if (elapsed >= windowMs) {
+            return -1;
+        }
+        
+        int length = radioReceive(packet, LORA_MAX_PAYLOAD, windowMs - elapsed);
+        if (length < (int)typedPacketSize(0) || packet[1] != settings.aggregatorId) {
+            continue;
+        }
+        if (!packetCrcValid(packet, length)) {
+            continue;
+        }
+        if (packet[0] == awaited) {
+            return length;
+        }
+        #if DOWNLINK_COMMANDS
+        if (storeDownlink(packet, length) && awaited == 0) {
+            return length;
+        }
+        #endif
+    }
+}
+#endif
+
+#if TELEMETRY_ENABLED
+void sendTelemetryLoRaPacket() {
+    /*
+     * Telemetry packet format (counters since boot):
+     * Bytes 0-3: Typed header (PACKET_TYPE_TELEMETRY, aggregator ID, sequence)
+     * TELEMETRY_FIELDS (packet_schema.h)
+     * Last 4 bytes: CRC-32
+     */
+    TelemetryRecord record;
+    record.uptimeS = millis() / 1000;
+    record.advertsSeen = telemetry.advertisementsSeen;
+    record.advertsMatched = telemetry.advertisementsMatched;
+    record.dedupHits = telemetry.dedupHits;
+    record.cacheFullDrops = telemetry.cacheFullDrops;
+    record.txQueueDrops = txQueueDrops;
+    record.txQueueDepth = uxQueueMessagesWaiting(txQueue);
+    record.txQueueHighWater = telemetry.txQueueHighWater;
+    record.airtimeWindowMs = dutyCycleUsedMs();
+    record.airtimeTotalMs = telemetry.airtimeTotalMs;
+    record.packetsSent = telemetry.packetsSent;
+    record.callbackP50Us = saturate16(telemetry.callbackLatency.percentileUs(50));
+    record.callbackP90Us = saturate16(telemetry.callbackLatency.percentileUs(90));
+    record.callbackP99Us = saturate16(telemetry.callbackLatency.percentileUs(99));
+    record.callbackMaxUs = saturate16(telemetry.callbackLatency.maxUs);
+    record.minFreeHeap = ESP.getMinFreeHeap();
+    record.txTimeouts = saturate16(radioTxTimeouts);
+    record.activeSensors = sensorCount.load(std::memory_order_relaxed);
+    record.commandId = settings.commandId;
+    record.missedScanWindows = telemetry.missedScanWindows;
+    record.missedDueWindows = telemetry.missedDueWindows;
+    record.relayedRecords = telemetry.relayedRecords;
+    record.relayMerged = telemetry.relayMerged;
+    record.txStackFree = saturate16(uxTaskGetStackHighWaterMark(txTaskHandle));
+    
+    uint8_t packet[TELEMETRY_PACKET_SIZE];
+    PacketWriter writer(packet, sizeof(packet));
+    writeTypedHeader(writer, PACKET_TYPE_TELEMETRY);
+    writeRecord(writer, record);
+    writer.appendCrc32();
+    
+    LOG_INFO("Sending telemetry: %u adverts, %u matched, %u packets sent",
+             telemetry.advertisementsSeen, telemetry.advertisementsMatched,
+             telemetry.packetsSent);
+    
+    if (!transmitLoRaPacket(packet, writer.length)) {
+        return;
+    }
+    #if DOWNLINK_COMMANDS
+    // The bridge's chance to send a command
+    uint8_t downlink[LORA_MAX_PAYLOAD];
+    receiveDownlink(downlink, 0, ACK_RX_WINDOW_MS);
+    #endif
+}
+#endif
+
+// ============================================================================
+// Relay
+// ============================================================================
+
+#if RELAY_ENABLED
+/*
+ * Machine records of other aggregators (RELAY_SOURCES) heard between our
+ * own sends, forwarded in RELAYED packets (see config.h). A packet is
+ * named by (source, sequence) and dropped if heard before; a record by
+ * (source, machine, sequence), a newer one replaces the buffered record.
+ * TX task only.
+ */
+#define RELAY_MAX_SOURCES       8
+#define RELAY_BITMAP_BITS       16
+
+const uint8_t relaySourceIds[] = RELAY_SOURCES;
+
+struct RelaySource {
+    uint8_t id;             // 0 = unused slot
+    uint16_t latestSeq;
+    uint16_t bitmap;        // Bit i set = latestSeq - 1 - i heard
+    uint32_t heardMs;
+};
+
+RelaySource relaySources[RELAY_MAX_SOURCES];
+RelayedRecord relayBuffer[RELAY_MAX_RECORDS];
+int relayCount = 0;
+uint32_t relayOpenedMs = 0;     // When the oldest buffered record arrived
+bool relayUrgent = false;       // Events buffered, send without waiting for the round
+
+bool relaySourceWanted(uint8_t id) {
+    if (id == settings.aggregatorId) {
+        return false;
+    }
+    for (uint8_t source : relaySourceIds) {
+        if (source == 0 || source == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The source's slot, taking over the longest silent one for a new source
+RelaySource& relaySourceFor(uint8_t id, uint16_t seq) {
+    RelaySource* slot = &relaySources[0];
+    for (RelaySource& source : relaySources) {
+        if (source.id == id) {
+            return source;
+        }
+        if (source.id == 0 || (slot->id != 0 && millis() - source.heardMs > millis() - slot->heardMs)) {
+            slot = &source;
+        }
+    }
+    memset(slot, 0, sizeof(RelaySource));
+    slot->id = id;
+    slot->latestSeq = seq - 1 - RELAY_BITMAP_BITS;  // Nothing heard before seq
+    return *slot;
+}
+
+// Note a packet of the source, false if it was heard before
+bool relayTrackSequence(RelaySource& source, uint16_t seq) {
+    source.heardMs = millis();
+    uint16_t ahead = seq - source.latestSeq;
+    if (ahead == 0) {
+        return false;
+    }
+    if (ahead < 0x8000) {
+        source.bitmap = ahead > RELAY_BITMAP_BITS ? 0 : (source.bitmap << ahead) | (1 << (ahead - 1));
+        source.latestSeq = seq;
+        return true;
+    }
+    uint16_t behind = -ahead;
+    if (behind > RELAY_BITMAP_BITS) {
+        source.latestSeq = seq;  // Far behind: the source restarted its sequence
+        source.bitmap = 0;
+        return true;
+    }
+    uint16_t bit = 1 << (behind - 1);
+    if (source.bitmap & bit) {
+        return false;
+    }
+    source.bitmap |= bit;
+    return true;
+}
+
+bool relayAfter(const RelayedRecord& a, const RelayedRecord& b) {
+    if (a.sourceId != b.sourceId) {
+        return a.sourceId > b.sourceId;
+    }
+    return (int16_t)(a.sourceSeq - b.sourceSeq) > 0;
+}
+
+/*
+ * Forward the buffered records now, grouped by source packet, and empty
+ * the buffer. Returns the time on air.
+ */
+uint32_t relaySend() {
+    if (relayCount == 0) {
+        return 0;
+    }
+    // Stable insertion sort by source, then source packet: one group each
+    for (int i = 1; i < relayCount; i++) {
+        RelayedRecord relayed = relayBuffer[i];
+        int j = i;
+        for (; j > 0 && relayAfter(relayBuffer[j - 1], relayed); j--) {
+            relayBuffer[j] = relayBuffer[j - 1];
+        }
+        relayBuffer[j] = relayed;
+    }
+    
+    uint32_t airtimeMs = sendRelayedLoRaPackets(relayBuffer, relayCount, millis());
+    telemetry.relayedRecords += relayCount;
+    relayCount = 0;
+    relayUrgent = false;
+    return airtimeMs;
+}
+
+bool relayDue() {
+    return relayCount > 0 && (relayUrgent || millis() - relayOpenedMs >= RELAY_MAX_HOLD_MS);
+}
+
+void relayStore(const RelayedRecord& relayed) {
+    for (int i = 0; i < relayCount; i++) {
+        RelayedRecord& held = relayBuffer[i];
+        if (held.sourceId == relayed.sourceId && held.record.machineId == relayed.record.machineId) {
+            if ((int16_t)(relayed.sourceSeq - held.sourceSeq) > 0) {
+                held = relayed;
+            }
+            telemetry.relayMerged++;
+            return;
+        }
+    }
+    if (relayCount == RELAY_MAX_RECORDS) {
+        relaySend();  // Full, make room
+    }
+    if (relayCount == 0) {
+        relayOpenedMs = relayed.receivedMs;
+    }
+    relayBuffer[relayCount++] = relayed;
+}
+
+/*
+ * Acknowledge a source's events packet at once, in its ACK window. The
+ * ACK says the relay has the events (the RELAYED packet itself goes out
+ * unacknowledged) and carries the bridge clock once TDMA is synced to it,
+ * ACK_CLOCK_UNKNOWN before, so the source keeps its own sync. The link
+ * SNR is not known, ADR at the source keeps its power.
+ */
+void relayAckEvents(const RelaySource& source) {
+    AckRecord ack;
+    ack.receivedBitmap = source.bitmap;
+    ack.bridgeClockMs = ACK_CLOCK_UNKNOWN;
+    #if TDMA_SLOTS
+    if (tdmaSynced) {
+        uint32_t clockMs = millis() + tdmaOffsetMs;
+        ack.bridgeClockMs = clockMs == ACK_CLOCK_UNKNOWN ? 0 : clockMs;  // 1 ms off, every 49 days
+    }
+    #endif
+    ack.snrX4 = 127;
+    ack.rssiNeg = 0;
+    
+    uint8_t packet[ACK_PACKET_SIZE];
+    PacketWriter writer(packet, sizeof(packet));
+    writer.u8(PACKET_TYPE_ACK);
+    writer.u8(source.id);
+    writer.u16(source.latestSeq);
+    writeRecord(writer, ack);
+    writer.appendCrc32();
+    
+    uint32_t airtimeMs = loraTimeOnAirMs(writer.length, loraProfile);
+    if (!dutyCycleAllows(airtimeMs)) {
+        return;
+    }
+    if (radioTransmit(packet, writer.length, airtimeMs, true) == TX_NOT_STARTED) {
+        return;
+    }
+    dutyCycleRecord(airtimeMs);
+    telemetry.airtimeTotalMs += airtimeMs;
+}
+
+/*
+ * Take the machine records of a packet heard from another aggregator.
+ * Readings, events, frame and keyframe packets of our RECORD_FORMAT are
+ * relayed, anything else is ignored.
+ */
+void relayAccept(const uint8_t* packet, int length) {
+    if (length < (int)typedPacketSize(1) || !relaySourceWanted(packet[1])) {
+        return;
+    }
+    int prefix;
+    switch (packet[0]) {
+        case PACKET_TYPE_READINGS:
+        case PACKET_TYPE_EVENTS:
+            prefix = PACKET_PREFIX_READINGS;
+            break;
+        case PACKET_TYPE_FRAME:
+            prefix = PACKET_PREFIX_FRAME;
+            break;
+        case PACKET_TYPE_KEYFRAME:
+            prefix = PACKET_PREFIX_KEYFRAME;
+            break;
+        default:
+            return;
+    }
+    const uint8_t formatFlag = RECORD_FORMAT == RECORD_FORMAT_V2 ? RECORD_V2_FLAG : 0;
+    uint8_t countByte = packet[TYPED_HEADER_SIZE + prefix - 1];
+    int count = countByte & ~RECORD_V2_FLAG;
+    if ((countByte & RECORD_V2_FLAG) != formatFlag ||
+        length != (int)typedPacketSize(prefix + count * MACHINE_RECORD_SIZE) ||
+        !packetCrcValid(packet, length)) {
+        return;
+    }
+    
+    uint16_t seq = packet[2] | (uint16_t)packet[3] << 8;
+    RelaySource& source = relaySourceFor(packet[1], seq);
+    if (!relayTrackSequence(source, seq)) {
+        telemetry.relayMerged += count;
+        return;
+    }
+    LOG_DEBUG("Relay: packet %u from aggregator %u, %d machines", seq, source.id, count);
+    
+    PacketReader reader(packet, length, TYPED_HEADER_SIZE + prefix);
+    for (int i = 0; i < count; i++) {
+        RelayedRecord relayed;
+        relayed.sourceId = source.id;
+        relayed.sourceSeq = seq;
+        relayed.receivedMs = millis();
+        readRecord(reader, relayed.record);
+        relayStore(relayed);
+    }
+    if (packet[0] == PACKET_TYPE_EVENTS) {
+        relayAckEvents(source);
+        relayUrgent = true;
+    }
+}
+
+/*
+ * Wait up to `wait` for the next BLE reading like xQueueReceive(), with
+ * the radio receiving meanwhile. The radio owns the TX task's
+ * notification, so a reading cannot end a slice early and waits at most
+ * RELAY_RX_SLICE_MS. Returns false early when relayed records are due.
+ */
+bool relayListen(SensorReading* reading, TickType_t wait) {
+    TickType_t start = xTaskGetTickCount();
+    for (;;) {
+        if (xQueueReceive(txQueue, reading, 0) == pdTRUE) {
+            return true;
+        }
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= wait || relayDue()) {
+            return false;
+        }
+        uint32_t sliceMs = (wait - elapsed) * portTICK_PERIOD_MS;
+        uint8_t packet[LORA_MAX_PAYLOAD];
+        int length = radioReceive(packet, sizeof(packet), min(sliceMs, (uint32_t)RELAY_RX_SLICE_MS));
+        if (length > 0) {
+            relayAccept(packet, length);
+        }
+    }
+}
+#endif
+
+// ============================================================================
+// Sensor Expiry
+// ============================================================================
+
+/*
+ * Offline detection, owned by the TX task. Every machine it got a reading
+ * for sits in a min-heap keyed by the time it would expire. Readings do
+ * not touch the heap: when the top entry comes due, its cache slot is read
+ * again and a machine heard from meanwhile goes back in with its new
+ * deadline. That is one O(log n) heap operation per machine and expiry
+ * period, however often it advertises, and no scan over all slots.
+ */
+struct ExpiryEntry {
+    uint32_t deadlineMs;
+    uint8_t machineId;
+};
+
+ExpiryEntry expiryHeap[256];        // At most one entry per machine ID
+int expiryCount = 0;
+uint8_t onlineSlot[256];            // machineId -> cache slot while online, else SLOT_NONE
+
+void resetSensorExpiry() {
+    memset(onlineSlot, SLOT_NONE, sizeof(onlineSlot));
+    expiryCount = 0;
+}
+
+bool expiresBefore(const ExpiryEntry& a, const ExpiryEntry& b) {
+    return (int32_t)(a.deadlineMs - b.deadlineMs) < 0;
+}
+
+void expiryPush(uint8_t machineId, uint32_t deadlineMs) {
+    int i = expiryCount++;
+    expiryHeap[i] = {deadlineMs, machineId};
+    while (i > 0 && expiresBefore(expiryHeap[i], expiryHeap[(i - 1) / 2])) {
+        ExpiryEntry parent = expiryHeap[(i - 1) / 2];
+        expiryHeap[(i - 1) / 2] = expiryHeap[i];
+        expiryHeap[i] = parent;
+        i = (i - 1) / 2;
+    }
+}
+
+ExpiryEntry expiryPop() {
+    ExpiryEntry top = expiryHeap[0];
+    expiryHeap[0] = expiryHeap[--expiryCount];
+    int i = 0;
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < expiryCount && expiresBefore(expiryHeap[left], expiryHeap[smallest])) {
+            smallest = left;
+        }
+        if (right < expiryCount && expiresBefore(expiryHeap[right], expiryHeap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return top;
+        }
+        ExpiryEntry child = expiryHeap[smallest];
+        expiryHeap[smallest] = expiryHeap[i];
+        expiryHeap[i] = child;
+        i = smallest;
+    }
+}
+
+// A reading from the TX queue: the machine is online (again)
+void trackSensorOnline(const SensorReading& reading) {
+    if (onlineSlot[reading.machineId] == SLOT_NONE) {
+        expiryPush(reading.machineId, reading.receivedMs + SENSOR_TIMEOUT_MS);
+    }
+    onlineSlot[reading.machineId] = reading.slot;  // Slot may have changed after an expiry
+}
+
+#if PERSIST_ENABLED
+// setup(): pick up where the last boot stopped, before the TX task starts
+void restoreRuntime() {
+    PersistSource source = persistLoadRuntime(persistScratch);
+    if (source == PERSIST_NONE) {
+        return;
+    }
+    dutyCycleImport(persistScratch.airtimeMs);
+    if (source != PERSIST_RTC) {
+        return;  // Counting restarts from 0, the server sees a reboot
+    }
+    
+    packetSequence = persistScratch.packetSequence;
+    restoreSensorCache(persistScratch.sensors, persistScratch.sensorCount);
+    for (int i = 0; i < persistScratch.sensorCount; i++) {
+        const SensorData& data = persistScratch.sensors[i];
+        if (data.valid) {
+            SensorReading reading = {};
+            reading.machineId = data.machineId;
+            reading.slot = i;
+            reading.receivedMs = data.lastSeenMs;
+            trackSensorOnline(reading);
+            warmStart = true;
+        }
+    }
+}
+#endif
+
+// Ticks until the earliest possible expiry
+TickType_t ticksUntilExpiry() {
+    if (expiryCount == 0) {
+        return portMAX_DELAY;
+    }
+    int32_t remaining = (int32_t)(expiryHeap[0].deadlineMs - millis());
+    return pdMS_TO_TICKS(remaining > 0 ? remaining : 0);
+}
+
+/*
+ * Expire every machine whose deadline has passed and report them in
+ * offline packets (MAX_MACHINES_PER_PACKET at a time). The writer may
+ * have recycled an expired machine's slot, so the machine ID is checked.
+ */
+void serviceSensorExpiry() {
+    uint8_t machineIds[MAX_MACHINES_PER_PACKET];
+    uint16_t silentSec[MAX_MACHINES_PER_PACKET];
+    int count = 0;
+    uint32_t now = millis();
+    
+    while (expiryCount > 0 && (int32_t)(expiryHeap[0].deadlineMs - now) <= 0) {
+        ExpiryEntry entry = expiryPop();
+        SensorData data = readSensorSlot(sensorCache[onlineSlot[entry.machineId]]);
+        if (data.valid && data.machineId == entry.machineId) {
+            uint32_t deadlineMs = data.lastSeenMs + sensorExpiryMs(data);
+            if ((int32_t)(deadlineMs - now) > 0) {
+                expiryPush(entry.machineId, deadlineMs);  // Heard from since
+                continue;
+            }
+        }
+        
+        onlineSlot[entry.machineId] = SLOT_NONE;
+        uint32_t silent = data.machineId == entry.machineId ? (now - data.lastSeenMs) / 1000 : 0;
+        machineIds[count] = entry.machineId;
+        silentSec[count] = saturate16(silent);
+        if (++count == MAX_MACHINES_PER_PACKET) {
+            sendOfflineLoRaPacket(machineIds, silentSec, count);
+            count = 0;
+        }
+    }
+    
+    if (count > 0) {
+        sendOfflineLoRaPacket(machineIds, silentSec, count);
+    }
+}
+
+/*
+ * Collect the online sensors of cache slots [first, last) from consistent
+ * snapshots. Online means tracked by the expiry heap, so a machine is in
+ * aggregated packets exactly until its offline event.
+ */
+int snapshotReadings(int first, int last, SensorReading* readings) {
+    int validCount = 0;
+    for (int i = first; i < last; i++) {
+        SensorData data = readSensorSlot(sensorCache[i]);
+        if (data.valid && onlineSlot[data.machineId] == i) {
+            SensorReading& reading = readings[validCount++];
+            reading.machineId = data.machineId;
+            reading.machineType = data.machineType;
+            reading.rmsX100 = data.rmsX100;
+            reading.meanX100 = data.meanX100;
+            reading.freqX10 = data.freqX10;
+            reading.batteryPercent = data.batteryPercent;
+            reading.flags = data.flags;
+            reading.receivedMs = data.lastSeenMs;
+            setEdgeFlags(reading);
+        }
+    }
+    return validCount;
+}
+
+void sendAggregatedLoRaPacket() {
+    /*
+     * Send all cached sensor data: with delta encoding one keyframe/delta
+     * stream per group of MAX_MACHINES_PER_PACKET cache slots, otherwise
+     * one multi-frame round (or one packet per group without MULTI_FRAME)
+     */
+    uint32_t airtimeMs = 0;
+    int count = sensorCount.load(std::memory_order_acquire);
+    
+    #if !DELTA_ENCODING && MULTI_FRAME
+    static SensorReading readings[MAX_SENSORS];  // Too big for the TX task stack
+    int validCount = snapshotReadings(0, count, readings);
+    if (validCount > 0) {
+        airtimeMs = sendReadingFrames(readings, validCount, millis());
+    }
+    #else
+    for (int first = 0; first < count; first += MAX_MACHINES_PER_PACKET) {
+        SensorReading readings[MAX_MACHINES_PER_PACKET];
+        int last = min(count, first + MAX_MACHINES_PER_PACKET);
+        int validCount = snapshotReadings(first, last, readings);
+        if (validCount == 0) {
+            continue;
+        }
+        
+        #if DELTA_ENCODING
+        airtimeMs += sendDeltaLoRaPacket(deltaStates[first / MAX_MACHINES_PER_PACKET],
+                                         readings, validCount, millis());
+        #else
+        airtimeMs += sendReadingsLoRaPacket(readings, validCount, millis());
+        #endif
+    }
+    #endif
+    
+    #if RELAY_ENABLED
+    airtimeMs += relaySend();  // Other aggregators' records go with our round
+    #endif
+    
+    lastAggregatedAirtimeMs = airtimeMs;
+}
+
+// ============================================================================
+// Acknowledged Events
+// ============================================================================
+
+#if ACK_EVENTS
+/*
+ * State changes (see classifyReading()) are the readings the server must
+ * not miss, so they go out in events packets
+ * which the bridge acknowledges; everything else stays fire-and-forget.
+ *
+ * ACK packet format (bridge -> aggregator):
+ * Bytes 0-3: PACKET_TYPE_ACK, aggregator ID, latest sequence received (u16)
+ * ACK_FIELDS (packet_schema.h): bitmap, bridge clock, SNR and RSSI
+ * Last 4 bytes: CRC-32
+ *
+ * The bitmap lets one ACK cover earlier events packets whose own ACK was
+ * lost, so only events the bridge really missed are sent again.
+ */
+#define ACK_BITMAP_BITS         16
+
+struct PendingEvent {
+    SensorReading reading;
+    uint16_t packetSeq;     // Events packet that last carried it
+    uint8_t attempts;       // Sends so far, 0 = not on air yet
+    uint32_t retryAtMs;
+    bool used;
+};
+
+PendingEvent pendingEvents[ACK_PENDING_MAX];
+
+void resetAckEvents() {
+    memset(pendingEvents, 0, sizeof(pendingEvents));
+}
+
+/*
+ * Queue a state change for an acknowledged send, returns false if the
+ * table is full. A newer event of a machine replaces its pending one.
+ */
+bool queueAckEvent(const SensorReading& reading) {
+    PendingEvent* slot = nullptr;
+    for (int i = 0; i < ACK_PENDING_MAX; i++) {
+        PendingEvent& event = pendingEvents[i];
+        if (event.used && event.reading.machineId == reading.machineId) {
+            slot = &event;
+            break;
+        }
+        if (!event.used && slot == nullptr) {
+            slot = &event;
+        }
+    }
+    if (slot == nullptr) {
+        LOG_WARN("ACK table full, state change of machine %u goes out unacknowledged",
+                 reading.machineId);
+        return false;
+    }
+    
+    slot->reading = reading;
+    slot->attempts = 0;
+    slot->retryAtMs = millis();
+    slot->used = true;
+    return true;
+}
+
+// Mark every pending event the bridge has confirmed
+void applyAck(uint16_t ackSeq, uint16_t bitmap) {
+    for (int i = 0; i < ACK_PENDING_MAX; i++) {
+        PendingEvent& event = pendingEvents[i];
+        if (!event.used || event.attempts == 0) {
+            continue;
+        }
+        uint16_t behind = ackSeq - event.packetSeq;
+        if (behind == 0 || (behind <= ACK_BITMAP_BITS && (bitmap & (1 << (behind - 1))))) {
+            LOG_DEBUG("Event of machine %u acknowledged (packet %u)",
+                      event.reading.machineId, event.packetSeq);
+            event.used = false;
+        }
+    }
+}
+
+#if ADR_ENABLED
+/*
+ * Adaptive TX power. SNR reports are kept as if sent at the configured
+ * power (settings.txPower, the ceiling), so older reports stay comparable
+ * after a power change; the power is then what the best report needs for
+ * ADR_MARGIN_DB of margin.
+ */
+#define ADR_SNR_UNKNOWN         127
+
+int8_t adrTxPower = LORA_TX_POWER;
+int16_t adrSnrHistoryX4[ADR_HISTORY];  // dB × 4 at settings.txPower
+int adrHistoryCount = 0;
+int adrHistoryNext = 0;
+int adrMissedAcks = 0;
+
+// Demodulation floor of the spreading factor: -7.5 dB at SF7, 2.5 dB lower per step
+int adrRequiredSnrX4() {
+    return 40 - 10 * loraProfile.spreadingFactor;
+}
+
+void adrSetTxPower(int power) {
+    if (power != adrTxPower) {
+        LOG_INFO("ADR: TX power %d -> %d dBm", adrTxPower, power);
+        adrTxPower = power;
+        radioSetTxPower(power);
+    }
+}
+
+void adrOnAck(int8_t snrX4) {
+    adrMissedAcks = 0;
+    if (snrX4 == ADR_SNR_UNKNOWN) {
+        return;
+    }
+    adrSnrHistoryX4[adrHistoryNext] = snrX4 + 4 * (settings.txPower - adrTxPower);
+    adrHistoryNext = (adrHistoryNext + 1) % ADR_HISTORY;
+    if (adrHistoryCount < ADR_HISTORY) {
+        adrHistoryCount++;
+    }
+    
+    int bestX4 = adrSnrHistoryX4[0];
+    for (int i = 1; i < adrHistoryCount; i++) {
+        bestX4 = max(bestX4, (int)adrSnrHistoryX4[i]);
+    }
+    int spareDb = (bestX4 - adrRequiredSnrX4()) / 4 - ADR_MARGIN_DB;
+    int power = settings.txPower - max(spareDb, 0);
+    adrSetTxPower(max(power, ADR_MIN_TX_POWER));
+}
+
+// An events packet got no ACK at all: after a few, assume the link got worse
+void adrOnAckMissed() {
+    if (++adrMissedAcks >= ADR_MISSED_ACKS && adrTxPower != settings.txPower) {
+        LOG_WARN("ADR: %d events without ACK, back to full power", adrMissedAcks);
+        adrHistoryCount = 0;
+        adrSetTxPower(settings.txPower);
+    }
+}
+
+// Start over at the configured power (boot, or the setting changed)
+void adrReset() {
+    adrHistoryCount = 0;
+    adrMissedAcks = 0;
+    adrTxPower = settings.txPower;
+    radioSetTxPower(adrTxPower);
+}
+#endif
+
+// Listen out the ACK window (a command may come first)
+bool receiveAck() {
+    uint8_t packet[LORA_MAX_PAYLOAD];
+    int length = receiveDownlink(packet, PACKET_TYPE_ACK, ACK_RX_WINDOW_MS);
+    if (length != (int)ACK_PACKET_SIZE) {
+        LOG_DEBUG("No ACK received");
+        return false;
+    }
+    PacketReader reader(packet, length, TYPED_HEADER_SIZE);
+    AckRecord ack;
+    readRecord(reader, ack);
+    
+    applyAck(packet[2] | (uint16_t)packet[3] << 8, ack.receivedBitmap);
+    LOG_DEBUG("ACK: SNR %d/4 dB, RSSI -%u dBm", (int8_t)ack.snrX4, ack.rssiNeg);
+    #if TDMA_SLOTS
+    if (ack.bridgeClockMs != ACK_CLOCK_UNKNOWN) {  // From a relay not synced yet
+        tdmaSync(ack.bridgeClockMs, loraTimeOnAirMs(ACK_PACKET_SIZE, loraProfile));
+    }
+    #endif
+    #if ADR_ENABLED
+    adrOnAck((int8_t)ack.snrX4);
+    #endif
+    return true;
+}
+
+// Ticks until the next event is due for (re)sending
+TickType_t ticksUntilEventRetry() {
+    TickType_t wait = portMAX_DELAY;
+    uint32_t now = millis();
+    for (int i = 0; i < ACK_PENDING_MAX; i++) {
+        if (pendingEvents[i].used) {
+            int32_t remaining = (int32_t)(pendingEvents[i].retryAtMs - now);
+            TickType_t ticks = pdMS_TO_TICKS(remaining > 0 ? remaining : 0);
+            if (ticks < wait) {
+                wait = ticks;
+            }
+        }
+    }
+    return wait;
+}
+
+/*
+ * Send all due events in one events packet, then wait for the ACK. An
+ * event still unacknowledged after ACK_MAX_RETRIES resends is dropped
+ * (the next regular packet still carries the machine's state). A packet
+ * the duty cycle holds back does not count as an attempt.
+ */
+void serviceAckEvents() {
+    SensorReading readings[ACK_PENDING_MAX];
+    int due[ACK_PENDING_MAX];
+    int count = 0;
+    uint32_t now = millis();
+    
+    for (int i = 0; i < ACK_PENDING_MAX; i++) {
+        PendingEvent& event = pendingEvents[i];
+        if (!event.used || (int32_t)(event.retryAtMs - now) > 0) {
+            continue;
+        }
+        if (event.attempts > ACK_MAX_RETRIES) {
+            LOG_WARN("Event of machine %u not acknowledged after %u sends, dropped",
+                     event.reading.machineId, event.attempts);
+            event.used = false;
+            continue;
+        }
+        readings[count] = event.reading;
+        due[count++] = i;
+    }
+    if (count == 0) {
+        return;
+    }
+    
+    uint16_t seq = packetSequence;
+    bool sent = sendEventsLoRaPacket(readings, count, now);
+    for (int i = 0; i < count; i++) {
+        PendingEvent& event = pendingEvents[due[i]];
+        if (sent) {
+            event.packetSeq = seq;
+            event.retryAtMs = millis() + ((uint32_t)ACK_RETRY_BASE_MS << event.attempts);
+            event.attempts++;
+        } else {
+            event.retryAtMs = millis() + ACK_RETRY_BASE_MS;
+        }
+    }
+    if (sent) {
+        #if ADR_ENABLED
+        if (!receiveAck()) {
+            adrOnAckMissed();
+        }
+        #else
+        receiveAck();
+        #endif
+    }
+}
+#endif
+
+// ============================================================================
+// TX Task
+// ============================================================================
+
+// Configured forwarding mode, may be changed at runtime with setForwardMode()
+volatile ForwardMode forwardMode = (ForwardMode)FORWARD_MODE;  // settings.forwardMode from setup()
+
+// Duty cycle override: immediate/batched fall back to paced aggregated packets
+bool dutyCycleCoalescing = false;
+
+// Takes effect at the TX task's next wakeup (next reading or deadline)
+void setForwardMode(ForwardMode mode) {
+    forwardMode = mode;
+}
+
+// Engage or release the duty cycle override with hysteresis
+void updateDutyCycleCoalescing() {
+    if (forwardMode == FORWARD_EVENTS) {
+        dutyCycleCoalescing = false;  // Already sends less than coalescing would
+        return;
+    }
+    uint32_t usedPercent = dutyCycleUsedMs() * 100 / DUTY_CYCLE_BUDGET_MS;
+    
+    if (!dutyCycleCoalescing && usedPercent >= DUTY_CYCLE_COALESCE_AT) {
+        dutyCycleCoalescing = true;
+        LOG_INFO("Duty cycle at %u%%, switching to coalesced forwarding", usedPercent);
+    } else if (dutyCycleCoalescing && usedPercent <= DUTY_CYCLE_RESUME_AT) {
+        dutyCycleCoalescing = false;
+        LOG_INFO("Duty cycle at %u%%, back to %s forwarding", usedPercent,
+                 forwardMode == FORWARD_BATCHED ? "batched" : "immediate");
+    }
+}
+
+// Spacing of coalesced packets so that their airtime alone stays within the duty cycle
+uint32_t coalesceIntervalMs() {
+    uint32_t pacedMs = lastAggregatedAirtimeMs * 100 / DUTY_CYCLE_PERCENT;
+    return pacedMs > DUTY_CYCLE_COALESCE_MIN_MS ? pacedMs : DUTY_CYCLE_COALESCE_MIN_MS;
+}
+
+// Ticks left until `intervalMs` has passed since `sinceMs` (0 if already due)
+TickType_t ticksUntil(uint32_t sinceMs, uint32_t intervalMs) {
+    uint32_t elapsed = millis() - sinceMs;
+    return pdMS_TO_TICKS(elapsed < intervalMs ? intervalMs - elapsed : 0);
+}
+
+#if DOWNLINK_COMMANDS
+bool telemetryRequested = false;    // Confirm a command with the next telemetry packet
+bool restartRequested = false;      // Restart once that confirmation is out
+
+// Save what a warm start needs and restart
+void restartAggregator() {
+    LOG_WARN("Restarting on command");
+    #if PERSIST_ENABLED
+    persistRuntime();
+    #endif
+    delay(100);  // Let the log drain
+    esp_restart();
+}
+
+/*
+ * Apply the command stored in the last RX window. A repeat of the last
+ * command ID (its confirmation was lost) is only confirmed again.
+ */
+void serviceCommand() {
+    if (!commandPending) {
+        return;
+    }
+    commandPending = false;
+    telemetryRequested = true;
+    CommandRecord command = pendingCommand;
+    if (command.commandId == settings.commandId) {
+        return;
+    }
+    
+    if (!settingsApply(command.setting, command.value, command.commandId)) {
+        LOG_WARN("Command %u: setting %u = %u rejected", command.commandId, command.setting, command.value);
+        return;
+    }
+    LOG_INFO("Command %u: setting %u = %u", command.commandId, command.setting, command.value);
+    switch (command.setting) {
+        case SETTING_RESTART:
+            restartRequested = true;
+            break;
+        case SETTING_FORWARD_MODE:
+            setForwardMode((ForwardMode)settings.forwardMode);
+            break;
+        case SETTING_TX_POWER:
+            #if ADR_ENABLED
+            adrReset();
+            #else
+            radioSetTxPower(settings.txPower);
+            #endif
+            break;
     }
-    return ~crc;
 }
+#endif
 
-// ============================================================================
-// Data Structures
-// ============================================================================
+#if OTA_ENABLED
+static_assert(DOWNLINK_COMMANDS, "OTA_ENABLED needs DOWNLINK_COMMANDS, updates start with a downlink");
 
-struct SensorData {
-    uint8_t machineId;
-    uint16_t rmsX100;           // RMS acceleration × 100
-    uint16_t freqX10;           // Dominant frequency × 10
-    uint8_t batteryPercent;
-    uint8_t flags;
-    uint32_t lastSeenMs;
-    bool valid;
+/*
+ * Firmware update in progress. The aggregator paces it: each OTA_REQUEST
+ * names the patch offset it needs next and the bridge answers with that
+ * chunk, so a lost chunk or request is simply asked for again.
+ */
+struct OtaTransfer {
+    bool active;
+    uint8_t sessionId;
+    uint32_t patchSize;
+    uint32_t offset;            // Patch bytes written so far
+    uint32_t lastRequestMs;
+    int missedChunks;
 };
 
-// Store data from up to MAX_MACHINES_PER_PACKET sensors
-SensorData sensorCache[MAX_MACHINES_PER_PACKET];
-int sensorCount = 0;
+OtaTransfer otaTransfer = {};
+uint8_t otaEndedSessionId = 0;      // Last finished update, a repeated start gets its status again
+uint8_t otaEndedStatus = OTA_STATUS_FAILED;
 
-// ============================================================================
-// BLE Scan Callback
-// ============================================================================
+// Spacing of requests so that the bridge's full chunks stay within the duty cycle
+uint32_t otaRequestIntervalMs() {
+    uint32_t pacedMs = loraTimeOnAirMs(LORA_MAX_PAYLOAD, loraProfile) * 100 / DUTY_CYCLE_PERCENT;
+    return pacedMs > OTA_REQUEST_MIN_INTERVAL_MS ? pacedMs : OTA_REQUEST_MIN_INTERVAL_MS;
+}
 
-class WashingMachineScanCallbacks : public NimBLEScanCallbacks {
+bool sendOtaRequest(uint8_t sessionId, uint8_t status, uint32_t offset) {
+    OtaRequestRecord request;
+    request.sessionId = sessionId;
+    request.status = status;
+    request.offset = offset;
     
-    void onResult(const NimBLEAdvertisedDevice* advertisedDevice) override {
-        // Check for manufacturer data
-        if (!advertisedDevice->haveManufacturerData()) {
-            return;
+    uint8_t packet[OTA_REQUEST_PACKET_SIZE];
+    PacketWriter writer(packet, sizeof(packet));
+    writeTypedHeader(writer, PACKET_TYPE_OTA_REQUEST);
+    writeRecord(writer, request);
+    writer.appendCrc32();
+    return transmitLoRaPacket(packet, writer.length);
+}
+
+// Report the outcome of an update (the bridge drops it) and forget it
+void otaEnd(uint8_t status) {
+    if (status != OTA_STATUS_DONE) {
+        otaAbort();
+    }
+    otaTransfer.active = false;
+    otaEndedSessionId = otaTransfer.sessionId;
+    otaEndedStatus = status;
+    sendOtaRequest(otaTransfer.sessionId, status, otaTransfer.offset);
+}
+
+// Start an update stored in the last RX window
+void otaStart(const OtaBeginRecord& begin) {
+    if (otaTransfer.active && begin.sessionId == otaTransfer.sessionId) {
+        return;  // Repeated while our first request was on its way
+    }
+    if (begin.sessionId == otaEndedSessionId) {
+        sendOtaRequest(begin.sessionId, otaEndedStatus, 0);
+        return;
+    }
+    
+    if (otaTransfer.active) {
+        otaAbort();  // Replaced by a newer update
+    }
+    otaTransfer = {};
+    otaTransfer.sessionId = begin.sessionId;
+    if (otaRunningImageIs(begin.imageSize, begin.imageCrc)) {
+        LOG_INFO("Firmware update %u already running", begin.sessionId);
+        otaEnd(OTA_STATUS_DONE);
+    } else if (!otaBegin(begin)) {
+        otaEnd(OTA_STATUS_FAILED);
+    } else {
+        otaTransfer.active = true;
+        otaTransfer.patchSize = begin.patchSize;
+        otaTransfer.lastRequestMs = millis() - otaRequestIntervalMs();  // First request now
+    }
+}
+
+// Ask for the next chunk and write it; restarts into the new image once complete
+void serviceOta() {
+    if (otaBeginPending) {
+        otaBeginPending = false;
+        otaStart(pendingOtaBegin);
+    }
+    if (!otaTransfer.active || millis() - otaTransfer.lastRequestMs < otaRequestIntervalMs()) {
+        return;
+    }
+    
+    otaTransfer.lastRequestMs = millis();
+    uint8_t packet[LORA_MAX_PAYLOAD];
+    int length = -1;
+    if (sendOtaRequest(otaTransfer.sessionId, OTA_STATUS_RECEIVING, otaTransfer.offset)) {
+        length = receiveDownlink(packet, PACKET_TYPE_OTA_CHUNK, OTA_CHUNK_RX_WINDOW_MS);
+    }
+    PacketReader reader(packet, length > 0 ? length : 0, TYPED_HEADER_SIZE);
+    OtaChunkRecord chunk = {};  // Session 0 matches no update
+    if (length > (int)typedPacketSize(SCHEMA_SIZE(OTA_CHUNK_FIELDS))) {
+        readRecord(reader, chunk);
+    }
+    if (chunk.sessionId != otaTransfer.sessionId || chunk.offset != otaTransfer.offset) {
+        if (++otaTransfer.missedChunks >= OTA_MAX_MISSED_CHUNKS) {
+            LOG_WARN("Firmware update %u: no chunk for %d requests", otaTransfer.sessionId,
+                     otaTransfer.missedChunks);
+            otaEnd(OTA_STATUS_FAILED);
         }
-        
-        std::string mfgData = advertisedDevice->getManufacturerData();
-        
-        // Minimum length check: company(2) + version(1) + id(1) + rms(2) + freq(2) + batt(1) + flags(1) = 10
-        if (mfgData.length() < 10) {
-            return;
+        return;
+    }
+    otaTransfer.missedChunks = 0;
+    
+    uint32_t dataLength = length - PACKET_CRC_SIZE - reader.position;
+    if (dataLength > otaTransfer.patchSize - otaTransfer.offset) {
+        dataLength = otaTransfer.patchSize - otaTransfer.offset;
+    }
+    if (!otaWrite(packet + reader.position, dataLength)) {
+        otaEnd(OTA_STATUS_FAILED);
+        return;
+    }
+    otaTransfer.offset += dataLength;
+    LOG_DEBUG("Firmware update %u: %u of %u bytes", otaTransfer.sessionId, otaTransfer.offset,
+              otaTransfer.patchSize);
+    
+    if (otaTransfer.offset == otaTransfer.patchSize) {
+        bool verified = otaFinish();
+        otaEnd(verified ? OTA_STATUS_DONE : OTA_STATUS_FAILED);
+        restartRequested = verified;
+    }
+}
+
+// Ticks until the next chunk request (portMAX_DELAY with no update running)
+TickType_t ticksUntilOtaRequest() {
+    if (!otaTransfer.active) {
+        return portMAX_DELAY;
+    }
+    return ticksUntil(otaTransfer.lastRequestMs, otaRequestIntervalMs());
+}
+#endif
+
+/*
+ * Collects readings for batched mode. The first reading opens a
+ * BATCH_DEADLINE_MS window; a newer reading of a machine already in the
+ * batch replaces the older one.
+ */
+struct ReadingBatch {
+    SensorReading readings[MAX_MACHINES_PER_PACKET];
+    int count;
+    uint32_t openedMs;
+    
+    void add(const SensorReading& reading) {
+        if (count == 0) {
+            openedMs = millis();
         }
-        
-        // Parse manufacturer data
-        const uint8_t* data = (const uint8_t*)mfgData.data();
-        
-        // Check company ID (little-endian)
-        uint16_t companyId = data[0] | (data[1] << 8);
-        if (companyId != WASHING_MACHINE_COMPANY_ID) {
-            return;
+        for (int i = 0; i < count; i++) {
+            if (readings[i].machineId == reading.machineId) {
+                readings[i] = reading;
+                return;
+            }
+        }
+        readings[count++] = reading;
+    }
+    
+    bool full() const { return count >= MAX_MACHINES_PER_PACKET; }
+    bool due() const { return count > 0 && millis() - openedMs >= BATCH_DEADLINE_MS; }
+    
+    void flush() {
+        if (count > 0) {
+            sendReadingsLoRaPacket(readings, count, millis());
+            count = 0;
+        }
+    }
+};
+
+/*
+ * Owns the LoRa radio. Runs on the core opposite the NimBLE host and
+ * sleeps through each send (~300 ms at SF10) in radioTransmit().
+ */
+void txTask(void* param) {
+    SensorReading reading;
+    ReadingBatch batch = {};
+    uint32_t lastAggregatedMs = millis();
+    #if PERSIST_ENABLED
+    if (warmStart) {
+        lastAggregatedMs -= 0x80000000;  // As if the last report was long ago
+    }
+    uint32_t lastPersistMs = millis();
+    #endif
+    #if TELEMETRY_ENABLED
+    uint32_t lastTelemetryMs = millis();
+    #endif
+    
+    for (;;) {
+        // Sleep until the next reading or the next deadline of the current mode
+        TickType_t wait = portMAX_DELAY;
+        if (dutyCycleCoalescing) {
+            wait = ticksUntil(lastAggregatedMs, coalesceIntervalMs());
+        } else if (forwardMode == FORWARD_INTERVAL) {
+            wait = ticksUntil(lastAggregatedMs, settings.forwardIntervalMs);
+        } else if (forwardMode == FORWARD_EVENTS) {
+            wait = ticksUntil(lastAggregatedMs, EVENT_HEARTBEAT_MS);
+        } else if (forwardMode == FORWARD_BATCHED && batch.count > 0) {
+            wait = ticksUntil(batch.openedMs, BATCH_DEADLINE_MS);
+        }
+        #if TELEMETRY_ENABLED
+        TickType_t telemetryWait = ticksUntil(lastTelemetryMs, TELEMETRY_INTERVAL_MS);
+        #if DOWNLINK_COMMANDS
+        if (telemetryRequested) {
+            telemetryWait = 0;
+        }
+        #endif
+        if (telemetryWait < wait) {
+            wait = telemetryWait;
+        }
+        #endif
+        #if OTA_ENABLED
+        TickType_t otaWait = ticksUntilOtaRequest();
+        if (otaWait < wait) {
+            wait = otaWait;
+        }
+        #endif
+        TickType_t expiryWait = ticksUntilExpiry();
+        if (expiryWait < wait) {
+            wait = expiryWait;
+        }
+        #if ACK_EVENTS
+        TickType_t retryWait = ticksUntilEventRetry();
+        if (retryWait < wait) {
+            wait = retryWait;
+        }
+        #endif
+        #if PERSIST_ENABLED
+        TickType_t persistWait = ticksUntil(lastPersistMs, PERSIST_WARM_INTERVAL_MS);
+        if (persistWait < wait) {
+            wait = persistWait;
+        }
+        #endif
+        #if RELAY_ENABLED
+        if (relayCount > 0) {
+            TickType_t relayWait = relayUrgent ? 0 : ticksUntil(relayOpenedMs, RELAY_MAX_HOLD_MS);
+            if (relayWait < wait) {
+                wait = relayWait;
+            }
         }
         
-        // Check protocol version
-        uint8_t protocolVersion = data[2];
-        if (protocolVersion != PROTOCOL_VERSION) {
-            #if DEBUG_SERIAL
-            Serial.printf("Unknown protocol version: %d\n", protocolVersion);
+        bool received = relayListen(&reading, wait);
+        #else
+        bool received = xQueueReceive(txQueue, &reading, wait) == pdTRUE;
+        #endif
+        bool stateChange = false;
+        bool ackQueued = false;     // Goes out as an acknowledged event below
+        if (received) {
+            trackSensorOnline(reading);
+            stateChange = classifyReading(reading);
+            #if ACK_EVENTS
+            ackQueued = stateChange && queueAckEvent(reading);
             #endif
-            return;
         }
+        updateDutyCycleCoalescing();
         
-        // Parse sensor data
-        uint8_t machineId = data[3];
-        uint16_t rmsX100 = data[4] | (data[5] << 8);
-        uint16_t freqX10 = data[6] | (data[7] << 8);
-        uint8_t batteryPercent = data[8];
-        uint8_t flags = data[9];
+        if (dutyCycleCoalescing || forwardMode == FORWARD_INTERVAL) {
+            // Queued readings are already in sensorCache, send them all at once
+            batch.count = 0;
+            uint32_t interval = dutyCycleCoalescing ? coalesceIntervalMs() : settings.forwardIntervalMs;
+            if (millis() - lastAggregatedMs >= interval) {
+                sendAggregatedLoRaPacket();
+                lastAggregatedMs = millis();
+            }
+        } else if (forwardMode == FORWARD_EVENTS) {
+            // Only state changes go out right away, everything else waits for the heartbeat
+            batch.count = 0;
+            if (stateChange && !ackQueued) {
+                sendReadingsLoRaPacket(&reading, 1, millis());
+            }
+            if (millis() - lastAggregatedMs >= EVENT_HEARTBEAT_MS) {
+                sendAggregatedLoRaPacket();
+                lastAggregatedMs = millis();
+            }
+        } else if (forwardMode == FORWARD_BATCHED) {
+            if (received) {
+                batch.add(reading);
+            }
+            if (batch.full() || batch.due()) {
+                batch.flush();
+            }
+        } else {
+            batch.flush();  // Left over from a mode change
+            if (received && !ackQueued) {
+                sendReadingsLoRaPacket(&reading, 1, millis());
+            }
+        }
         
-        #if DEBUG_SERIAL
-        Serial.printf("Received from Machine %d: RMS=%.2f m/s², Freq=%.1f Hz, Batt=%d%%\n",
-                      machineId,
-                      rmsX100 / 100.0,
-                      freqX10 / 10.0,
-                      batteryPercent);
+        #if ACK_EVENTS
+        serviceAckEvents();
         #endif
         
-        // Update sensor cache
-        updateSensorCache(machineId, rmsX100, freqX10, batteryPercent, flags);
-        
-        // Forward immediately if configured
-        #if FORWARD_INTERVAL_MS == 0
-        sendLoRaPacket(machineId, rmsX100, freqX10, batteryPercent);
-        #endif
-    }
-    
-    void updateSensorCache(uint8_t machineId, uint16_t rmsX100, uint16_t freqX10, 
-                          uint8_t batteryPercent, uint8_t flags) {
-        // Find existing entry or empty slot
-        int slot = -1;
-        for (int i = 0; i < MAX_MACHINES_PER_PACKET; i++) {
-            if (sensorCache[i].valid && sensorCache[i].machineId == machineId) {
-                slot = i;
-                break;
-            }
-            if (!sensorCache[i].valid && slot == -1) {
-                slot = i;
-            }
+        #if RELAY_ENABLED
+        // Relayed records the aggregated round did not take along
+        if (relayDue()) {
+            relaySend();
         }
+        #endif
         
-        if (slot == -1) {
-            #if DEBUG_SERIAL
-            Serial.println("Warning: Sensor cache full!");
-            #endif
-            return;
+        // Offline events go out as soon as a machine expires
+        serviceSensorExpiry();
+        
+        #if PERSIST_ENABLED
+        // Readings that were not sent still belong in the next warm start
+        if (millis() - lastPersistMs >= PERSIST_WARM_INTERVAL_MS) {
+            persistRuntime();
+            lastPersistMs = millis();
         }
+        #endif
         
-        sensorCache[slot].machineId = machineId;
-        sensorCache[slot].rmsX100 = rmsX100;
-        sensorCache[slot].freqX10 = freqX10;
-        sensorCache[slot].batteryPercent = batteryPercent;
-        sensorCache[slot].flags = flags;
-        sensorCache[slot].lastSeenMs = millis();
-        sensorCache[slot].valid = true;
+        #if TELEMETRY_ENABLED
+        // Lowest priority: only with no reading waiting, skipped while the
+        // duty cycle is tight (a skipped report is not made up later).
+        // Confirmations of commands are never skipped.
+        bool telemetryDue = millis() - lastTelemetryMs >= TELEMETRY_INTERVAL_MS;
+        bool confirmDue = false;
+        #if DOWNLINK_COMMANDS
+        confirmDue = telemetryRequested;
+        #endif
+        if ((telemetryDue || confirmDue) && uxQueueMessagesWaiting(txQueue) == 0) {
+            if (confirmDue || !dutyCycleCoalescing) {
+                #if DOWNLINK_COMMANDS
+                telemetryRequested = false;
+                #endif
+                sendTelemetryLoRaPacket();
+            }
+            lastTelemetryMs = millis();
+        }
+        #endif
         
-        if (slot >= sensorCount) {
-            sensorCount = slot + 1;
+        #if DOWNLINK_COMMANDS
+        // Downlinks from the RX windows above
+        serviceCommand();
+        #if OTA_ENABLED
+        serviceOta();
+        #endif
+        if (restartRequested && !telemetryRequested) {
+            restartAggregator();
         }
+        #endif
     }
-};
-
-// ============================================================================
-// LoRa Functions
-// ============================================================================
+}
 
-bool initLoRa() {
-    // Configure SPI pins
-    SPI.begin(LORA_SCK_PIN, LORA_MISO_PIN, LORA_MOSI_PIN, LORA_CS_PIN);
-    
-    // Set LoRa pins
-    LoRa.setPins(LORA_CS_PIN, LORA_RST_PIN, LORA_DIO1_PIN);
-    
-    // Initialize LoRa
-    if (!LoRa.begin(LORA_FREQUENCY * 1E6)) {
-        Serial.println("LoRa init failed!");
+bool initTxTask() {
+    txQueue = xQueueCreate(TX_QUEUE_LENGTH, sizeof(SensorReading));
+    if (txQueue == nullptr) {
+        Serial.println("TX queue allocation failed!");
         return false;
     }
     
-    // Configure LoRa parameters
-    LoRa.setSpreadingFactor(LORA_SPREADING_FACTOR);
-    LoRa.setSignalBandwidth(LORA_BANDWIDTH);
-    LoRa.setCodingRate4(LORA_CODING_RATE);
-    LoRa.setTxPower(LORA_TX_POWER);
-    LoRa.setPreambleLength(LORA_PREAMBLE_LENGTH);
-    LoRa.setSyncWord(LORA_SYNC_WORD);
-    
-    Serial.println("LoRa initialized successfully");
-    Serial.printf("  Frequency: %.1f MHz\n", LORA_FREQUENCY);
-    Serial.printf("  SF: %d, BW: %d kHz\n", LORA_SPREADING_FACTOR, LORA_BANDWIDTH / 1000);
+    if (xTaskCreatePinnedToCore(txTask, "lora_tx", TX_TASK_STACK_SIZE, nullptr,
+                                TX_TASK_PRIORITY, &txTaskHandle, TX_TASK_CORE) != pdPASS) {
+        Serial.println("TX task creation failed!");
+        return false;
+    }
     
+    Serial.printf("TX task started on core %d (queue: %d readings)\n",
+                  TX_TASK_CORE, TX_QUEUE_LENGTH);
     return true;
 }
 
-void sendLoRaPacket(uint8_t machineId, uint16_t rmsX100, uint16_t freqX10, uint8_t batteryPercent) {
-    /*
-     * Packet format:
-     * Byte 0: Aggregator ID
-     * Byte 1: Machine count (1 for single machine)
-     * Bytes 2+: Machine data (6 bytes each)
-     *   - Byte 0: Machine ID
-     *   - Bytes 1-2: RMS × 100 (little-endian)
-     *   - Bytes 3-4: Freq × 10 (little-endian)
-     *   - Byte 5: Battery %
-     */
-    
-    uint8_t packet[8];
-    packet[0] = AGGREGATOR_ID;
-    packet[1] = 1;  // Single machine
-    packet[2] = machineId;
-    packet[3] = rmsX100 & 0xFF;
-    packet[4] = (rmsX100 >> 8) & 0xFF;
-    packet[5] = freqX10 & 0xFF;
-    packet[6] = (freqX10 >> 8) & 0xFF;
-    packet[7] = batteryPercent;
-    
-    #if DEBUG_SERIAL
-    Serial.printf("Sending LoRa packet for machine %d...\n", machineId);
-    #endif
+// ============================================================================
+// Loop Wakeups
+// ============================================================================
+
+/*
+ * loop() sleeps in xTaskNotifyWait() until one of these bits is set: by
+ * logPush() when a record is queued, or by a one-shot software timer
+ * armed for the next scan phase or scan window change. Nothing polls, so
+ * between events the core runs the idle task (and light sleeps).
+ */
+#define WAKE_LOG                (1 << 0)
+#define WAKE_SCAN_FILTER        (1 << 1)
+#define WAKE_SCAN_WINDOW        (1 << 2)
+
+TaskHandle_t loopTaskHandle = nullptr;
+
+void wakeLoop(uint32_t bits) {
+    if (loopTaskHandle != nullptr) {
+        xTaskNotify(loopTaskHandle, bits, eSetBits);
+    }
+}
+
+void onLogPending() {
+    wakeLoop(WAKE_LOG);
+}
+
+// Runs in the timer service task: the timer ID is the wake bit
+void onWakeTimer(TimerHandle_t timer) {
+    wakeLoop((uint32_t)(uintptr_t)pvTimerGetTimerID(timer));
+}
+
+TimerHandle_t createWakeTimer(const char* name, uint32_t bit) {
+    return xTimerCreate(name, 1, pdFALSE, (void*)(uintptr_t)bit, onWakeTimer);
+}
+
+// (Re)start a wake timer to fire in `ms`, replacing any pending expiry
+void armWakeTimer(TimerHandle_t timer, uint32_t ms) {
+    TickType_t ticks = pdMS_TO_TICKS(ms);
+    xTimerChangePeriod(timer, ticks > 0 ? ticks : 1, portMAX_DELAY);
+}
+
+// ============================================================================
+// BLE Initialization
+// ============================================================================
+
+void initBLE() {
+    NimBLEDevice::init("WM_Aggregator");
     
-    LoRa.beginPacket();
-    LoRa.write(packet, sizeof(packet));
-    LoRa.endPacket();
+    pBLEScan = NimBLEDevice::getScan();
+    pBLEScan->setScanCallbacks(new WashingMachineScanCallbacks(), false);
+    pBLEScan->setActiveScan(false);  // Passive scan (less power, no scan response)
+    pBLEScan->setInterval(BLE_SCAN_INTERVAL_MS);
+    pBLEScan->setWindow(scanWindowMs());  // Adaptive: widened once wake times are learned
+    pBLEScan->setMaxResults(0);  // Don't store results, use callback only
     
-    #if DEBUG_SERIAL
-    Serial.println("LoRa packet sent");
+    #if BLE_FILTER_MODE == BLE_FILTER_WHITELIST
+    learnQueue = xQueueCreate(BLE_WHITELIST_MAX, sizeof(NodeAddress));
     #endif
+    
+    Serial.println("BLE initialized");
+    Serial.printf("  Scan interval: %d ms, window: %d ms\n", 
+                  BLE_SCAN_INTERVAL_MS, BLE_SCAN_WINDOW_MS);
 }
 
-void sendAggregatedLoRaPacket() {
-    /*
-     * Send all cached sensor data in one packet
-     */
+#if SCAN_ADAPTIVE
+/*
+ * Adaptive scan window. Scans with the full BLE_SCAN_WINDOW_MS while any
+ * node with a learned period is due (within SCAN_WAKE_GUARD_MS of its
+ * expected burst, repeating if the burst is missed), and with the narrow
+ * SCAN_NARROW_WINDOW_MS otherwise. The narrow window still catches new
+ * nodes and nodes that drifted, just with fewer advertisements per burst.
+ */
+TimerHandle_t scanWindowTimer = nullptr;
+
+/*
+ * Whether any node is due at `now`; *holdMs is set to how long that answer
+ * stays valid, capped at SCAN_WAKE_GUARD_MS so that schedules learned in
+ * the meantime are picked up in time
+ */
+bool anySensorDue(uint32_t now, uint32_t* holdMs) {
+    const uint32_t dueSpan = 2 * SCAN_WAKE_GUARD_MS;
+    uint32_t hold = SCAN_WAKE_GUARD_MS;
+    bool due = false;
     
-    // Count valid sensors
-    int validCount = 0;
-    for (int i = 0; i < sensorCount; i++) {
-        if (sensorCache[i].valid) {
-            // Check if sensor is still alive
-            if (millis() - sensorCache[i].lastSeenMs < SENSOR_TIMEOUT_MS) {
-                validCount++;
+    int count = sensorCount.load(std::memory_order_acquire);
+    for (int i = 0; i < count; i++) {
+        SensorData data = readSensorSlot(sensorCache[i]);
+        if (!data.valid || data.wakePeriodMs <= dueSpan) {
+            continue;
+        }
+        uint32_t lead = now - data.wakeStartMs + SCAN_WAKE_GUARD_MS;
+        uint32_t untilChange;
+        if (lead < data.wakePeriodMs) {
+            untilChange = data.wakePeriodMs - lead;  // First burst not due yet
+        } else {
+            uint32_t phase = lead % data.wakePeriodMs;
+            if (phase <= dueSpan) {
+                due = true;
+                untilChange = dueSpan - phase + 1;
             } else {
-                sensorCache[i].valid = false;  // Mark as offline
+                untilChange = data.wakePeriodMs - phase;
             }
         }
+        if (untilChange < hold) {
+            hold = untilChange;
+        }
     }
     
-    if (validCount == 0) {
+    *holdMs = hold;
+    return due;
+}
+
+void serviceScanWindow() {
+    uint32_t holdMs;
+    bool wide = anySensorDue(millis(), &holdMs);
+    armWakeTimer(scanWindowTimer, holdMs);
+    if (wide == scanWide) {
         return;
     }
     
-    // Build packet with CRC-32
-    uint8_t packet[2 + (MAX_MACHINES_PER_PACKET * 6) + 4];  // +4 for CRC
-    packet[0] = AGGREGATOR_ID;
-    packet[1] = validCount;
+    xSemaphoreTake(scanLock, portMAX_DELAY);
+    scanWide = wide;
+    if (!scanYielded || COEX_TX_SCAN != COEX_SCAN_NARROW) {
+        pBLEScan->setWindow(scanWindowMs());  // Else the resume sets it
+    }
+    scanStartLocked();
+    xSemaphoreGive(scanLock);
+}
+#endif
+
+#if BLE_FILTER_MODE == BLE_FILTER_WHITELIST
+/*
+ * Whitelist scan filtering. The aggregator alternates between
+ *   - discovery: unfiltered scan for BLE_DISCOVERY_DURATION_MS, learning
+ *     the MAC of every node that matches our company ID, and
+ *   - filtered: the controller only reports whitelisted nodes, so the host
+ *     is not woken for every phone nearby, for BLE_DISCOVERY_INTERVAL_MS.
+ * Falls back to unfiltered scanning if there are more nodes than fit.
+ */
+enum ScanPhase {
+    SCAN_DISCOVERY,
+    SCAN_FILTERED
+};
+
+ScanPhase scanPhase = SCAN_DISCOVERY;
+uint32_t scanPhaseStartMs = 0;
+TimerHandle_t scanFilterTimer = nullptr;
+
+void startScanPhase(ScanPhase phase, uint32_t now) {
+    scanPhase = phase;
+    scanPhaseStartMs = now;
+    armWakeTimer(scanFilterTimer, phase == SCAN_DISCOVERY ? BLE_DISCOVERY_DURATION_MS
+                                                          : BLE_DISCOVERY_INTERVAL_MS);
+}
+
+#if PERSIST_ENABLED
+// Save the whitelist, so that a restart can skip discovery
+void persistNodes() {
+    PersistedNodes nodes;
+    nodes.count = NimBLEDevice::getWhiteListCount();
+    for (int i = 0; i < nodes.count; i++) {
+        NimBLEAddress address = NimBLEDevice::getWhiteListAddress(i);
+        memcpy(nodes.addresses[i].addr, address.getVal(), 6);
+        nodes.addresses[i].type = address.getType();
+    }
+    persistSaveNodes(nodes);
+}
+
+// Whitelist the nodes known before the restart, true if there are any
+bool restoreNodes() {
+    PersistedNodes nodes;
+    if (!persistLoadNodes(nodes)) {
+        return false;
+    }
+    for (int i = 0; i < nodes.count; i++) {
+        NimBLEDevice::whiteListAdd(NimBLEAddress(nodes.addresses[i].addr, nodes.addresses[i].type));
+    }
+    LOG_INFO("%d nodes whitelisted from the last boot", nodes.count);
+    return NimBLEDevice::getWhiteListCount() > 0;
+}
+#endif
+
+void serviceScanFilter() {
+    uint32_t now = millis();
     
-    int offset = 2;
-    for (int i = 0; i < sensorCount && offset < sizeof(packet) - 10; i++) {
-        if (sensorCache[i].valid) {
-            packet[offset++] = sensorCache[i].machineId;
-            packet[offset++] = sensorCache[i].rmsX100 & 0xFF;
-            packet[offset++] = (sensorCache[i].rmsX100 >> 8) & 0xFF;
-            packet[offset++] = sensorCache[i].freqX10 & 0xFF;
-            packet[offset++] = (sensorCache[i].freqX10 >> 8) & 0xFF;
-            packet[offset++] = sensorCache[i].batteryPercent;
+    if (scanPhase == SCAN_DISCOVERY && now - scanPhaseStartMs >= BLE_DISCOVERY_DURATION_MS) {
+        xSemaphoreTake(scanLock, portMAX_DELAY);
+        pBLEScan->stop();
+        NodeAddress learned;
+        while (xQueueReceive(learnQueue, &learned, 0) == pdTRUE) {
+            if (!NimBLEDevice::whiteListAdd(NimBLEAddress(learned.addr, learned.type))) {
+                whitelistOverflow = true;
+            }
         }
+        
+        bool filter = !whitelistOverflow && NimBLEDevice::getWhiteListCount() > 0;
+        #if PERSIST_ENABLED
+        if (filter) {
+            persistNodes();
+        }
+        #endif
+        pBLEScan->setFilterPolicy(filter ? BLE_HCI_SCAN_FILT_USE_WL : BLE_HCI_SCAN_FILT_NO_WL);
+        scanStartLocked();
+        xSemaphoreGive(scanLock);
+        
+        startScanPhase(filter ? SCAN_FILTERED : SCAN_DISCOVERY, now);
+        
+        LOG_INFO("Discovery done: %d nodes whitelisted, %s scan",
+                 (int)NimBLEDevice::getWhiteListCount(), filter ? "filtered" : "unfiltered");
+    } else if (scanPhase == SCAN_FILTERED && now - scanPhaseStartMs >= BLE_DISCOVERY_INTERVAL_MS) {
+        // Look for nodes that were added or replaced since the last discovery
+        xSemaphoreTake(scanLock, portMAX_DELAY);
+        pBLEScan->setFilterPolicy(BLE_HCI_SCAN_FILT_NO_WL);
+        scanStartLocked();
+        xSemaphoreGive(scanLock);
+        startScanPhase(SCAN_DISCOVERY, now);
     }
-    
-    // Calculate and append CRC-32
-    uint32_t crc = crc32(packet, offset);
-    packet[offset++] = crc & 0xFF;
-    packet[offset++] = (crc >> 8) & 0xFF;
-    packet[offset++] = (crc >> 16) & 0xFF;
-    packet[offset++] = (crc >> 24) & 0xFF;
-    
-    #if DEBUG_SERIAL
-    Serial.printf("Sending aggregated LoRa packet with %d machines (CRC: 0x%08X)\n", validCount, crc);
-    #endif
-    
-    LoRa.beginPacket();
-    LoRa.write(packet, offset);
-    LoRa.endPacket();
 }
+#endif
 
 // ============================================================================
-// BLE Initialization
+// Power Management
 // ============================================================================
 
-NimBLEScan* pBLEScan = nullptr;
-
-void initBLE() {
-    NimBLEDevice::init("WM_Aggregator");
+#if POWER_LIGHT_SLEEP
+/*
+ * Let the idle task scale the clock down and light sleep whenever every
+ * task is blocked. The radio's DIO1 line is a wake source so that TX done
+ * is not delayed; BLE keeps the chip awake through its own scan windows.
+ */
+void initPowerManagement() {
+    esp_pm_config_esp32s3_t pm = {};
+    pm.max_freq_mhz = getCpuFrequencyMhz();
+    pm.min_freq_mhz = POWER_MIN_CPU_MHZ;
+    pm.light_sleep_enable = true;
     
-    pBLEScan = NimBLEDevice::getScan();
-    pBLEScan->setScanCallbacks(new WashingMachineScanCallbacks(), false);
-    pBLEScan->setActiveScan(false);  // Passive scan (less power, no scan response)
-    pBLEScan->setInterval(BLE_SCAN_INTERVAL_MS);
-    pBLEScan->setWindow(BLE_SCAN_WINDOW_MS);
-    pBLEScan->setMaxResults(0);  // Don't store results, use callback only
+    esp_err_t err = esp_pm_configure(&pm);
+    if (err != ESP_OK) {
+        Serial.printf("Light sleep not available (%s), staying awake\n", esp_err_to_name(err));
+        return;
+    }
     
-    Serial.println("BLE initialized");
-    Serial.printf("  Scan interval: %d ms, window: %d ms\n", 
-                  BLE_SCAN_INTERVAL_MS, BLE_SCAN_WINDOW_MS);
+    gpio_wakeup_enable((gpio_num_t)LORA_DIO1_PIN, GPIO_INTR_HIGH_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+    Serial.printf("Light sleep enabled (%d-%d MHz)\n", pm.min_freq_mhz, pm.max_freq_mhz);
 }
+#endif
 
 // ============================================================================
 // Setup & Loop
@@ -290,15 +2164,36 @@ void initBLE() {
 
 void setup() {
     Serial.begin(DEBUG_BAUD_RATE);
-    delay(1000);  // Wait for serial
+    delay(SERIAL_STARTUP_DELAY_MS);  // Wait for serial
+    
+    // Runtime settings first, the ID and radio profile come from them
+    settingsBegin();
+    packetsBegin(settings.aggregatorId, loraProfile);
+    forwardMode = (ForwardMode)settings.forwardMode;
+    #if LBT_ENABLED
+    backoffState = 0x9E3779B9u * settings.aggregatorId;
+    #endif
     
     Serial.println("\n========================================");
     Serial.println("Washing Machine Aggregator");
-    Serial.printf("ID: %d, Name: %s\n", AGGREGATOR_ID, AGGREGATOR_NAME);
+    Serial.printf("ID: %d, Name: %s\n", settings.aggregatorId, AGGREGATOR_NAME);
     Serial.println("========================================\n");
     
+    // loop() runs in this task once setup() returns
+    loopTaskHandle = xTaskGetCurrentTaskHandle();
+    logBegin(onLogPending);
+    
     // Initialize sensor cache
-    memset(sensorCache, 0, sizeof(sensorCache));
+    resetSensorCache();
+    resetSensorExpiry();
+    resetEdgeClassifiers();
+    #if ACK_EVENTS
+    resetAckEvents();
+    #endif
+    #if PERSIST_ENABLED
+    persistBegin();
+    restoreRuntime();
+    #endif
     
     // Initialize LoRa
     if (!initLoRa()) {
@@ -307,29 +2202,81 @@ void setup() {
             delay(1000);
         }
     }
+    #if ADR_ENABLED
+    adrReset();
+    #endif
+    
+    // Start TX task before BLE so the callback always has a queue to feed;
+    // its sends leave the scan alone until setup() started it
+    scanLock = xSemaphoreCreateMutex();
+    if (!initTxTask()) {
+        Serial.println("FATAL: TX task initialization failed!");
+        while (1) {
+            delay(1000);
+        }
+    }
     
     // Initialize BLE
     initBLE();
     
     // Start BLE scanning
     Serial.println("Starting BLE scan...");
+    #if BLE_FILTER_MODE == BLE_FILTER_WHITELIST
+    scanFilterTimer = createWakeTimer("scan_filter", WAKE_SCAN_FILTER);
+    bool knownNodes = false;
+    #if PERSIST_ENABLED
+    knownNodes = restoreNodes();
+    #endif
+    if (knownNodes) {
+        // Nodes from the last boot: filtered right away, next discovery on schedule
+        pBLEScan->setFilterPolicy(BLE_HCI_SCAN_FILT_USE_WL);
+        startScanPhase(SCAN_FILTERED, millis());
+    } else {
+        startScanPhase(SCAN_DISCOVERY, millis());  // Discovery phase first
+    }
+    #endif
+    xSemaphoreTake(scanLock, portMAX_DELAY);
     pBLEScan->start(BLE_SCAN_DURATION_SEC, false);  // 0 = continuous
+    scanRunning = true;
+    xSemaphoreGive(scanLock);
+    #if SCAN_ADAPTIVE
+    scanWindowTimer = createWakeTimer("scan_window", WAKE_SCAN_WINDOW);
+    armWakeTimer(scanWindowTimer, SCAN_WAKE_GUARD_MS);
+    #endif
+    
+    #if POWER_LIGHT_SLEEP
+    initPowerManagement();
+    #endif
+    
+    #if OTA_ENABLED
+    otaConfirmBoot();  // Came this far: keep this image
+    #endif
     
     Serial.println("\nAggregator ready, waiting for sensor data...\n");
 }
 
 void loop() {
-    // BLE scanning runs in background via callbacks
+    // BLE scanning runs in background via callbacks,
+    // LoRa forwarding (immediate or periodic) runs in txTask.
+    // Blocking here (instead of delay() polling) also keeps the idle task
+    // and its watchdog fed.
+    uint32_t wake = 0;
+    xTaskNotifyWait(0, UINT32_MAX, &wake, portMAX_DELAY);
     
-    #if FORWARD_INTERVAL_MS > 0
-    // Periodic aggregated forwarding
-    static uint32_t lastForward = 0;
-    if (millis() - lastForward >= FORWARD_INTERVAL_MS) {
-        sendAggregatedLoRaPacket();
-        lastForward = millis();
+    #if BLE_FILTER_MODE == BLE_FILTER_WHITELIST
+    if (wake & WAKE_SCAN_FILTER) {
+        serviceScanFilter();
+    }
+    #endif
+    #if SCAN_ADAPTIVE
+    if (wake & WAKE_SCAN_WINDOW) {
+        serviceScanWindow();
     }
     #endif
     
-    // Small delay to prevent watchdog issues
-    delay(10);
+    // Format deferred log records here, off the BLE and TX hot paths;
+    // come straight back if there are more than one batch
+    if ((wake & WAKE_LOG) && logDrain(LOG_DRAIN_PER_LOOP) == LOG_DRAIN_PER_LOOP) {
+        wakeLoop(WAKE_LOG);
+    }
 }
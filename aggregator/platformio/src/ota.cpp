@@ -0,0 +1,263 @@
+/*
+ * Delta firmware updates (see ota.h)
+ *
+ * The patch is inflated by the ROM's tinfl into a 32 KB window, and its
+ * operations are applied as the bytes come out, so neither the patch nor
+ * either image is ever held in RAM. ADD reads the base from the running
+ * partition; the new image goes to the other OTA partition with sequential
+ * writes, which erase sector by sector as they go instead of the whole
+ * partition up front (seconds the TX task would be blocked).
+ */
+
+#include "ota.h"
+
+#if OTA_ENABLED
+
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <rom/miniz.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+
+#define OTA_BLOCK_SIZE          256
+#define OTA_OP_HEADER_MAX       9       // ADD: opcode, base offset, length
+
+struct OtaSession {
+    tinfl_decompressor inflator;
+    uint8_t window[TINFL_LZ_DICT_SIZE];
+    size_t windowOffset;
+    bool inflated;              // End of the zlib stream seen
+
+    uint8_t header[OTA_OP_HEADER_MAX];  // Operation header being collected
+    int headerLength;
+    uint8_t opcode;
+    uint32_t remaining;         // Data bytes left in the current operation
+    uint32_t baseOffset;
+
+    const esp_partition_t* base;
+    const esp_partition_t* target;
+    esp_ota_handle_t handle;
+    bool handleOpen;
+    uint32_t baseSize;
+    uint32_t imageSize;
+    uint32_t imageCrc;
+    uint32_t written;
+    uint32_t crcState;          // Over the image written so far
+
+    uint8_t block[OTA_BLOCK_SIZE];
+};
+
+static OtaSession* session = nullptr;
+
+static uint32_t readU32(const uint8_t* data) {
+    return data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+// CRC-32 of the first `size` bytes of a partition
+static bool partitionCrc(const esp_partition_t* partition, uint32_t size, uint8_t* block, uint32_t* crc) {
+    if (size > partition->size) {
+        return false;
+    }
+    uint32_t state = crc32Begin();
+    for (uint32_t offset = 0; offset < size; offset += OTA_BLOCK_SIZE) {
+        uint32_t n = size - offset < OTA_BLOCK_SIZE ? size - offset : OTA_BLOCK_SIZE;
+        if (esp_partition_read(partition, offset, block, n) != ESP_OK) {
+            return false;
+        }
+        state = crc32Update(state, block, n);
+    }
+    *crc = crc32Finish(state);
+    return true;
+}
+
+bool otaRunningImageIs(uint32_t size, uint32_t crc) {
+    uint8_t block[OTA_BLOCK_SIZE];
+    uint32_t runningCrc;
+    return partitionCrc(esp_ota_get_running_partition(), size, block, &runningCrc) && runningCrc == crc;
+}
+
+bool otaBegin(const OtaBeginRecord& begin) {
+    otaAbort();
+    session = (OtaSession*)malloc(sizeof(OtaSession));
+    if (session == nullptr) {
+        LOG_ERROR("Firmware update: %u bytes of heap not available", (unsigned)sizeof(OtaSession));
+        return false;
+    }
+    memset(session, 0, sizeof(OtaSession));
+    tinfl_init(&session->inflator);
+    session->base = esp_ota_get_running_partition();
+    session->target = esp_ota_get_next_update_partition(nullptr);
+    session->baseSize = begin.baseSize;
+    session->imageSize = begin.imageSize;
+    session->imageCrc = begin.imageCrc;
+    session->crcState = crc32Begin();
+
+    if (session->target == nullptr || begin.imageSize > session->target->size) {
+        LOG_ERROR("Firmware update: no OTA partition for %u bytes", begin.imageSize);
+        otaAbort();
+        return false;
+    }
+    uint32_t baseCrc;
+    if (!partitionCrc(session->base, begin.baseSize, session->block, &baseCrc) || baseCrc != begin.baseCrc) {
+        LOG_WARN("Firmware update %u is a patch for another firmware", begin.sessionId);
+        otaAbort();
+        return false;
+    }
+    if (esp_ota_begin(session->target, OTA_WITH_SEQUENTIAL_WRITES, &session->handle) != ESP_OK) {
+        LOG_ERROR("Firmware update: OTA partition could not be opened");
+        otaAbort();
+        return false;
+    }
+    session->handleOpen = true;
+
+    LOG_INFO("Firmware update %u: %u byte patch, %u -> %u byte image", begin.sessionId,
+             begin.patchSize, begin.baseSize, begin.imageSize);
+    return true;
+}
+
+static bool writeImage(const uint8_t* data, size_t length) {
+    if (esp_ota_write(session->handle, data, length) != ESP_OK) {
+        LOG_ERROR("Firmware update: flash write failed at %u", session->written);
+        return false;
+    }
+    session->crcState = crc32Update(session->crcState, data, length);
+    session->written += length;
+    return true;
+}
+
+// Apply inflated patch bytes: operation headers, then their data
+static bool applyPatchBytes(const uint8_t* data, size_t length) {
+    OtaSession& s = *session;
+    while (length > 0) {
+        if (s.remaining == 0) {
+            s.header[s.headerLength++] = *data++;
+            length--;
+            int headerSize = s.header[0] == OTA_OP_ADD ? 9 : s.header[0] == OTA_OP_INSERT ? 5 : 0;
+            if (headerSize == 0) {
+                LOG_ERROR("Firmware update: unknown patch operation 0x%02X", s.header[0]);
+                return false;
+            }
+            if (s.headerLength < headerSize) {
+                continue;
+            }
+
+            s.opcode = s.header[0];
+            s.headerLength = 0;
+            if (s.opcode == OTA_OP_ADD) {
+                s.baseOffset = readU32(s.header + 1);
+                s.remaining = readU32(s.header + 5);
+                if (s.baseOffset > s.baseSize || s.remaining > s.baseSize - s.baseOffset) {
+                    LOG_ERROR("Firmware update: patch reads past the base image");
+                    return false;
+                }
+            } else {
+                s.remaining = readU32(s.header + 1);
+            }
+            if (s.remaining > s.imageSize - s.written) {
+                LOG_ERROR("Firmware update: patch writes past the image");
+                return false;
+            }
+            continue;
+        }
+
+        size_t n = length < s.remaining ? length : s.remaining;
+        if (n > OTA_BLOCK_SIZE) {
+            n = OTA_BLOCK_SIZE;
+        }
+        if (s.opcode == OTA_OP_ADD) {
+            if (esp_partition_read(s.base, s.baseOffset, s.block, n) != ESP_OK) {
+                return false;
+            }
+            for (size_t i = 0; i < n; i++) {
+                s.block[i] += data[i];
+            }
+            s.baseOffset += n;
+        } else {
+            memcpy(s.block, data, n);
+        }
+        if (!writeImage(s.block, n)) {
+            return false;
+        }
+        s.remaining -= n;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool otaWrite(const uint8_t* data, size_t length) {
+    if (session == nullptr || session->inflated) {
+        return false;
+    }
+    OtaSession& s = *session;
+    for (;;) {
+        size_t in = length;
+        size_t out = TINFL_LZ_DICT_SIZE - s.windowOffset;
+        tinfl_status status = tinfl_decompress(&s.inflator, data, &in, s.window, s.window + s.windowOffset,
+                                               &out, TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+        data += in;
+        length -= in;
+        if (out > 0 && !applyPatchBytes(s.window + s.windowOffset, out)) {
+            return false;
+        }
+        s.windowOffset = (s.windowOffset + out) & (TINFL_LZ_DICT_SIZE - 1);
+
+        if (status < TINFL_STATUS_DONE) {
+            LOG_ERROR("Firmware update: patch stream corrupt (%d)", (int)status);
+            return false;
+        }
+        if (status == TINFL_STATUS_DONE) {
+            s.inflated = true;
+            return length == 0;
+        }
+        if (status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+            return true;  // Everything consumed
+        }
+        // TINFL_STATUS_HAS_MORE_OUTPUT: the window is full, go round again
+    }
+}
+
+bool otaFinish() {
+    if (session == nullptr) {
+        return false;
+    }
+    OtaSession& s = *session;
+    bool complete = s.inflated && s.remaining == 0 && s.headerLength == 0 && s.written == s.imageSize;
+    if (!complete || crc32Finish(s.crcState) != s.imageCrc) {
+        LOG_ERROR("Firmware update: image %s (%u of %u bytes)", complete ? "CRC wrong" : "incomplete",
+                  s.written, s.imageSize);
+        otaAbort();
+        return false;
+    }
+
+    esp_err_t err = esp_ota_end(s.handle);  // Also checks the image's own checksum
+    s.handleOpen = false;
+    if (err == ESP_OK) {
+        err = esp_ota_set_boot_partition(s.target);
+    }
+    if (err != ESP_OK) {
+        LOG_ERROR("Firmware update: image rejected (%s)", esp_err_to_name(err));
+    } else {
+        LOG_INFO("Firmware update: %u byte image verified, boots next reset", s.written);
+    }
+    otaAbort();
+    return err == ESP_OK;
+}
+
+void otaAbort() {
+    if (session == nullptr) {
+        return;
+    }
+    if (session->handleOpen) {
+        esp_ota_abort(session->handle);
+    }
+    free(session);
+    session = nullptr;
+}
+
+void otaConfirmBoot() {
+    esp_ota_mark_app_valid_cancel_rollback();
+}
+
+#endif
@@ -0,0 +1,448 @@
+/*
+ * LoRa packet encoding and the readings/frame/keyframe/delta/offline/relayed
+ * senders (see packets.h). No Arduino or radio calls, times are passed in.
+ */
+
+#include "packets.h"
+
+#include <math.h>
+#include "log.h"
+
+uint16_t packetSequence = 0;
+
+// Set by packetsBegin(), both only change with a restart
+static uint8_t packetAggregatorId = AGGREGATOR_ID;
+static LoRaProfile packetProfile = LORA_PROFILE;
+
+void packetsBegin(uint8_t aggregatorId, const LoRaProfile& profile) {
+    packetAggregatorId = aggregatorId;
+    packetProfile = profile;
+}
+
+void writeTypedHeader(PacketWriter& writer, uint8_t packetType) {
+    writer.u8(packetType);
+    writer.u8(packetAggregatorId);
+    writer.u16(packetSequence);
+}
+
+// Milliseconds since the BLE advertisement was received, saturating
+static uint16_t readingAgeMs(const SensorReading& reading, uint32_t nowMs) {
+    uint32_t age = nowMs - reading.receivedMs;
+    return age > 0xFFFF ? 0xFFFF : age;
+}
+
+#if RECORD_FORMAT == RECORD_FORMAT_V2
+// v2 record quantization, field widths and ranges in packet_schema.h
+static uint8_t quantizeFreqLog(uint16_t freqX10) {
+    if (freqX10 == 0) {
+        return 0;
+    }
+    long code = 1 + lroundf(log2f(freqX10) * 24);
+    return code > 255 ? 255 : code;
+}
+
+static uint8_t quantizeAgeLog(uint16_t ageMs) {
+    uint32_t units = ageMs >> 6;
+    return units == 0 ? 0 : 32 - __builtin_clz(units);
+}
+
+static uint8_t quantizeBattery(uint8_t batteryPercent) {
+    uint32_t code = (batteryPercent * 15 + 50) / 100;
+    return code > 15 ? 15 : code;
+}
+#endif
+
+// Full machine record shared by readings, frame and keyframe packets
+static void writeMachineRecord(PacketWriter& writer, const SensorReading& reading, uint32_t nowMs) {
+    MachineRecord record;
+    record.machineId = reading.machineId;
+    #if RECORD_FORMAT == RECORD_FORMAT_V2
+    record.rmsX100 = reading.rmsX100 > 2047 ? 2047 : reading.rmsX100;
+    record.freqCode = quantizeFreqLog(reading.freqX10);
+    record.batteryCode = quantizeBattery(reading.batteryPercent);
+    record.meanX10 = reading.meanX100 / 10 > 255 ? 255 : reading.meanX100 / 10;
+    record.dryer = reading.machineType == 2;
+    record.ageCode = quantizeAgeLog(readingAgeMs(reading, nowMs));
+    record.flags = reading.flags;
+    #else
+    record.rmsX100 = reading.rmsX100;
+    record.freqX10 = reading.freqX10;
+    record.batteryPercent = reading.batteryPercent;
+    record.ageMs = readingAgeMs(reading, nowMs);
+    #endif
+    writeRecord(writer, record);
+}
+
+// Changed-machine record of a delta packet
+static void writeDeltaRecord(PacketWriter& writer, const SensorReading& reading, uint32_t nowMs) {
+    DeltaRecord record;
+    #if RECORD_FORMAT == RECORD_FORMAT_V2
+    record.rmsX100 = reading.rmsX100 > 2047 ? 2047 : reading.rmsX100;
+    record.batteryCode = quantizeBattery(reading.batteryPercent);
+    record.reserved = 0;
+    record.ageCode = quantizeAgeLog(readingAgeMs(reading, nowMs));
+    record.flags = reading.flags;
+    #else
+    record.rmsX100 = reading.rmsX100;
+    record.batteryPercent = reading.batteryPercent;
+    record.ageMs = readingAgeMs(reading, nowMs);
+    #endif
+    writeRecord(writer, record);
+}
+
+// Machine count byte, marks the record format
+static uint8_t recordCountByte(int count) {
+    #if RECORD_FORMAT == RECORD_FORMAT_V2
+    return count | RECORD_V2_FLAG;
+    #else
+    return count;
+    #endif
+}
+
+uint16_t saturate16(uint32_t value) {
+    return value > 0xFFFF ? 0xFFFF : value;
+}
+
+static size_t writeReadingsPacket(uint8_t* packet, size_t capacity, uint8_t packetType,
+                                  const SensorReading* readings, int count, uint32_t nowMs) {
+    /*
+     * Readings packet format (events packets are the same):
+     * Bytes 0-3: Typed header (PACKET_TYPE_READINGS, aggregator ID, sequence)
+     * Byte 4: Machine count (N), | RECORD_V2_FLAG for v2 records
+     * Bytes 5+: N machine records (MACHINE_RECORD_V1/V2_FIELDS)
+     * Last 4 bytes: CRC-32
+     */
+    PacketWriter writer(packet, capacity);
+    writeTypedHeader(writer, packetType);
+    writer.u8(recordCountByte(count));
+    for (int i = 0; i < count; i++) {
+        writeMachineRecord(writer, readings[i], nowMs);
+    }
+    writer.appendCrc32();
+    return writer.length;
+}
+
+uint32_t sendReadingsLoRaPacket(const SensorReading* readings, int count, uint32_t nowMs) {
+    if (count > MAX_MACHINES_PER_PACKET) {
+        count = MAX_MACHINES_PER_PACKET;
+    }
+
+    uint8_t packet[READINGS_PACKET_MAX];
+    size_t length = writeReadingsPacket(packet, sizeof(packet), PACKET_TYPE_READINGS,
+                                        readings, count, nowMs);
+
+    LOG_DEBUG("Sending LoRa packet %u with %d machines", packetSequence, count);
+
+    transmitLoRaPacket(packet, length);
+    return loraTimeOnAirMs(length, packetProfile);
+}
+
+bool sendEventsLoRaPacket(const SensorReading* readings, int count, uint32_t nowMs) {
+    if (count > MAX_MACHINES_PER_PACKET) {
+        count = MAX_MACHINES_PER_PACKET;
+    }
+
+    uint8_t packet[READINGS_PACKET_MAX];
+    size_t length = writeReadingsPacket(packet, sizeof(packet), PACKET_TYPE_EVENTS,
+                                        readings, count, nowMs);
+
+    LOG_INFO("Sending state-change events %u for %d machines", packetSequence, count);
+
+    return transmitLoRaPacket(packet, length);
+}
+
+#if MULTI_FRAME
+#define MAX_FRAME_RECORDS       ((LORA_MAX_PAYLOAD - typedPacketSize(PACKET_PREFIX_FRAME)) / MACHINE_RECORD_SIZE)
+
+// Most records per frame whose time on air stays within FRAME_AIRTIME_TARGET_MS
+static int recordsPerFrame() {
+    int records = MAX_FRAME_RECORDS;
+    while (records > 1 &&
+           loraTimeOnAirMs(typedPacketSize(PACKET_PREFIX_FRAME + records * MACHINE_RECORD_SIZE),
+                           packetProfile) > FRAME_AIRTIME_TARGET_MS) {
+        records--;
+    }
+    return records;
+}
+
+static uint8_t lastRoundId = 0;
+
+uint32_t sendReadingFrames(const SensorReading* readings, int count, uint32_t nowMs) {
+    /*
+     * Frame packet format:
+     * Bytes 0-3: Typed header (PACKET_TYPE_FRAME, aggregator ID, sequence)
+     * Byte 4: Round ID (same for all frames of one round)
+     * Byte 5: Frame index (0-based)
+     * Byte 6: Frame total
+     * Byte 7: Machine count (N), | RECORD_V2_FLAG for v2 records
+     * Bytes 8+: N machine records (same layout as readings packet)
+     * Last 4 bytes: CRC-32
+     */
+    const int perFrame = recordsPerFrame();
+    int total = (count + perFrame - 1) / perFrame;
+    if (total > 255) {
+        total = 255;
+        count = total * perFrame;
+    }
+    uint8_t roundId = ++lastRoundId;
+    uint32_t airtimeMs = 0;
+
+    for (int frame = 0; frame < total; frame++) {
+        int first = frame * perFrame;
+        int n = count - first < perFrame ? count - first : perFrame;
+
+        uint8_t packet[LORA_MAX_PAYLOAD];
+        PacketWriter writer(packet, sizeof(packet));
+        writeTypedHeader(writer, PACKET_TYPE_FRAME);
+        writer.u8(roundId);
+        writer.u8(frame);
+        writer.u8(total);
+        writer.u8(recordCountByte(n));
+        for (int i = 0; i < n; i++) {
+            writeMachineRecord(writer, readings[first + i], nowMs);
+        }
+        writer.appendCrc32();
+
+        LOG_DEBUG("Sending round %d frame %d/%d with %d machines", roundId, frame + 1, total, n);
+
+        airtimeMs += loraTimeOnAirMs(writer.length, packetProfile);
+        transmitLoRaPacket(packet, writer.length);
+    }
+    return airtimeMs;
+}
+#endif
+
+#if DELTA_ENCODING
+DeltaState deltaStates[SENSOR_GROUPS] = {};
+static uint8_t lastKeyframeId = 0;
+
+static bool isRunningRms(uint16_t rmsX100) {
+    return rmsX100 >= DELTA_RUNNING_RMS_X100;
+}
+
+static int keyframeIndexOf(const DeltaState& state, uint8_t machineId) {
+    for (int i = 0; i < state.count; i++) {
+        if (state.machineIds[i] == machineId) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static uint32_t sendKeyframeLoRaPacket(DeltaState& state, const SensorReading* readings, int count,
+                                       uint32_t nowMs) {
+    /*
+     * Keyframe packet format:
+     * Bytes 0-3: Typed header (PACKET_TYPE_KEYFRAME, aggregator ID, sequence)
+     * Byte 4: Keyframe ID (referenced by following deltas)
+     * Byte 5: Machine count (K), | RECORD_V2_FLAG for v2 records
+     * Bytes 6+: K machine records (same layout as readings packet)
+     * Last 4 bytes: CRC-32
+     */
+    if (count > MAX_MACHINES_PER_PACKET) {
+        count = MAX_MACHINES_PER_PACKET;
+    }
+
+    uint8_t keyframeId = lastKeyframeId + 1;
+    uint8_t packet[KEYFRAME_PACKET_MAX];
+    PacketWriter writer(packet, sizeof(packet));
+    writeTypedHeader(writer, PACKET_TYPE_KEYFRAME);
+    writer.u8(keyframeId);
+    writer.u8(recordCountByte(count));
+    for (int i = 0; i < count; i++) {
+        writeMachineRecord(writer, readings[i], nowMs);
+    }
+    writer.appendCrc32();
+
+    LOG_DEBUG("Sending keyframe %d with %d machines", keyframeId, count);
+
+    uint32_t airtimeMs = loraTimeOnAirMs(writer.length, packetProfile);
+    if (!transmitLoRaPacket(packet, writer.length)) {
+        return airtimeMs;
+    }
+
+    lastKeyframeId = keyframeId;
+    state.valid = true;
+    state.keyframeId = keyframeId;
+    state.count = count;
+    state.deltasSinceKeyframe = 0;
+    for (int i = 0; i < count; i++) {
+        state.machineIds[i] = readings[i].machineId;
+        state.sentRmsX100[i] = readings[i].rmsX100;
+        state.sentFlags[i] = readings[i].flags;
+    }
+    return airtimeMs;
+}
+
+uint32_t sendDeltaLoRaPacket(DeltaState& state, const SensorReading* readings, int count, uint32_t nowMs) {
+    /*
+     * Delta packet format:
+     * Bytes 0-3: Typed header (PACKET_TYPE_DELTA, aggregator ID, sequence)
+     * Byte 4: Keyframe ID this delta applies to
+     * Byte 5: Keyframe machine count (K), | RECORD_V2_FLAG for v2 records
+     * Next B = ceil(K/8) bytes: presence bitmap (bit i = keyframe machine i still online)
+     * Next B bytes: change bitmap (bit i = record follows for keyframe machine i)
+     * Then one record per changed machine, in keyframe order (DELTA_RECORD_V1/V2_FIELDS)
+     * Last 4 bytes: CRC-32
+     */
+    bool needKeyframe = !state.valid ||
+                        state.deltasSinceKeyframe >= DELTA_KEYFRAME_EVERY;
+    for (int i = 0; i < count && !needKeyframe; i++) {
+        needKeyframe = keyframeIndexOf(state, readings[i].machineId) < 0;
+    }
+    if (needKeyframe) {
+        return sendKeyframeLoRaPacket(state, readings, count, nowMs);
+    }
+
+    // Decide per keyframe machine: still present? changed enough to resend?
+    const int bitmapBytes = (state.count + 7) / 8;
+    uint8_t present[DELTA_BITMAP_SIZE] = {};
+    uint8_t changed[DELTA_BITMAP_SIZE] = {};
+    const SensorReading* current[MAX_MACHINES_PER_PACKET] = {};
+    int changedCount = 0;
+
+    for (int k = 0; k < state.count; k++) {
+        for (int i = 0; i < count; i++) {
+            if (readings[i].machineId == state.machineIds[k]) {
+                current[k] = &readings[i];
+                break;
+            }
+        }
+        if (current[k] == nullptr) {
+            continue;  // Went offline since the keyframe
+        }
+        present[k / 8] |= 1 << (k % 8);
+
+        uint16_t rms = current[k]->rmsX100;
+        uint16_t sent = state.sentRmsX100[k];
+        uint16_t diff = rms > sent ? rms - sent : sent - rms;
+        bool flagsChanged = RECORD_FORMAT == RECORD_FORMAT_V2 &&
+                            ((current[k]->flags ^ state.sentFlags[k]) & 0x07) != 0;
+        if (diff > DELTA_RMS_THRESHOLD_X100 || isRunningRms(rms) != isRunningRms(sent) ||
+            flagsChanged) {
+            changed[k / 8] |= 1 << (k % 8);
+            changedCount++;
+        }
+    }
+
+    uint8_t packet[DELTA_PACKET_MAX];
+    PacketWriter writer(packet, sizeof(packet));
+    writeTypedHeader(writer, PACKET_TYPE_DELTA);
+    writer.u8(state.keyframeId);
+    writer.u8(recordCountByte(state.count));
+    writer.bytes(present, bitmapBytes);
+    writer.bytes(changed, bitmapBytes);
+    for (int k = 0; k < state.count; k++) {
+        if (changed[k / 8] & (1 << (k % 8))) {
+            writeDeltaRecord(writer, *current[k], nowMs);
+        }
+    }
+    writer.appendCrc32();
+
+    LOG_DEBUG("Sending delta on keyframe %d: %d of %d machines changed (%d bytes)",
+              state.keyframeId, changedCount, state.count, (int)writer.length);
+
+    uint32_t airtimeMs = loraTimeOnAirMs(writer.length, packetProfile);
+    if (!transmitLoRaPacket(packet, writer.length)) {
+        return airtimeMs;
+    }
+
+    state.deltasSinceKeyframe++;
+    for (int k = 0; k < state.count; k++) {
+        if (changed[k / 8] & (1 << (k % 8))) {
+            state.sentRmsX100[k] = current[k]->rmsX100;
+            state.sentFlags[k] = current[k]->flags;
+        }
+    }
+    return airtimeMs;
+}
+#endif
+
+void sendOfflineLoRaPacket(const uint8_t* machineIds, const uint16_t* silentSec, int count) {
+    /*
+     * Offline packet format:
+     * Bytes 0-3: Typed header (PACKET_TYPE_OFFLINE, aggregator ID, sequence)
+     * Byte 4: Machine count (N)
+     * Bytes 5+: N offline records (OFFLINE_RECORD_FIELDS)
+     * Last 4 bytes: CRC-32
+     */
+    uint8_t packet[OFFLINE_PACKET_MAX];
+    PacketWriter writer(packet, sizeof(packet));
+    writeTypedHeader(writer, PACKET_TYPE_OFFLINE);
+    writer.u8(count);
+    for (int i = 0; i < count; i++) {
+        OfflineRecord record;
+        record.machineId = machineIds[i];
+        record.silentS = silentSec[i];
+        writeRecord(writer, record);
+    }
+    writer.appendCrc32();
+
+    LOG_INFO("Sending offline event for %d machines", count);
+    transmitLoRaPacket(packet, writer.length);
+}
+
+#if RELAY_ENABLED
+// Add the time a relayed record was held here to its age
+static void addRelayHold(MachineRecord& record, uint32_t heldMs) {
+    #if RECORD_FORMAT == RECORD_FORMAT_V2
+    // From the middle of the code's range, which quantizes back to the same code
+    uint32_t ageMs = record.ageCode == 0 ? 0 : record.ageCode > 10 ? 0xFFFF : 96u << (record.ageCode - 1);
+    record.ageCode = quantizeAgeLog(saturate16(ageMs + heldMs));
+    #else
+    record.ageMs = saturate16(record.ageMs + heldMs);
+    #endif
+}
+
+static bool sameRelayGroup(const RelayedRecord& a, const RelayedRecord& b) {
+    return a.sourceId == b.sourceId && a.sourceSeq == b.sourceSeq;
+}
+
+uint32_t sendRelayedLoRaPackets(const RelayedRecord* records, int count, uint32_t nowMs) {
+    /*
+     * Relayed packet format:
+     * Bytes 0-3: Typed header (PACKET_TYPE_RELAYED, relay's aggregator ID, sequence)
+     * Byte 4: Group count (G)
+     * G groups: RELAY_GROUP_FIELDS (source ID, source sequence,
+     *           count N | RECORD_V2_FLAG), then N machine records (same
+     *           layout as readings packet) of that source packet
+     * Last 4 bytes: CRC-32
+     */
+    uint32_t airtimeMs = 0;
+    for (int first = 0; first < count; first += MAX_MACHINES_PER_PACKET) {
+        int last = count - first < MAX_MACHINES_PER_PACKET ? count : first + MAX_MACHINES_PER_PACKET;
+        int groups = 1;
+        for (int i = first + 1; i < last; i++) {
+            groups += !sameRelayGroup(records[i], records[i - 1]);
+        }
+
+        uint8_t packet[RELAYED_PACKET_MAX];
+        PacketWriter writer(packet, sizeof(packet));
+        writeTypedHeader(writer, PACKET_TYPE_RELAYED);
+        writer.u8(groups);
+        for (int i = first; i < last; ) {
+            int run = 1;
+            while (i + run < last && sameRelayGroup(records[i + run], records[i])) {
+                run++;
+            }
+            RelayGroupRecord group;
+            group.sourceId = records[i].sourceId;
+            group.sourceSeq = records[i].sourceSeq;
+            group.count = recordCountByte(run);
+            writeRecord(writer, group);
+            for (; run > 0; run--, i++) {
+                MachineRecord record = records[i].record;
+                addRelayHold(record, nowMs - records[i].receivedMs);
+                writeRecord(writer, record);
+            }
+        }
+        writer.appendCrc32();
+
+        LOG_DEBUG("Relaying %d machines of %d aggregators in packet %u", last - first, groups, packetSequence);
+
+        airtimeMs += loraTimeOnAirMs(writer.length, packetProfile);
+        transmitLoRaPacket(packet, writer.length);
+    }
+    return airtimeMs;
+}
+#endif
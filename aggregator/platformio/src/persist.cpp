@@ -0,0 +1,191 @@
+/*
+ * State kept across resets (see persist.h)
+ *
+ * RTC slow memory is not cleared by software, watchdog or panic resets,
+ * but holds garbage after power-up: a record only counts if its magic and
+ * CRC-32 match. The magic is cleared while a record is rewritten, so a
+ * reset in the middle of a save leaves no half-written record behind.
+ *
+ * NVS lives in flash, so it only gets what is worth keeping through power
+ * loss and only when it changed: the node addresses after a discovery that
+ * found a new one, the airtime sum at most every PERSIST_NVS_INTERVAL_MS.
+ */
+
+#include "persist.h"
+
+#if PERSIST_ENABLED
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <esp_attr.h>
+#include <string.h>
+#include <sys/time.h>
+#include "crc32.h"
+#include "log.h"
+
+#define PERSIST_MAGIC_RUNTIME   0x314E5552  // "RUN1"
+#define PERSIST_MAGIC_NODES     0x31444F4E  // "NOD1"
+#define PERSIST_BUCKET_MS       (DUTY_CYCLE_WINDOW_MS / PERSIST_AIRTIME_BUCKETS)
+
+struct RtcRuntime {
+    uint32_t magic;
+    uint32_t crc;               // Over everything below
+    uint32_t savedMs;           // millis() at the save
+    int64_t savedSystemUs;      // System time at the save
+    PersistedRuntime runtime;
+};
+
+struct RtcNodes {
+    uint32_t magic;
+    uint32_t crc;
+    PersistedNodes nodes;
+};
+
+RTC_NOINIT_ATTR static RtcRuntime rtcRuntime;
+RTC_NOINIT_ATTR static RtcNodes rtcNodes;
+
+static Preferences nvs;
+static bool nvsReady = false;
+static uint32_t nvsAirtimeMs = 0;           // Value in NVS
+static uint32_t nvsAirtimeSavedMs = 0;      // When it was written
+static bool nvsAirtimeWritten = false;      // Written since boot
+
+template <typename Record>
+static uint32_t recordCrc(const Record& record) {
+    const uint8_t* start = (const uint8_t*)&record.crc + sizeof(record.crc);
+    return crc32(start, (const uint8_t*)(&record + 1) - start);
+}
+
+template <typename Record>
+static bool recordValid(const Record& record, uint32_t magic) {
+    return record.magic == magic && record.crc == recordCrc(record);
+}
+
+static int64_t systemTimeUs() {
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+void persistBegin() {
+    nvsReady = nvs.begin("aggregator", false);
+    if (!nvsReady) {
+        LOG_WARN("NVS not available, nothing survives power loss");
+        return;
+    }
+    nvsAirtimeMs = nvs.getULong("airtime", 0);
+}
+
+static uint32_t airtimeSum(const PersistedRuntime& runtime) {
+    uint32_t sum = 0;
+    for (int i = 0; i < PERSIST_AIRTIME_BUCKETS; i++) {
+        sum += runtime.airtimeMs[i];
+    }
+    return sum;
+}
+
+// Move a record saved elapsedMs ago into this boot's millis()
+static void rebaseRuntime(PersistedRuntime& runtime, uint32_t savedMs, uint32_t elapsedMs) {
+    uint32_t offset = millis() - elapsedMs - savedMs;
+    for (int i = 0; i < runtime.sensorCount; i++) {
+        SensorData& data = runtime.sensors[i];
+        data.lastSeenMs += offset;
+        data.wakeStartMs += offset;
+    }
+
+    uint32_t shift = elapsedMs / PERSIST_BUCKET_MS;
+    for (int i = PERSIST_AIRTIME_BUCKETS - 1; i >= 0; i--) {
+        runtime.airtimeMs[i] = (uint32_t)i >= shift ? runtime.airtimeMs[i - shift] : 0;
+    }
+}
+
+PersistSource persistLoadRuntime(PersistedRuntime& runtime) {
+    memset(&runtime, 0, sizeof(runtime));
+
+    if (recordValid(rtcRuntime, PERSIST_MAGIC_RUNTIME)) {
+        runtime = rtcRuntime.runtime;
+        if (runtime.sensorCount < 0 || runtime.sensorCount > MAX_SENSORS) {
+            runtime.sensorCount = 0;
+        }
+
+        int64_t elapsedUs = systemTimeUs() - rtcRuntime.savedSystemUs;
+        if (elapsedUs >= 0 && elapsedUs <= (int64_t)PERSIST_MAX_DOWNTIME_MS * 1000) {
+            rebaseRuntime(runtime, rtcRuntime.savedMs, (uint32_t)(elapsedUs / 1000));
+        } else {
+            // Readings of unknown age; the airtime counts as if just used
+            runtime.sensorCount = 0;
+        }
+        LOG_INFO("Warm start: sequence %u, %d sensor slots restored",
+                 runtime.packetSequence, runtime.sensorCount);
+        return PERSIST_RTC;
+    }
+
+    if (nvsReady && nvs.isKey("airtime")) {
+        runtime.airtimeMs[0] = nvsAirtimeMs;
+        LOG_INFO("Cold start: %u ms airtime carried over", nvsAirtimeMs);
+        return PERSIST_NVS;
+    }
+    return PERSIST_NONE;
+}
+
+void persistSaveRuntime(const PersistedRuntime& runtime) {
+    rtcRuntime.magic = 0;
+    rtcRuntime.savedMs = millis();
+    rtcRuntime.savedSystemUs = systemTimeUs();
+    rtcRuntime.runtime = runtime;
+    rtcRuntime.crc = recordCrc(rtcRuntime);
+    rtcRuntime.magic = PERSIST_MAGIC_RUNTIME;
+
+    uint32_t airtime = airtimeSum(runtime);
+    uint32_t now = millis();
+    if (!nvsReady || airtime == nvsAirtimeMs ||
+        (nvsAirtimeWritten && now - nvsAirtimeSavedMs < PERSIST_NVS_INTERVAL_MS)) {
+        return;
+    }
+    nvs.putULong("airtime", airtime);
+    nvsAirtimeMs = airtime;
+    nvsAirtimeSavedMs = now;
+    nvsAirtimeWritten = true;
+}
+
+bool persistLoadNodes(PersistedNodes& nodes) {
+    nodes.count = 0;
+    if (recordValid(rtcNodes, PERSIST_MAGIC_NODES) &&
+        rtcNodes.nodes.count >= 0 && rtcNodes.nodes.count <= BLE_WHITELIST_MAX) {
+        nodes = rtcNodes.nodes;
+        return nodes.count > 0;
+    }
+
+    if (!nvsReady) {
+        return false;
+    }
+    size_t length = nvs.getBytesLength("nodes");
+    if (length == 0 || length % sizeof(NodeAddress) != 0 || length > sizeof(nodes.addresses)) {
+        return false;
+    }
+    nvs.getBytes("nodes", nodes.addresses, length);
+    nodes.count = length / sizeof(NodeAddress);
+    return true;
+}
+
+void persistSaveNodes(const PersistedNodes& nodes) {
+    rtcNodes.magic = 0;
+    rtcNodes.nodes = nodes;
+    rtcNodes.crc = recordCrc(rtcNodes);
+    rtcNodes.magic = PERSIST_MAGIC_NODES;
+
+    if (!nvsReady || nodes.count == 0) {
+        return;
+    }
+    size_t length = nodes.count * sizeof(NodeAddress);
+    NodeAddress stored[BLE_WHITELIST_MAX];
+    if (nvs.getBytesLength("nodes") == length &&
+        nvs.getBytes("nodes", stored, length) == length &&
+        memcmp(stored, nodes.addresses, length) == 0) {
+        return;  // Unchanged, spare the flash
+    }
+    nvs.putBytes("nodes", nodes.addresses, length);
+    LOG_INFO("Saved %d node addresses to NVS", nodes.count);
+}
+
+#endif
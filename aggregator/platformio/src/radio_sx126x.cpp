@@ -0,0 +1,383 @@
+/*
+ * Native SX126x radio backend (SX1261/62 command interface, DS_SX1261-2)
+ *
+ * Every SPI command is preceded by the BUSY handshake: the chip holds BUSY
+ * high while it processes the previous command, and anything clocked in
+ * meanwhile is lost. BUSY is polled instead of waiting a fixed time, so a
+ * command goes out as soon as the chip can take it (typically a few µs).
+ */
+
+#include "radio.h"
+
+#if LORA_RADIO == LORA_RADIO_SX126X
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <initializer_list>
+
+// Opcodes
+#define SX126X_SET_SLEEP                0x84
+#define SX126X_SET_STANDBY              0x80
+#define SX126X_SET_TX                   0x83
+#define SX126X_SET_RX                   0x82
+#define SX126X_SET_CAD                  0xC5
+#define SX126X_SET_CAD_PARAMS           0x88
+#define SX126X_SET_RX_TX_FALLBACK_MODE  0x93
+#define SX126X_SET_REGULATOR_MODE       0x96
+#define SX126X_CALIBRATE                0x89
+#define SX126X_CALIBRATE_IMAGE          0x98
+#define SX126X_SET_PA_CONFIG            0x95
+#define SX126X_WRITE_REGISTER           0x0D
+#define SX126X_READ_REGISTER            0x1D
+#define SX126X_WRITE_BUFFER             0x0E
+#define SX126X_READ_BUFFER              0x1E
+#define SX126X_SET_DIO_IRQ_PARAMS       0x08
+#define SX126X_GET_IRQ_STATUS           0x12
+#define SX126X_CLEAR_IRQ_STATUS         0x02
+#define SX126X_GET_RX_BUFFER_STATUS     0x13
+#define SX126X_SET_DIO2_AS_RF_SWITCH    0x9D
+#define SX126X_SET_DIO3_AS_TCXO_CTRL    0x97
+#define SX126X_SET_RF_FREQUENCY         0x86
+#define SX126X_SET_PACKET_TYPE          0x8A
+#define SX126X_SET_TX_PARAMS            0x8E
+#define SX126X_SET_MODULATION_PARAMS    0x8B
+#define SX126X_SET_PACKET_PARAMS        0x8C
+#define SX126X_SET_BUFFER_BASE_ADDRESS  0x8F
+#define SX126X_CLEAR_DEVICE_ERRORS      0x07
+
+// Registers
+#define SX126X_REG_SYNC_WORD            0x0740  // 2 bytes
+#define SX126X_REG_TX_CLAMP_CONFIG      0x08D8
+#define SX126X_REG_OCP                  0x08E7
+
+// Command arguments
+#define SX126X_STANDBY_RC               0x00
+#define SX126X_STANDBY_XOSC             0x01
+#define SX126X_FALLBACK_STANDBY_XOSC    0x30
+#define SX126X_PACKET_TYPE_LORA         0x01
+#define SX126X_REGULATOR_DC_DC          0x01
+#define SX126X_CALIBRATE_ALL            0x7F
+#define SX126X_RAMP_200_US              0x04
+#define SX126X_CAD_ON_2_SYMB            0x01
+#define SX126X_CAD_ON_4_SYMB            0x02
+#define SX126X_CAD_ONLY                 0x00
+#define SX126X_IRQ_TX_DONE              0x0001
+#define SX126X_IRQ_RX_DONE              0x0002
+#define SX126X_IRQ_HEADER_ERR           0x0020
+#define SX126X_IRQ_CRC_ERR              0x0040
+#define SX126X_IRQ_CAD_DONE             0x0080
+#define SX126X_IRQ_CAD_DETECTED         0x0100
+#define SX126X_IRQ_TIMEOUT              0x0200
+#define SX126X_IRQ_ALL                  0x03FF
+
+#define SX126X_BUSY_TIMEOUT_US          10000   // Calibration is the slowest (~3.5 ms)
+
+static const SPISettings sx126xSpi(8000000, MSBFIRST, SPI_MODE0);
+
+// Block until the chip accepts the next command, false if it never does
+static bool waitWhileBusy() {
+    uint32_t start = micros();
+    while (digitalRead(LORA_BUSY_PIN) == HIGH) {
+        if (micros() - start > SX126X_BUSY_TIMEOUT_US) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool command(uint8_t opcode, const uint8_t* params, size_t length) {
+    if (!waitWhileBusy()) {
+        return false;
+    }
+    SPI.beginTransaction(sx126xSpi);
+    digitalWrite(LORA_CS_PIN, LOW);
+    SPI.transfer(opcode);
+    for (size_t i = 0; i < length; i++) {
+        SPI.transfer(params[i]);
+    }
+    digitalWrite(LORA_CS_PIN, HIGH);
+    SPI.endTransaction();
+    return true;
+}
+
+static bool command(uint8_t opcode, std::initializer_list<uint8_t> params) {
+    return command(opcode, params.begin(), params.size());
+}
+
+// Opcode and params, then the status byte, then clock out the response
+static bool readCommand(uint8_t opcode, std::initializer_list<uint8_t> params,
+                        uint8_t* response, size_t length) {
+    if (!waitWhileBusy()) {
+        return false;
+    }
+    SPI.beginTransaction(sx126xSpi);
+    digitalWrite(LORA_CS_PIN, LOW);
+    SPI.transfer(opcode);
+    for (uint8_t param : params) {
+        SPI.transfer(param);
+    }
+    SPI.transfer(0x00);  // Status byte
+    for (size_t i = 0; i < length; i++) {
+        response[i] = SPI.transfer(0x00);
+    }
+    digitalWrite(LORA_CS_PIN, HIGH);
+    SPI.endTransaction();
+    return true;
+}
+
+static bool writeRegister(uint16_t address, const uint8_t* data, size_t length) {
+    if (!waitWhileBusy()) {
+        return false;
+    }
+    SPI.beginTransaction(sx126xSpi);
+    digitalWrite(LORA_CS_PIN, LOW);
+    SPI.transfer(SX126X_WRITE_REGISTER);
+    SPI.transfer(address >> 8);
+    SPI.transfer(address & 0xFF);
+    for (size_t i = 0; i < length; i++) {
+        SPI.transfer(data[i]);
+    }
+    digitalWrite(LORA_CS_PIN, HIGH);
+    SPI.endTransaction();
+    return true;
+}
+
+static bool readRegister(uint16_t address, uint8_t* data, size_t length) {
+    if (!waitWhileBusy()) {
+        return false;
+    }
+    SPI.beginTransaction(sx126xSpi);
+    digitalWrite(LORA_CS_PIN, LOW);
+    SPI.transfer(SX126X_READ_REGISTER);
+    SPI.transfer(address >> 8);
+    SPI.transfer(address & 0xFF);
+    SPI.transfer(0x00);  // Status byte
+    for (size_t i = 0; i < length; i++) {
+        data[i] = SPI.transfer(0x00);
+    }
+    digitalWrite(LORA_CS_PIN, HIGH);
+    SPI.endTransaction();
+    return true;
+}
+
+static bool writeBuffer(uint8_t offset, const uint8_t* data, size_t length) {
+    if (!waitWhileBusy()) {
+        return false;
+    }
+    SPI.beginTransaction(sx126xSpi);
+    digitalWrite(LORA_CS_PIN, LOW);
+    SPI.transfer(SX126X_WRITE_BUFFER);
+    SPI.transfer(offset);
+    for (size_t i = 0; i < length; i++) {
+        SPI.transfer(data[i]);
+    }
+    digitalWrite(LORA_CS_PIN, HIGH);
+    SPI.endTransaction();
+    return true;
+}
+
+static uint8_t bandwidthCode(uint32_t hz) {
+    switch (hz) {
+        case 7800:   return 0x00;
+        case 10400:  return 0x08;
+        case 15600:  return 0x01;
+        case 20800:  return 0x09;
+        case 31250:  return 0x02;
+        case 41700:  return 0x0A;
+        case 62500:  return 0x03;
+        case 250000: return 0x05;
+        case 500000: return 0x06;
+        default:     return 0x04;  // 125 kHz
+    }
+}
+
+// Image calibration band limits (DS_SX1261-2, 9.2.1), in 4 MHz steps
+static void calibrateImage(float mhz) {
+    if (mhz >= 902) {
+        command(SX126X_CALIBRATE_IMAGE, {0xE1, 0xE9});
+    } else if (mhz >= 863) {
+        command(SX126X_CALIBRATE_IMAGE, {0xD7, 0xDB});
+    } else if (mhz >= 779) {
+        command(SX126X_CALIBRATE_IMAGE, {0xC1, 0xC5});
+    } else if (mhz >= 470) {
+        command(SX126X_CALIBRATE_IMAGE, {0x75, 0x81});
+    } else {
+        command(SX126X_CALIBRATE_IMAGE, {0x6B, 0x6F});
+    }
+}
+
+static uint16_t preambleLength = LORA_PREAMBLE_LENGTH;
+
+static bool setPacketParams(uint8_t payloadLength) {
+    return command(SX126X_SET_PACKET_PARAMS, {
+        (uint8_t)(preambleLength >> 8), (uint8_t)(preambleLength & 0xFF),
+        0x00,                   // Explicit header
+        payloadLength,
+        LORA_HW_CRC ? (uint8_t)0x01 : (uint8_t)0x00,
+        0x00                    // Standard IQ
+    });
+}
+
+static void clearIrqStatus() {
+    command(SX126X_CLEAR_IRQ_STATUS, {(uint8_t)(SX126X_IRQ_ALL >> 8), (uint8_t)SX126X_IRQ_ALL});
+}
+
+bool radioBegin(RadioIrqHandler irq, const LoRaProfile& profile, int8_t txPower) {
+    pinMode(LORA_CS_PIN, OUTPUT);
+    digitalWrite(LORA_CS_PIN, HIGH);
+    pinMode(LORA_BUSY_PIN, INPUT);
+    pinMode(LORA_DIO1_PIN, INPUT);
+    pinMode(LORA_RST_PIN, OUTPUT);
+
+    digitalWrite(LORA_RST_PIN, LOW);
+    delay(1);
+    digitalWrite(LORA_RST_PIN, HIGH);
+    delay(5);
+
+    if (!command(SX126X_SET_STANDBY, {SX126X_STANDBY_RC})) {
+        return false;
+    }
+
+    #ifdef LORA_TCXO_VOLTAGE
+    // TCXO supplied from DIO3, 5 ms startup (in 15.625 µs steps)
+    command(SX126X_SET_DIO3_AS_TCXO_CTRL, {LORA_TCXO_VOLTAGE, 0x00, 0x01, 0x40});
+    command(SX126X_CALIBRATE, {SX126X_CALIBRATE_ALL});
+    command(SX126X_CLEAR_DEVICE_ERRORS, {0x00, 0x00});  // XOSC start error before the TCXO ran
+    #endif
+
+    command(SX126X_SET_PACKET_TYPE, {SX126X_PACKET_TYPE_LORA});
+    command(SX126X_SET_REGULATOR_MODE, {SX126X_REGULATOR_DC_DC});
+    #if LORA_DIO2_RF_SWITCH
+    command(SX126X_SET_DIO2_AS_RF_SWITCH, {0x01});
+    #endif
+
+    uint32_t frf = (uint32_t)((double)LORA_FREQUENCY * 1E6 * (1 << 25) / 32E6);
+    calibrateImage(LORA_FREQUENCY);
+    command(SX126X_SET_RF_FREQUENCY, {
+        (uint8_t)(frf >> 24), (uint8_t)(frf >> 16), (uint8_t)(frf >> 8), (uint8_t)frf
+    });
+
+    // SX1262 high-power PA, SetTxParams scales the output down to txPower
+    command(SX126X_SET_PA_CONFIG, {0x04, 0x07, 0x00, 0x01});
+    command(SX126X_SET_TX_PARAMS, {(uint8_t)txPower, SX126X_RAMP_200_US});
+    uint8_t ocp = 0x38;  // 140 mA, SetPaConfig resets it to 60 mA
+    writeRegister(SX126X_REG_OCP, &ocp, 1);
+
+    // Better PA clamping with antenna mismatch (DS_SX1261-2, 15.2)
+    uint8_t clamp;
+    readRegister(SX126X_REG_TX_CLAMP_CONFIG, &clamp, 1);
+    clamp |= 0x1E;
+    writeRegister(SX126X_REG_TX_CLAMP_CONFIG, &clamp, 1);
+
+    command(SX126X_SET_BUFFER_BASE_ADDRESS, {0x00, 0x00});
+
+    command(SX126X_SET_MODULATION_PARAMS, {
+        profile.spreadingFactor,
+        bandwidthCode(profile.bandwidthHz),
+        (uint8_t)(profile.codingRate - 4),
+        loraSymbolUs(profile) > 16000 ? (uint8_t)0x01 : (uint8_t)0x00   // Low data rate optimization
+    });
+    preambleLength = profile.preambleLength;
+    setPacketParams(0xFF);
+
+    // SX127x single-byte sync word 0xXY maps to 0xX4 0xY4
+    uint8_t syncWord[2] = {
+        (uint8_t)((LORA_SYNC_WORD & 0xF0) | 0x04),
+        (uint8_t)(((LORA_SYNC_WORD & 0x0F) << 4) | 0x04)
+    };
+    writeRegister(SX126X_REG_SYNC_WORD, syncWord, 2);
+
+    // Read back to detect a missing or unresponsive chip
+    uint8_t check[2] = {0, 0};
+    if (!readRegister(SX126X_REG_SYNC_WORD, check, 2) ||
+        check[0] != syncWord[0] || check[1] != syncWord[1]) {
+        return false;
+    }
+
+    // CAD detection thresholds after AN1200.48: peak SF + 14, minimum 10
+    command(SX126X_SET_CAD_PARAMS, {
+        profile.spreadingFactor < 9 ? (uint8_t)SX126X_CAD_ON_2_SYMB : (uint8_t)SX126X_CAD_ON_4_SYMB,
+        (uint8_t)(profile.spreadingFactor + 14), 10,
+        SX126X_CAD_ONLY, 0x00, 0x00, 0x00
+    });
+
+    uint16_t irqMask = SX126X_IRQ_TX_DONE | SX126X_IRQ_RX_DONE | SX126X_IRQ_HEADER_ERR |
+                       SX126X_IRQ_CRC_ERR | SX126X_IRQ_CAD_DONE | SX126X_IRQ_CAD_DETECTED |
+                       SX126X_IRQ_TIMEOUT;
+    command(SX126X_SET_DIO_IRQ_PARAMS, {
+        (uint8_t)(irqMask >> 8), (uint8_t)irqMask,   // Enabled IRQs
+        (uint8_t)(irqMask >> 8), (uint8_t)irqMask,   // Routed to DIO1
+        0x00, 0x00, 0x00, 0x00                       // DIO2/DIO3 unused
+    });
+    attachInterrupt(digitalPinToInterrupt(LORA_DIO1_PIN), irq, RISING);
+
+    // Stay on the crystal between packets so SetTx starts without XOSC startup
+    command(SX126X_SET_RX_TX_FALLBACK_MODE, {SX126X_FALLBACK_STANDBY_XOSC});
+    return command(SX126X_SET_STANDBY, {SX126X_STANDBY_XOSC});
+}
+
+void radioSetTxPower(int8_t dbm) {
+    command(SX126X_SET_TX_PARAMS, {(uint8_t)dbm, SX126X_RAMP_200_US});
+}
+
+bool radioStartTransmit(const uint8_t* data, size_t length) {
+    if (length > 255) {
+        return false;
+    }
+    return setPacketParams((uint8_t)length) &&
+           writeBuffer(0x00, data, length) &&
+           command(SX126X_SET_TX, {0x00, 0x00, 0x00});  // No timeout, TX done ends it
+}
+
+void radioEndTransmit() {
+    clearIrqStatus();
+    command(SX126X_SET_STANDBY, {SX126X_STANDBY_XOSC});
+}
+
+bool radioStartReceive() {
+    clearIrqStatus();  // DIO1 only rises again once every flag is clear
+    return setPacketParams(0xFF) &&
+           command(SX126X_SET_RX, {0x00, 0x00, 0x00});  // Single packet, no timeout
+}
+
+int radioReadPacket(uint8_t* buffer, size_t capacity) {
+    uint8_t irqStatus[2];
+    if (!readCommand(SX126X_GET_IRQ_STATUS, {}, irqStatus, 2)) {
+        return -1;
+    }
+    uint16_t flags = ((uint16_t)irqStatus[0] << 8) | irqStatus[1];
+    clearIrqStatus();
+    if (!(flags & SX126X_IRQ_RX_DONE) || (flags & (SX126X_IRQ_HEADER_ERR | SX126X_IRQ_CRC_ERR))) {
+        return -1;
+    }
+
+    uint8_t rxStatus[2];  // Payload length, start offset
+    if (!readCommand(SX126X_GET_RX_BUFFER_STATUS, {}, rxStatus, 2) || rxStatus[0] > capacity) {
+        return -1;
+    }
+    if (!readCommand(SX126X_READ_BUFFER, {rxStatus[1]}, buffer, rxStatus[0])) {
+        return -1;
+    }
+    return rxStatus[0];
+}
+
+void radioEndReceive() {
+    clearIrqStatus();
+    command(SX126X_SET_STANDBY, {SX126X_STANDBY_XOSC});
+}
+
+bool radioStartChannelScan() {
+    clearIrqStatus();
+    return command(SX126X_SET_CAD, {});
+}
+
+bool radioEndChannelScan() {
+    uint8_t irqStatus[2] = {0, 0};
+    readCommand(SX126X_GET_IRQ_STATUS, {}, irqStatus, 2);
+    uint16_t flags = ((uint16_t)irqStatus[0] << 8) | irqStatus[1];
+    clearIrqStatus();
+    command(SX126X_SET_STANDBY, {SX126X_STANDBY_XOSC});  // Ends a scan that never finished
+    return (flags & SX126X_IRQ_CAD_DETECTED) != 0;
+}
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * SX127x radio backend on top of sandeepmistry/LoRa
+ */
+
+#include "radio.h"
+
+#if LORA_RADIO == LORA_RADIO_SX127X
+
+#include <Arduino.h>
+#include <LoRa.h>
+
+static RadioIrqHandler irqHandler = nullptr;
+static volatile int rxLength = 0;
+static volatile bool cadDetected = false;
+
+// The library only calls this for packets with a valid CRC
+static void onReceive(int length) {
+    rxLength = length;
+    irqHandler();
+}
+
+static void onCadDone(bool detected) {
+    cadDetected = detected;
+    irqHandler();
+}
+
+bool radioBegin(RadioIrqHandler irq, const LoRaProfile& profile, int8_t txPower) {
+    LoRa.setPins(LORA_CS_PIN, LORA_RST_PIN, LORA_DIO1_PIN);
+
+    if (!LoRa.begin(LORA_FREQUENCY * 1E6)) {
+        return false;
+    }
+
+    LoRa.setSpreadingFactor(profile.spreadingFactor);
+    LoRa.setSignalBandwidth(profile.bandwidthHz);
+    LoRa.setCodingRate4(profile.codingRate);
+    LoRa.setTxPower(txPower);
+    LoRa.setPreambleLength(profile.preambleLength);
+    LoRa.setSyncWord(LORA_SYNC_WORD);
+    #if LORA_HW_CRC
+    LoRa.enableCrc();
+    #endif
+    irqHandler = irq;
+    LoRa.onTxDone(irq);
+    LoRa.onReceive(onReceive);
+    LoRa.onCadDone(onCadDone);
+
+    return true;
+}
+
+void radioSetTxPower(int8_t dbm) {
+    LoRa.setTxPower(dbm);
+}
+
+bool radioStartTransmit(const uint8_t* data, size_t length) {
+    if (!LoRa.beginPacket()) {
+        return false;  // Still transmitting
+    }
+    LoRa.write(data, length);
+    return LoRa.endPacket(true);
+}
+
+void radioEndTransmit() {
+    LoRa.idle();  // The library's ISR has already cleared the IRQ flags
+}
+
+bool radioStartReceive() {
+    rxLength = 0;
+    LoRa.receive();
+    return true;
+}
+
+int radioReadPacket(uint8_t* buffer, size_t capacity) {
+    int length = rxLength;
+    if (length <= 0 || (size_t)length > capacity) {
+        return -1;
+    }
+    for (int i = 0; i < length; i++) {
+        buffer[i] = LoRa.read();
+    }
+    rxLength = 0;
+    return length;
+}
+
+void radioEndReceive() {
+    LoRa.idle();
+}
+
+bool radioStartChannelScan() {
+    cadDetected = false;
+    LoRa.channelActivityDetection();
+    return true;
+}
+
+bool radioEndChannelScan() {
+    LoRa.idle();
+    return cadDetected;
+}
+
+#endif
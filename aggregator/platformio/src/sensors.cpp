@@ -0,0 +1,317 @@
+/*
+ * Sensor readings: advertisement parsing and the seqlocked sensor cache
+ * (see sensors.h). No Arduino or NimBLE calls, times are passed in.
+ */
+
+#include "sensors.h"
+
+#include <string.h>
+#include "log.h"
+
+SensorSlot sensorCache[MAX_SENSORS];
+std::atomic<int> sensorCount(0);
+
+// machineId -> slot (SLOT_NONE if unassigned), only touched by the writer
+static uint8_t sensorSlotIndex[256];
+
+static void writeSensorSlot(SensorSlot& slot, const SensorData& data) {
+    uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.data = data;
+    slot.seq.store(seq + 2, std::memory_order_release);
+}
+
+SensorData readSensorSlot(const SensorSlot& slot) {
+    SensorData copy;
+    for (;;) {
+        uint32_t before = slot.seq.load(std::memory_order_acquire);
+        if (before & 1) {
+            continue;  // Writer is in the middle of an update (a few µs)
+        }
+        copy = slot.data;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) == before) {
+            return copy;
+        }
+    }
+}
+
+void resetSensorCache() {
+    memset(sensorSlotIndex, SLOT_NONE, sizeof(sensorSlotIndex));
+    for (int i = 0; i < MAX_SENSORS; i++) {
+        sensorCache[i].seq.store(0);
+        sensorCache[i].data = SensorData();
+        sensorCache[i].payloadHash = 0;
+        sensorCache[i].lastForwardMs = 0;
+    }
+    sensorCount.store(0);
+}
+
+void restoreSensorCache(const SensorData* slots, int count) {
+    resetSensorCache();
+    for (int i = 0; i < count; i++) {
+        if (!slots[i].valid) {
+            continue;
+        }
+        sensorSlotIndex[slots[i].machineId] = i;
+        sensorCache[i].data = slots[i];
+    }
+    sensorCount.store(count);
+}
+
+/*
+ * Sensor nodes advertise in short bursts once per wake interval. A new
+ * burst starts after SCAN_BURST_GAP_MS of silence; the distance between
+ * burst starts is folded into a running average of the node's period
+ * (divided down if bursts were missed in between).
+ */
+static void learnWakeSchedule(const SensorData& prev, SensorData& next, uint32_t now) {
+    bool sameNode = prev.valid && prev.machineId == next.machineId;
+    if (!sameNode) {
+        next.wakeStartMs = now;
+        next.wakePeriodMs = 0;
+        return;
+    }
+
+    next.wakeStartMs = prev.wakeStartMs;
+    next.wakePeriodMs = prev.wakePeriodMs;
+    if (now - prev.lastSeenMs < SCAN_BURST_GAP_MS) {
+        return;  // Same burst
+    }
+
+    uint32_t interval = now - prev.wakeStartMs;
+    next.wakeStartMs = now;
+    if (interval > SCAN_MAX_PERIOD_MS) {
+        return;
+    }
+    if (prev.wakePeriodMs == 0) {
+        next.wakePeriodMs = interval;
+        return;
+    }
+
+    uint32_t missed = (interval + prev.wakePeriodMs / 2) / prev.wakePeriodMs;
+    if (missed == 0) {
+        missed = 1;
+    }
+    next.wakePeriodMs = (3 * prev.wakePeriodMs + interval / missed) / 4;
+}
+
+uint32_t sensorExpiryMs(const SensorData& data) {
+    uint32_t missedMs = data.wakePeriodMs * OFFLINE_MISSED_WAKES + data.wakePeriodMs / 2;
+    return missedMs > SENSOR_TIMEOUT_MS ? missedMs : SENSOR_TIMEOUT_MS;
+}
+
+// FNV-1a over the reading's payload fields, used to spot repeated advertisements
+static uint32_t readingHash(const SensorReading& reading) {
+    const uint8_t bytes[9] = {
+        (uint8_t)(reading.rmsX100 & 0xFF), (uint8_t)(reading.rmsX100 >> 8),
+        (uint8_t)(reading.meanX100 & 0xFF), (uint8_t)(reading.meanX100 >> 8),
+        (uint8_t)(reading.freqX10 & 0xFF), (uint8_t)(reading.freqX10 >> 8),
+        reading.batteryPercent, reading.flags, reading.machineType
+    };
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(bytes); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Find our sensor's manufacturer data in a raw advertisement payload and
+ * parse it in place. The payload is a sequence of AD structures
+ * [length][type][data...]; manufacturer data is type 0xFF, company(2) +
+ * version(1) followed by
+ *   v1: id(1) + rms(2) + freq(2) + batt(1) + flags(1)                 = 10
+ *   v2: type(1) + id(1) + rms(2) + mean(2) + freq(2) + batt(1)        = 12
+ * (v2 is what sensor_node/circuitpython sends). Company ID and protocol
+ * version are checked before anything is copied.
+ */
+bool parseSensorAdvertisement(const uint8_t* payload, size_t length, SensorReading& out) {
+    size_t pos = 0;
+    while (pos + 1 < length) {
+        uint8_t fieldLength = payload[pos];
+        if (fieldLength == 0 || pos + 1 + fieldLength > length) {
+            return false;  // Padding or malformed structure
+        }
+
+        uint8_t fieldType = payload[pos + 1];
+        const uint8_t* data = &payload[pos + 2];
+        size_t dataLength = fieldLength - 1;
+        pos += 1 + fieldLength;
+
+        if (fieldType != 0xFF || dataLength < 3) {
+            continue;
+        }
+
+        // Check company ID (little-endian)
+        uint16_t companyId = data[0] | (data[1] << 8);
+        if (companyId != WASHING_MACHINE_COMPANY_ID) {
+            return false;
+        }
+
+        if (data[2] == 1 && dataLength >= 10) {
+            out.machineId = data[3];
+            out.machineType = 0;
+            out.rmsX100 = data[4] | (data[5] << 8);
+            out.meanX100 = 0;
+            out.freqX10 = data[6] | (data[7] << 8);
+            out.batteryPercent = data[8];
+            out.flags = data[9];
+            return true;
+        }
+        if (data[2] == 2 && dataLength >= 12) {
+            out.machineType = data[3];
+            out.machineId = data[4];
+            out.rmsX100 = data[5] | (data[6] << 8);
+            out.meanX100 = data[7] | (data[8] << 8);
+            out.freqX10 = data[9] | (data[10] << 8);
+            out.batteryPercent = data[11];
+            out.flags = 0;
+            return true;
+        }
+
+        LOG_DEBUG("Unknown protocol version %d or short payload (%d bytes)",
+                  data[2], (int)dataLength);
+        return false;
+    }
+    return false;
+}
+
+/*
+ * O(1) lookup through sensorSlotIndex. A new machine takes the next
+ * unused slot; only when all MAX_SENSORS slots were handed out is a
+ * timed-out slot searched for and recycled. Returns -1 if none is free.
+ */
+static int findOrAllocateSlot(uint8_t machineId, uint32_t now) {
+    uint8_t slot = sensorSlotIndex[machineId];
+    if (slot != SLOT_NONE) {
+        return slot;
+    }
+
+    int count = sensorCount.load(std::memory_order_relaxed);
+    if (count < MAX_SENSORS) {
+        sensorSlotIndex[machineId] = count;
+        return count;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const SensorData& data = sensorCache[i].data;
+        if (!data.valid) {
+            // A hole left by restoreSensorCache(), its machineId is not indexed
+            sensorSlotIndex[machineId] = i;
+            return i;
+        }
+        if (now - data.lastSeenMs >= sensorExpiryMs(data)) {
+            sensorSlotIndex[data.machineId] = SLOT_NONE;
+            sensorSlotIndex[machineId] = i;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The only writer of sensorCache, so it may read slot data directly
+CacheUpdate updateSensorCache(SensorReading& reading, uint32_t now) {
+    int slot = findOrAllocateSlot(reading.machineId, now);
+    if (slot == -1) {
+        return CACHE_FULL;
+    }
+
+    reading.slot = slot;
+    SensorSlot& entry = sensorCache[slot];
+    uint32_t hash = readingHash(reading);
+    bool known = entry.data.valid && entry.data.machineId == reading.machineId &&
+                 now - entry.data.lastSeenMs < sensorExpiryMs(entry.data);
+    bool isNew = !known || hash != entry.payloadHash ||
+                 now - entry.lastForwardMs >= DEDUP_HOLDOFF_MS;
+
+    SensorData data;
+    data.machineId = reading.machineId;
+    data.machineType = reading.machineType;
+    data.rmsX100 = reading.rmsX100;
+    data.meanX100 = reading.meanX100;
+    data.freqX10 = reading.freqX10;
+    data.batteryPercent = reading.batteryPercent;
+    data.flags = reading.flags;
+    data.lastSeenMs = now;
+    data.valid = true;
+    learnWakeSchedule(entry.data, data, now);
+    writeSensorSlot(entry, data);
+
+    if (isNew) {
+        entry.payloadHash = hash;
+        entry.lastForwardMs = now;
+    }
+
+    if (slot >= sensorCount.load(std::memory_order_relaxed)) {
+        sensorCount.store(slot + 1, std::memory_order_release);
+    }
+
+    return isNew ? CACHE_NEW : CACHE_REPEAT;
+}
+
+#if EDGE_CLASSIFIER
+#define STOP_RMS_X100   EDGE_STOP_RMS_X100
+#define STOP_HOLD_MS    EDGE_STOP_HOLD_MS
+#else
+#define STOP_RMS_X100   EDGE_RUN_RMS_X100       // Plain threshold crossing
+#define STOP_HOLD_MS    0
+#endif
+
+enum EdgeState : uint8_t {
+    EDGE_UNKNOWN,
+    EDGE_STOPPED,
+    EDGE_RUNNING
+};
+
+struct EdgeClassifier {
+    EdgeState state;
+    bool quiet;                 // Running, but below the stop threshold since quietSinceMs
+    uint32_t quietSinceMs;
+};
+
+static EdgeClassifier edgeClassifiers[256];    // By machine ID, TX task only
+
+void resetEdgeClassifiers() {
+    memset(edgeClassifiers, 0, sizeof(edgeClassifiers));
+}
+
+bool classifyReading(SensorReading& reading) {
+    EdgeClassifier& edge = edgeClassifiers[reading.machineId];
+    EdgeState previous = edge.state;
+
+    if (reading.rmsX100 >= EDGE_RUN_RMS_X100) {
+        edge.state = EDGE_RUNNING;
+        edge.quiet = false;
+    } else if (edge.state != EDGE_RUNNING) {
+        edge.state = EDGE_STOPPED;
+    } else if (reading.rmsX100 >= STOP_RMS_X100) {
+        edge.quiet = false;     // Inside the hysteresis band
+    } else {
+        if (!edge.quiet) {
+            edge.quiet = true;
+            edge.quietSinceMs = reading.receivedMs;
+        }
+        if ((int32_t)(reading.receivedMs - edge.quietSinceMs) >= (int32_t)STOP_HOLD_MS) {
+            edge.state = EDGE_STOPPED;
+            edge.quiet = false;
+        }
+    }
+
+    setEdgeFlags(reading);
+    return previous != EDGE_UNKNOWN && previous != edge.state;
+}
+
+void setEdgeFlags(SensorReading& reading) {
+    reading.flags &= ~READING_FLAGS_EDGE;
+    #if EDGE_CLASSIFIER
+    EdgeState state = edgeClassifiers[reading.machineId].state;
+    if (state != EDGE_UNKNOWN) {
+        reading.flags |= READING_FLAG_EDGE_KNOWN;
+        if (state == EDGE_RUNNING) {
+            reading.flags |= READING_FLAG_EDGE_RUNNING;
+        }
+    }
+    #endif
+}
@@ -0,0 +1,88 @@
+/*
+ * Runtime settings (see settings.h)
+ *
+ * The settings live in NVS as one blob. A blob of another size (written by
+ * a firmware with a different Settings struct) is ignored, the aggregator
+ * then starts from config.h again. Settings that need a restart are only
+ * changed in the stored copy; `settings` keeps what this boot runs with.
+ */
+
+#include "settings.h"
+
+#include <Arduino.h>
+#include <Preferences.h>
+
+Settings settings = {
+    AGGREGATOR_ID, FORWARD_MODE, FORWARD_INTERVAL_MS, LORA_SPREADING_FACTOR, LORA_TX_POWER, 0
+};
+
+LoRaProfile loraProfile = LORA_PROFILE;
+
+#if DOWNLINK_COMMANDS
+struct SettingRange {
+    uint8_t code;
+    uint32_t min;
+    uint32_t max;
+};
+
+#define SETTING_RANGE(name, code, min, max)     {code, min, max},
+
+static const SettingRange settingRanges[] = { SETTINGS(SETTING_RANGE) };
+
+static Preferences store;
+static bool storeReady = false;
+static Settings stored;             // What the next boot runs with
+
+static bool inRange(uint8_t setting, uint32_t value) {
+    for (const SettingRange& range : settingRanges) {
+        if (range.code == setting) {
+            return value >= range.min && value <= range.max;
+        }
+    }
+    return false;
+}
+#endif
+
+void settingsBegin() {
+    #if DOWNLINK_COMMANDS
+    storeReady = store.begin("settings", false);
+    if (storeReady && store.getBytesLength("current") == sizeof(Settings)) {
+        store.getBytes("current", &settings, sizeof(Settings));
+    }
+    settings.txPower = min(settings.txPower, (int8_t)LORA_TX_POWER);  // Stored before the cap
+    stored = settings;
+    #endif
+    loraProfile.spreadingFactor = settings.spreadingFactor;
+}
+
+bool settingsApply(uint8_t setting, uint32_t value, uint8_t commandId) {
+    #if DOWNLINK_COMMANDS
+    bool valid = inRange(setting, value);
+    if (valid) {
+        switch (setting) {
+            case SETTING_AGGREGATOR_ID:
+                stored.aggregatorId = value;
+                break;
+            case SETTING_FORWARD_MODE:
+                stored.forwardMode = settings.forwardMode = value;
+                break;
+            case SETTING_FORWARD_INTERVAL_MS:
+                stored.forwardIntervalMs = settings.forwardIntervalMs = value;
+                break;
+            case SETTING_SPREADING_FACTOR:
+                stored.spreadingFactor = value;
+                break;
+            case SETTING_TX_POWER:
+                stored.txPower = settings.txPower = value;
+                break;
+        }
+    }
+    stored.commandId = settings.commandId = commandId;
+    if (storeReady) {
+        store.putBytes("current", &stored, sizeof(Settings));
+    }
+    return valid;
+    #else
+    return false;
+    #endif
+}
@@ -0,0 +1,130 @@
+/*
+ * CRC-32 of crc32.cpp (the CRC32_IMPLEMENTATION built, the table by
+ * default) against the bitwise reference and against the values Python's
+ * binascii.crc32() gives, which the server and the bridge check packets
+ * with. Also benchmarks it against the bitwise version.
+ *
+ *   pio test -e native -f test_crc32 -v
+ */
+
+#include <unity.h>
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "packets.h"
+#include "../host_stubs.h"
+
+// The bit-at-a-time CRC-32 the aggregator used before the table
+static uint32_t crc32Bitwise(const uint8_t* data, size_t length) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static uint8_t randomBytes[4096];
+
+void setUp() {}
+
+void tearDown() {}
+
+// binascii.crc32(...) of each input
+static void test_binascii_vectors() {
+    static uint8_t counting[256];
+    static uint8_t zeros[1000];
+    for (int i = 0; i < 256; i++) {
+        counting[i] = i;
+    }
+    struct Vector {
+        const uint8_t* data;
+        size_t length;
+        uint32_t crc;
+    };
+    const Vector vectors[] = {
+        {(const uint8_t*)"", 0, 0x00000000},
+        {(const uint8_t*)"a", 1, 0xE8B7BE43},
+        {(const uint8_t*)"123456789", 9, 0xCBF43926},
+        {(const uint8_t*)"The quick brown fox jumps over the lazy dog", 43, 0x414FA339},
+        {counting, sizeof(counting), 0x29058C73},
+        {zeros, sizeof(zeros), 0x060B1780},
+    };
+    for (const Vector& vector : vectors) {
+        TEST_ASSERT_EQUAL_HEX32(vector.crc, crc32(vector.data, vector.length));
+        TEST_ASSERT_EQUAL_HEX32(vector.crc, crc32Bitwise(vector.data, vector.length));
+    }
+}
+
+static void test_matches_bitwise() {
+    for (size_t length = 0; length <= 300; length++) {
+        const uint8_t* data = randomBytes + length * 7 % 1000;
+        TEST_ASSERT_EQUAL_HEX32(crc32Bitwise(data, length), crc32(data, length));
+    }
+}
+
+// Split at every point, and byte by byte as PacketWriter does
+static void test_incremental() {
+    const size_t length = 255;
+    uint32_t expected = crc32(randomBytes, length);
+    for (size_t split = 0; split <= length; split++) {
+        uint32_t state = crc32Begin();
+        state = crc32Update(state, randomBytes, split);
+        state = crc32Update(state, randomBytes + split, length - split);
+        TEST_ASSERT_EQUAL_HEX32(expected, crc32Finish(state));
+    }
+    uint32_t state = crc32Begin();
+    for (size_t i = 0; i < length; i++) {
+        state = crc32UpdateByte(state, randomBytes[i]);
+    }
+    TEST_ASSERT_EQUAL_HEX32(expected, crc32Finish(state));
+
+    uint8_t packet[64];
+    PacketWriter writer(packet, sizeof(packet));
+    writer.bytes(randomBytes, 40);
+    uint32_t crc = writer.appendCrc32();
+    TEST_ASSERT_EQUAL_HEX32(crc32(randomBytes, 40), crc);
+    TEST_ASSERT_EQUAL_HEX32(crc, packet[40] | packet[41] << 8 | packet[42] << 16 | (uint32_t)packet[43] << 24);
+}
+
+static void test_benchmark() {
+    using Clock = std::chrono::steady_clock;
+    const int rounds = 2000;
+    volatile uint32_t sink = 0;
+
+    Clock::time_point t0 = Clock::now();
+    for (int i = 0; i < rounds; i++) {
+        sink = sink + crc32(randomBytes, sizeof(randomBytes));
+    }
+    Clock::time_point t1 = Clock::now();
+    for (int i = 0; i < rounds; i++) {
+        sink = sink + crc32Bitwise(randomBytes, sizeof(randomBytes));
+    }
+    Clock::time_point t2 = Clock::now();
+
+    double megabytes = (double)rounds * sizeof(randomBytes) / 1e6;
+    double fast = megabytes / std::chrono::duration<double>(t1 - t0).count();
+    double bitwise = megabytes / std::chrono::duration<double>(t2 - t1).count();
+    printf("crc32 (implementation %d): %.0f MB/s, bitwise %.0f MB/s, %.1fx\n",
+           CRC32_IMPLEMENTATION, fast, bitwise, fast / bitwise);
+}
+
+int main() {
+    srand(1);
+    for (size_t i = 0; i < sizeof(randomBytes); i++) {
+        randomBytes[i] = rand();
+    }
+
+    UNITY_BEGIN();
+    RUN_TEST(test_binascii_vectors);
+    RUN_TEST(test_matches_bitwise);
+    RUN_TEST(test_incremental);
+    RUN_TEST(test_benchmark);
+    return UNITY_END();
+}
@@ -0,0 +1,271 @@
+/*
+ * Replay benchmark of the parse -> cache -> packetize path
+ *
+ * Feeds an advertisement trace through parseSensorAdvertisement(),
+ * updateSensorCache(), classifyReading() and the packet senders as fast
+ * as the host runs them, and reports throughput, per-advertisement
+ * latency and the airtime the packets would take. The trace is a
+ * synthetic laundry room unless REPLAY_TRACE names a captured one: one
+ * advertisement per line, "<receive ms> <payload hex>".
+ *
+ *   pio test -e native -v
+ *   REPLAY_TRACE=capture.txt pio test -e native -v
+ */
+
+#include <unity.h>
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "packets.h"
+#include "sensors.h"
+#include "../host_stubs.h"
+
+// Mean host time per advertisement above which the hot path has regressed
+#ifndef REPLAY_MAX_MEAN_NS
+#define REPLAY_MAX_MEAN_NS      20000
+#endif
+
+#define REPLAY_SENSORS          20
+#define REPLAY_HOURS            24
+#define REPLAY_WAKE_MS          60000   // Node measurement interval
+#define REPLAY_BURST            5       // Advertisements per wake
+#define REPLAY_BURST_GAP_MS     100
+
+struct TraceAdvert {
+    uint32_t receivedMs;
+    uint8_t length;
+    uint8_t payload[31];
+};
+
+static std::vector<TraceAdvert> trace;
+static bool traceCaptured = false;      // Also holds other devices' advertisements
+
+// Protocol v2 advertisement as the sensor node sends it
+static TraceAdvert makeAdvert(uint32_t ms, uint8_t machineId, uint8_t type, uint16_t rmsX100,
+                              uint16_t meanX100, uint16_t freqX10, uint8_t battery) {
+    const uint8_t payload[] = {
+        0x02, 0x01, 0x06,                                   // Flags
+        0x0D, 0xFF,                                         // Manufacturer data, 12 bytes
+        WASHING_MACHINE_COMPANY_ID & 0xFF, WASHING_MACHINE_COMPANY_ID >> 8,
+        2, type, machineId,
+        (uint8_t)rmsX100, (uint8_t)(rmsX100 >> 8),
+        (uint8_t)meanX100, (uint8_t)(meanX100 >> 8),
+        (uint8_t)freqX10, (uint8_t)(freqX10 >> 8),
+        battery,
+    };
+    TraceAdvert advert;
+    advert.receivedMs = ms;
+    advert.length = sizeof(payload);
+    memcpy(advert.payload, payload, sizeof(payload));
+    return advert;
+}
+
+// REPLAY_SENSORS machines waking every REPLAY_WAKE_MS, running about half the time
+static void buildSyntheticTrace() {
+    srand(1);
+    for (int id = 1; id <= REPLAY_SENSORS; id++) {
+        uint32_t ms = rand() % REPLAY_WAKE_MS;
+        bool running = false;
+        for (; ms < REPLAY_HOURS * 3600000u; ms += REPLAY_WAKE_MS - 200 + rand() % 400) {
+            if (rand() % 30 == 0) {
+                running = !running;
+            }
+            uint16_t rms = running ? 60 + rand() % 200 : rand() % 20;
+            uint16_t freq = running ? 100 + rand() % 150 : 0;
+            for (int i = 0; i < REPLAY_BURST; i++) {
+                trace.push_back(makeAdvert(ms + i * REPLAY_BURST_GAP_MS, id, 1 + id % 2,
+                                           rms, 981, freq, 80));
+            }
+        }
+    }
+    std::sort(trace.begin(), trace.end(),
+              [](const TraceAdvert& a, const TraceAdvert& b) { return a.receivedMs < b.receivedMs; });
+}
+
+static bool loadTrace(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == nullptr) {
+        return false;
+    }
+    char line[160];
+    while (fgets(line, sizeof(line), file)) {
+        TraceAdvert advert = {};
+        char hex[128];
+        if (sscanf(line, "%u %127s", &advert.receivedMs, hex) != 2) {
+            continue;
+        }
+        for (size_t i = 0; hex[2 * i] && hex[2 * i + 1] && i < sizeof(advert.payload); i++) {
+            unsigned byte;
+            sscanf(&hex[2 * i], "%2x", &byte);
+            advert.payload[advert.length++] = byte;
+        }
+        trace.push_back(advert);
+    }
+    fclose(file);
+    return !trace.empty();
+}
+
+// Same snapshot and senders as sendAggregatedLoRaPacket()
+static void sendAggregated(uint32_t now) {
+    int count = sensorCount.load(std::memory_order_acquire);
+    SensorReading readings[MAX_SENSORS];
+    int validCount = 0;
+    for (int i = 0; i < count; i++) {
+        SensorData data = readSensorSlot(sensorCache[i]);
+        if (data.valid) {
+            SensorReading& reading = readings[validCount++];
+            reading.machineId = data.machineId;
+            reading.machineType = data.machineType;
+            reading.rmsX100 = data.rmsX100;
+            reading.meanX100 = data.meanX100;
+            reading.freqX10 = data.freqX10;
+            reading.batteryPercent = data.batteryPercent;
+            reading.flags = data.flags;
+            reading.receivedMs = data.lastSeenMs;
+            setEdgeFlags(reading);
+        }
+    }
+    #if DELTA_ENCODING
+    for (int first = 0; first < validCount; first += MAX_MACHINES_PER_PACKET) {
+        int n = std::min(validCount - first, MAX_MACHINES_PER_PACKET);
+        sendDeltaLoRaPacket(deltaStates[first / MAX_MACHINES_PER_PACKET], readings + first, n, now);
+    }
+    #elif MULTI_FRAME
+    sendReadingFrames(readings, validCount, now);
+    #else
+    for (int first = 0; first < validCount; first += MAX_MACHINES_PER_PACKET) {
+        sendReadingsLoRaPacket(readings + first, std::min(validCount - first, MAX_MACHINES_PER_PACKET), now);
+    }
+    #endif
+}
+
+struct ReplayResult {
+    uint32_t parsed;
+    uint32_t forwarded;
+    uint32_t cacheFull;
+    uint64_t meanNs;
+    uint64_t p50Ns;
+    uint64_t p99Ns;
+    uint64_t maxNs;
+    double advertsPerSecond;
+};
+
+/*
+ * Replay the trace, forwarding every new reading (immediate) or the
+ * whole cache every FORWARD_INTERVAL_MS of trace time (interval). The
+ * latency of an advertisement covers everything up to its packet.
+ */
+static ReplayResult replay(bool interval) {
+    using Clock = std::chrono::steady_clock;
+    resetSensorCache();
+    resetEdgeClassifiers();
+    #if DELTA_ENCODING
+    memset(deltaStates, 0, sizeof(deltaStates));
+    #endif
+    hostAirtimeReset();
+
+    ReplayResult result = {};
+    std::vector<uint64_t> latencyNs;
+    latencyNs.reserve(trace.size());
+    uint32_t lastAggregatedMs = trace.front().receivedMs;
+    Clock::time_point started = Clock::now();
+
+    for (const TraceAdvert& advert : trace) {
+        Clock::time_point t0 = Clock::now();
+        SensorReading reading;
+        if (parseSensorAdvertisement(advert.payload, advert.length, reading)) {
+            result.parsed++;
+            reading.receivedMs = advert.receivedMs;
+            CacheUpdate update = updateSensorCache(reading, advert.receivedMs);
+            if (update == CACHE_FULL) {
+                result.cacheFull++;
+            } else if (update == CACHE_NEW) {
+                result.forwarded++;
+                classifyReading(reading);
+                if (!interval) {
+                    sendReadingsLoRaPacket(&reading, 1, advert.receivedMs);
+                }
+            }
+        }
+        if (interval && advert.receivedMs - lastAggregatedMs >= FORWARD_INTERVAL_MS) {
+            sendAggregated(advert.receivedMs);
+            lastAggregatedMs = advert.receivedMs;
+        }
+        latencyNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count());
+    }
+    if (interval) {
+        sendAggregated(trace.back().receivedMs);  // The round the trace ends in
+    }
+
+    double seconds = std::chrono::duration<double>(Clock::now() - started).count();
+    uint64_t totalNs = 0;
+    for (uint64_t ns : latencyNs) {
+        totalNs += ns;
+    }
+    std::sort(latencyNs.begin(), latencyNs.end());
+    result.meanNs = totalNs / latencyNs.size();
+    result.p50Ns = latencyNs[latencyNs.size() / 2];
+    result.p99Ns = latencyNs[latencyNs.size() * 99 / 100];
+    result.maxNs = latencyNs.back();
+    result.advertsPerSecond = trace.size() / seconds;
+
+    double traceHours = (trace.back().receivedMs - trace.front().receivedMs) / 3600000.0;
+    printf("%-9s %u adverts, %.0f adverts/s, latency mean %llu / p50 %llu / p99 %llu / max %llu ns\n",
+           interval ? "interval" : "immediate", (unsigned)trace.size(), result.advertsPerSecond,
+           (unsigned long long)result.meanNs, (unsigned long long)result.p50Ns,
+           (unsigned long long)result.p99Ns, (unsigned long long)result.maxNs);
+    printf("%-9s %u forwarded, %u packets, %u bytes, %u ms airtime (%.1f s per hour of trace)\n", "",
+           result.forwarded, hostAirtime.packets, hostAirtime.bytes, hostAirtime.airtimeMs,
+           traceHours > 0 ? hostAirtime.airtimeMs / 1000.0 / traceHours : 0.0);
+    return result;
+}
+
+static void checkReplay(const ReplayResult& result) {
+    if (!traceCaptured) {
+        TEST_ASSERT_EQUAL_UINT32(trace.size(), result.parsed);
+    }
+    TEST_ASSERT_TRUE(result.parsed > 0);
+    TEST_ASSERT_EQUAL_UINT32(0, result.cacheFull);
+    TEST_ASSERT_EQUAL_UINT32(0, hostAirtime.crcErrors);
+    TEST_ASSERT_TRUE(hostAirtime.packets > 0);
+    TEST_ASSERT_LESS_THAN_UINT32(REPLAY_MAX_MEAN_NS, (uint32_t)result.meanNs);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+static void test_replay_immediate() {
+    checkReplay(replay(false));
+}
+
+static void test_replay_interval() {
+    ReplayResult result = replay(true);
+    checkReplay(result);
+    // The cache takes in every machine, aggregated rounds send far fewer packets
+    if (!traceCaptured) {
+        TEST_ASSERT_TRUE(hostAirtime.packets < result.forwarded);
+    }
+}
+
+int main() {
+    const char* path = getenv("REPLAY_TRACE");
+    if (path != nullptr && !loadTrace(path)) {
+        printf("Trace %s not readable\n", path);
+        return 1;
+    }
+    traceCaptured = !trace.empty();
+    if (trace.empty()) {
+        buildSyntheticTrace();
+    }
+
+    UNITY_BEGIN();
+    RUN_TEST(test_replay_immediate);
+    RUN_TEST(test_replay_interval);
+    return UNITY_END();
+}
@@ -0,0 +1,204 @@
+"""
+Downlink Module
+Commands and firmware updates waiting to be sent to aggregators
+
+The WiFi bridge fetches the pending downlinks with every forwarded packet
+(and keepalive) and sends them over LoRa in the receive window after an
+aggregator's next telemetry or events packet. An aggregator confirms a
+command with the command ID in its next telemetry packet, and reports the
+progress of an update in OTA_REQUEST packets; both then leave the queue.
+State is in memory only, a server restart drops what is still pending.
+"""
+
+import itertools
+import threading
+import time
+import logging
+from dataclasses import dataclass, field
+from typing import Dict, List, Optional
+
+import packet_schema
+from packet_schema import SETTING_RANGES, OTA_STATUS_RECEIVING, OTA_STATUS_DONE
+
+logger = logging.getLogger(__name__)
+
+# setting name (lower case, as in the API) -> SETTING_* code
+SETTING_CODES = {
+    name[len("SETTING_"):].lower(): getattr(packet_schema, name)
+    for name in dir(packet_schema)
+    if name.startswith("SETTING_") and name != "SETTING_RANGES"
+}
+
+OTA_STATUS_NAMES = {
+    getattr(packet_schema, name): name[len("OTA_STATUS_"):].lower()
+    for name in dir(packet_schema) if name.startswith("OTA_STATUS_")
+}
+
+
+@dataclass
+class Command:
+    """One setting change (or restart) for one aggregator"""
+    aggregator_id: int
+    command_id: int
+    setting: int
+    value: int
+    queued_at: float = field(default_factory=time.time)
+
+
+@dataclass
+class OtaSession:
+    """A firmware update for one aggregator, from queued until DONE or FAILED"""
+    aggregator_id: int
+    session_id: int
+    stream: bytes               # Compressed patch, sent in chunks
+    base_size: int
+    base_crc: int
+    image_size: int
+    image_crc: int
+    status: Optional[int] = None    # Last status reported, None before the first request
+    offset: int = 0
+    queued_at: float = field(default_factory=time.time)
+    updated_at: float = field(default_factory=time.time)
+
+
+class DownlinkQueue:
+    """Pending commands and updates, shared by the HTTP handlers and the decoder"""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.commands: List[Command] = []
+        self.sessions: Dict[int, OtaSession] = {}       # session ID -> session
+        self.finished: List[OtaSession] = []             # Most recent last
+        # IDs 1-255 (0 means none), the aggregator ignores a repeat of its last
+        self._command_ids = itertools.cycle(range(1, 256))
+        self.last_command_ids: Dict[int, int] = {}     # aggregator ID -> as in its last telemetry
+        self._session_ids = itertools.cycle(range(1, 256))
+
+    def add_command(self, aggregator_id: int, setting: str, value: int = 0) -> Command:
+        """Queue a setting change, ValueError for an unknown setting or value out of range"""
+        if setting not in SETTING_CODES:
+            raise ValueError(f"Unknown setting '{setting}', expected one of {sorted(SETTING_CODES)}")
+        code = SETTING_CODES[setting]
+        low, high = SETTING_RANGES[code]
+        if not low <= value <= high:
+            raise ValueError(f"{setting} must be {low}-{high}")
+        with self.lock:
+            # Not the aggregator's last ID (it would only be confirmed) nor one still pending
+            taken = {c.command_id for c in self.commands if c.aggregator_id == aggregator_id}
+            taken.add(self.last_command_ids.get(aggregator_id, 0))
+            command_id = next(self._command_ids)
+            while command_id in taken:
+                command_id = next(self._command_ids)
+            command = Command(aggregator_id, command_id, code, value)
+            self.commands.append(command)
+        logger.info(f"Queued command {command.command_id} for aggregator {aggregator_id}: {setting} = {value}")
+        return command
+
+    def add_restart(self, aggregator_id: int) -> Command:
+        """Queue a restart (restart-only settings take effect with it)"""
+        return self.add_command(aggregator_id, "restart")
+
+    def add_ota(self, aggregator_id: int, patch: dict) -> OtaSession:
+        """Queue a firmware update (patch as parsed by ota_patch.parse_patch), replacing a queued one"""
+        with self.lock:
+            for session_id, session in list(self.sessions.items()):
+                if session.aggregator_id == aggregator_id:
+                    del self.sessions[session_id]
+            session = OtaSession(
+                aggregator_id=aggregator_id,
+                session_id=next(self._session_ids),
+                stream=patch["stream"],
+                base_size=patch["base_size"],
+                base_crc=patch["base_crc"],
+                image_size=patch["image_size"],
+                image_crc=patch["image_crc"],
+            )
+            self.sessions[session.session_id] = session
+        logger.info(
+            f"Queued firmware update {session.session_id} for aggregator {aggregator_id}: "
+            f"{len(session.stream)} byte patch, {session.base_size} -> {session.image_size} bytes"
+        )
+        return session
+
+    def get_stream(self, session_id: int) -> Optional[bytes]:
+        with self.lock:
+            session = self.sessions.get(session_id)
+            return session.stream if session else None
+
+    def on_telemetry(self, aggregator_id: int, report: dict):
+        """Drop the command a telemetry packet confirms"""
+        command_id = report.get("command_id", 0)
+        with self.lock:
+            self.last_command_ids[aggregator_id] = command_id
+            for command in self.commands:
+                if command.aggregator_id == aggregator_id and command.command_id == command_id:
+                    self.commands.remove(command)
+                    logger.info(f"Aggregator {aggregator_id} confirmed command {command_id}")
+                    break
+
+    def on_ota_progress(self, aggregator_id: int, session_id: int, status: int, offset: int):
+        """Track an OTA_REQUEST, a final status ends the session"""
+        with self.lock:
+            session = self.sessions.get(session_id)
+            if session is None or session.aggregator_id != aggregator_id:
+                return
+            session.status = status
+            session.offset = offset
+            session.updated_at = time.time()
+            if status != OTA_STATUS_RECEIVING:
+                del self.sessions[session_id]
+                self.finished = (self.finished + [session])[-16:]
+        if status == OTA_STATUS_RECEIVING:
+            logger.info(f"Firmware update {session_id}: {offset}/{len(session.stream)} bytes on aggregator {aggregator_id}")
+        else:
+            level = logging.INFO if status == OTA_STATUS_DONE else logging.WARNING
+            logger.log(level, f"Firmware update {session_id} on aggregator {aggregator_id}: "
+                              f"{OTA_STATUS_NAMES.get(status, status)}")
+
+    def pending(self) -> List[dict]:
+        """Downlinks for the bridge: commands oldest first, then updates"""
+        with self.lock:
+            downlinks = [
+                {
+                    "type": "command",
+                    "aggregator_id": c.aggregator_id,
+                    "command_id": c.command_id,
+                    "setting": c.setting,
+                    "value": c.value,
+                }
+                for c in self.commands
+            ]
+            downlinks += [
+                {
+                    "type": "ota",
+                    "aggregator_id": s.aggregator_id,
+                    "session_id": s.session_id,
+                    "patch_size": len(s.stream),
+                    "base_size": s.base_size,
+                    "base_crc": s.base_crc,
+                    "image_size": s.image_size,
+                    "image_crc": s.image_crc,
+                }
+                for s in self.sessions.values()
+            ]
+        return downlinks
+
+    def get_status(self, aggregator_id: int) -> dict:
+        """Pending commands and updates of one aggregator, for the API"""
+        setting_names = {code: name for name, code in SETTING_CODES.items()}
+        with self.lock:
+            sessions = [s for s in list(self.sessions.values()) + self.finished
+                        if s.aggregator_id == aggregator_id]
+            return {
+                "commands": [
+                    {"command_id": c.command_id, "setting": setting_names[c.setting],
+                     "value": c.value, "queued_at": c.queued_at}
+                    for c in self.commands if c.aggregator_id == aggregator_id
+                ],
+                "updates": [
+                    {"session_id": s.session_id, "patch_size": len(s.stream), "offset": s.offset,
+                     "status": "queued" if s.status is None else OTA_STATUS_NAMES.get(s.status, s.status),
+                     "image_size": s.image_size, "updated_at": s.updated_at}
+                    for s in sessions
+                ],
+            }
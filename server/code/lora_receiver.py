@@ -16,12 +16,134 @@ import serial
 import struct
 import threading
 import time
-from dataclasses import dataclass
-from typing import Callable, Optional, List
+import binascii
+from dataclasses import dataclass, field
+from typing import Callable, Optional, List, Dict, Tuple
 import logging
 
+from packet_schema import (
+    PACKET_TYPE_MIN, PACKET_TYPE_KEYFRAME, PACKET_TYPE_DELTA, PACKET_TYPE_READINGS,
+    PACKET_TYPE_TELEMETRY, PACKET_TYPE_FRAME, PACKET_TYPE_OFFLINE, PACKET_TYPE_EVENTS,
+    PACKET_TYPE_OTA_REQUEST, PACKET_TYPE_RELAYED, OTA_REQUEST, OTA_REQUEST_LEN,
+    PACKET_PREFIX_LEN, TYPED_HEADER_LEN, RECORD_V2_FLAG,
+    MACHINE_RECORD, MACHINE_RECORD_LEN, DELTA_RECORD, DELTA_RECORD_LEN,
+    OFFLINE_RECORD, OFFLINE_RECORD_LEN, RELAY_GROUP, RELAY_GROUP_LEN, TELEMETRY, TELEMETRY_LEN,
+    TELEMETRY_PACKET_LEN, OTA_REQUEST_PACKET_LEN,
+    DOWNLINK_PACKET_TYPES, LORA_SPREADING_FACTOR, unpack_record,
+)
+
 logger = logging.getLogger(__name__)
 
+# Typed packets (PlatformIO aggregator): byte 0 >= 0xF0 is the packet type,
+# byte 1 the aggregator ID, bytes 2-3 the sequence number, the last 4 bytes
+# a CRC-32 (all little-endian). Types and record layouts come from
+# packet_schema.py, generated from the aggregator's packet_schema.h.
+# Machine records are v1 unless the count byte has RECORD_V2_FLAG set.
+FRAME_HEADER_LEN = TYPED_HEADER_LEN + PACKET_PREFIX_LEN[PACKET_TYPE_FRAME]
+
+# v2 record flags: bit 0 from the sensor, bits 1-2 the aggregator's edge state
+READING_FLAG_LOW_BATTERY = 0x01
+READING_FLAG_EDGE_KNOWN = 0x02      # READING_FLAG_EDGE_RUNNING is valid
+READING_FLAG_EDGE_RUNNING = 0x04    # Classified running (with hysteresis)
+
+# Frames of an incomplete round are delivered anyway after this long
+FRAME_ROUND_TIMEOUT_S = 30.0
+
+# Upper bounds (ms) of the latency histogram buckets, plus one overflow bucket
+LATENCY_BUCKETS_MS = (100, 250, 500, 1000, 2500, 5000, 10000, 30000, 60000)
+
+# Latest sequences of each aggregator remembered as heard, so that relayed
+# copies of its packets can be told apart from packets the bridge missed
+SEQUENCE_HISTORY = 64
+
+
+def split_count(count_byte: int) -> Tuple[int, int]:
+    """Machine count byte -> (count, record version)"""
+    return count_byte & ~RECORD_V2_FLAG & 0xFF, 2 if count_byte & RECORD_V2_FLAG else 1
+
+
+def decode_age_v2(code: int) -> int:
+    """5-bit log age code -> ms (middle of [64 × 2^(code-1), 64 × 2^code))"""
+    return 0 if code == 0 else 96 << (code - 1)
+
+
+@dataclass
+class MachineRecord:
+    """One decoded machine record, any record version"""
+    machine_id: int
+    rms_x100: int
+    freq_x10: int
+    battery: int
+    age_ms: int = 0
+    machine_type: int = 1       # v1 records carry no type
+    mean_x100: int = 0          # v2 only
+    flags: int = 0              # v2 only
+    
+    @classmethod
+    def unpack(cls, data: bytes, offset: int, version: int) -> "MachineRecord":
+        fields = unpack_record(MACHINE_RECORD[version], data, offset)
+        if version == 1:
+            return cls(
+                machine_id=fields["machine_id"],
+                rms_x100=fields["rms_x100"],
+                freq_x10=fields["freq_x10"],
+                battery=fields["battery_percent"],
+                age_ms=fields["age_ms"],
+            )
+        
+        freq_code = fields["freq_code"]
+        return cls(
+            machine_id=fields["machine_id"],
+            rms_x100=fields["rms_x100"],
+            freq_x10=0 if freq_code == 0 else round(2 ** ((freq_code - 1) / 24)),
+            battery=round(fields["battery_code"] * 100 / 15),
+            age_ms=decode_age_v2(fields["age_code"]),
+            machine_type=2 if fields["dryer"] else 1,
+            mean_x100=fields["mean_x10"] * 10,
+            flags=fields["flags"],
+        )
+    
+    def apply_delta(self, data: bytes, offset: int, version: int):
+        """Update from a delta record (rms, battery, age, v2 also flags)"""
+        fields = unpack_record(DELTA_RECORD[version], data, offset)
+        self.rms_x100 = fields["rms_x100"]
+        if version == 1:
+            self.battery = fields["battery_percent"]
+            self.age_ms = fields["age_ms"]
+            return
+        self.battery = round(fields["battery_code"] * 100 / 15)
+        self.age_ms = decode_age_v2(fields["age_code"])
+        self.flags = fields["flags"]
+
+
+@dataclass
+class FrameRound:
+    """Frames of one multi-frame round received so far"""
+    round_id: int
+    total: int
+    started: float
+    # frame index -> records of that frame
+    frames: Dict[int, List[MachineRecord]] = field(default_factory=dict)
+
+
+@dataclass
+class SequenceStats:
+    """Packet loss bookkeeping for one aggregator"""
+    last_seq: int
+    received: int = 1
+    lost: int = 0
+    restarts: int = 0
+    heard: int = 1      # Bit i set = last_seq - i heard, directly or relayed
+
+
+@dataclass
+class Keyframe:
+    """Last keyframe received from an aggregator, base for decoding deltas"""
+    keyframe_id: int
+    machine_ids: List[int]
+    record_version: int = 1
+    values: Dict[int, MachineRecord] = field(default_factory=dict)
+
 
 @dataclass
 class MachineReading:
@@ -33,6 +155,15 @@ class MachineReading:
     dominant_freq: float    # Hz
     battery_percent: int
     timestamp: float        # Unix timestamp
+    mean: float = 0.0       # m/s², v2 records only
+    flags: int = 0          # v2 records only
+    
+    @property
+    def edge_running(self) -> Optional[bool]:
+        """The aggregator's running/stopped classification, None if not sent"""
+        if not self.flags & READING_FLAG_EDGE_KNOWN:
+            return None
+        return bool(self.flags & READING_FLAG_EDGE_RUNNING)
 
 
 class WaveshareLoRaConfig:
@@ -135,6 +266,8 @@ class LoRaReceiver:
       - Bytes 1-2: RMS × 100 (uint16, little-endian)
       - Bytes 3-4: Freq × 10 (uint16, little-endian)
       - Byte 5: Battery %
+    
+    Typed packets (byte 0 >= 0xF0) are decoded by _parse_typed_packet.
     """
     
     # Waveshare default baud rate is 115200
@@ -146,13 +279,45 @@ class LoRaReceiver:
         self.running = False
         self.thread: Optional[threading.Thread] = None
         self.callback: Optional[Callable[[MachineReading], None]] = None
+        # (aggregator_id, machine_id, seconds since last heard)
+        self.offline_callback: Optional[Callable[[int, int, int], None]] = None
+        # (aggregator_id, telemetry report)
+        self.telemetry_callback: Optional[Callable[[int, dict], None]] = None
+        # (aggregator_id, session_id, status, offset) of firmware update progress
+        self.ota_callback: Optional[Callable[[int, int, int, int], None]] = None
         self.last_packet_time = 0.0
         self.packets_received = 0
+        self.crc_errors = 0
+        self.sequences: Dict[int, SequenceStats] = {}
+        # Age field histogram: BLE receive on the aggregator to LoRa TX
+        self.latency_histogram = [0] * (len(LATENCY_BUCKETS_MS) + 1)
+        self.latency_count = 0
+        self.latency_total_ms = 0
+        # aggregator_id -> last telemetry report (plus "received_at")
+        self.telemetry: Dict[int, dict] = {}
+        # aggregator_id -> round being reassembled
+        self.frame_rounds: Dict[int, FrameRound] = {}
+        self.incomplete_rounds = 0
+        # (aggregator_id, keyframe_id) -> Keyframe; aggregators with more
+        # machines than fit one packet keep one keyframe per group
+        self.keyframes: Dict[tuple, Keyframe] = {}
         
     def set_callback(self, callback: Callable[[MachineReading], None]):
         """Set callback function for received readings"""
         self.callback = callback
     
+    def set_offline_callback(self, callback: Callable[[int, int, int], None]):
+        """Set callback function for machines reported offline by an aggregator"""
+        self.offline_callback = callback
+    
+    def set_telemetry_callback(self, callback: Callable[[int, dict], None]):
+        """Set callback function for telemetry reports (they confirm downlink commands)"""
+        self.telemetry_callback = callback
+    
+    def set_ota_callback(self, callback: Callable[[int, int, int, int], None]):
+        """Set callback function for firmware update progress reports"""
+        self.ota_callback = callback
+    
     @property
     def is_connected(self) -> bool:
         """Check if LoRa receiver is connected"""
@@ -184,7 +349,7 @@ class LoRaReceiver:
         if self.configure_on_start:
             logger.info("Configuring Waveshare LoRa module...")
             config = WaveshareLoRaConfig(self.serial)
-            if config.configure(sf=10, bw=0, channel=18):
+            if config.configure(sf=LORA_SPREADING_FACTOR, bw=0, channel=18):
                 logger.info("LoRa module configured successfully")
             else:
                 logger.warning("LoRa module configuration failed, using defaults")
@@ -206,13 +371,92 @@ class LoRaReceiver:
     
     def get_stats(self) -> dict:
         """Get receiver statistics"""
+        received = sum(s.received for s in self.sequences.values())
+        lost = sum(s.lost for s in self.sequences.values())
         return {
             "connected": self.is_connected,
             "packets_received": self.packets_received,
+            "crc_errors": self.crc_errors,
+            "packets_lost": lost,
+            "loss_rate": lost / (received + lost) if received + lost else 0.0,
+            "aggregators": {
+                agg_id: {
+                    "received": s.received,
+                    "lost": s.lost,
+                    "loss_rate": s.lost / (s.received + s.lost),
+                    "restarts": s.restarts,
+                }
+                for agg_id, s in self.sequences.items()
+            },
+            "latency_ms": {
+                "count": self.latency_count,
+                "mean": self.latency_total_ms / self.latency_count if self.latency_count else 0.0,
+                "histogram": {
+                    label: count
+                    for label, count in zip(self._latency_labels(), self.latency_histogram)
+                },
+            },
+            "incomplete_rounds": self.incomplete_rounds,
+            "telemetry": self.telemetry,
             "last_packet_time": self.last_packet_time,
             "port": self.port,
             "baud_rate": self.baud_rate
         }
+    
+    @staticmethod
+    def _latency_labels() -> List[str]:
+        return [f"<={b}" for b in LATENCY_BUCKETS_MS] + [f">{LATENCY_BUCKETS_MS[-1]}"]
+    
+    def _track_sequence(self, aggregator_id: int, seq: int):
+        """Count gaps in an aggregator's 16-bit sequence as lost packets.
+        
+        A jump backwards (or forward by more than half the range) is taken
+        as an aggregator restart or a duplicate and not counted as loss.
+        """
+        stats = self.sequences.get(aggregator_id)
+        if stats is None:
+            self.sequences[aggregator_id] = SequenceStats(last_seq=seq)
+            return
+        
+        gap = (seq - stats.last_seq) & 0xFFFF
+        if gap == 0:
+            return  # Duplicate
+        if gap > 0x8000:
+            stats.restarts += 1
+            stats.heard = 1
+        else:
+            stats.lost += gap - 1
+            stats.heard = ((stats.heard << gap) | 1) & ((1 << SEQUENCE_HISTORY) - 1)
+        stats.received += 1
+        stats.last_seq = seq
+    
+    def _relayed_seen(self, source_id: int, seq: int) -> bool:
+        """True if the source's packet seq was heard before; notes it as heard.
+        
+        A packet newer than the source's last direct one is taken as not
+        heard; relayed packets do not count in the loss statistics.
+        """
+        stats = self.sequences.get(source_id)
+        if stats is None:
+            return False
+        behind = (stats.last_seq - seq) & 0xFFFF
+        if behind >= SEQUENCE_HISTORY:
+            return False
+        if stats.heard & (1 << behind):
+            return True
+        stats.heard |= 1 << behind
+        return False
+    
+    def _track_latency(self, age_ms: int):
+        """Add one record's age field to the latency histogram"""
+        bucket = len(LATENCY_BUCKETS_MS)
+        for i, bound in enumerate(LATENCY_BUCKETS_MS):
+            if age_ms <= bound:
+                bucket = i
+                break
+        self.latency_histogram[bucket] += 1
+        self.latency_count += 1
+        self.latency_total_ms += age_ms
         
     def _receive_loop(self):
         """Main receive loop running in background thread"""
@@ -231,6 +475,20 @@ class LoRaReceiver:
                     
                     # Try to parse complete packets
                     while len(buffer) >= 2:
+                        # Typed packets carry their own length information
+                        if buffer[0] >= PACKET_TYPE_MIN:
+                            packet_len = self._typed_packet_length(buffer)
+                            if packet_len is None:
+                                break  # Wait for more data
+                            if packet_len < 0:
+                                logger.warning(f"Invalid packet type {buffer[0]:#x}, skipping byte")
+                                del buffer[0]
+                                continue
+                            packet = bytes(buffer[:packet_len])
+                            del buffer[:packet_len]
+                            self.handle_packet(packet)
+                            continue
+                        
                         # Validate aggregator ID (should be 1-255)
                         if buffer[0] == 0 or buffer[0] > 250:
                             # Invalid packet start, skip byte
@@ -271,8 +529,353 @@ class LoRaReceiver:
             except Exception as e:
                 logger.exception(f"Error in receive loop: {e}")
                 
+    def handle_packet(self, packet: bytes) -> int:
+        """Parse a complete packet from any source (serial or HTTP).
+        
+        Returns:
+            Number of machine readings delivered to the callback
+        """
+        readings = self._parse_packet(packet)
+        self.packets_received += 1
+        self.last_packet_time = time.time()
+        return readings or 0
+    
+    @staticmethod
+    def _typed_packet_length(buffer: bytearray) -> Optional[int]:
+        """Length of the typed packet at the start of buffer.
+        
+        Returns None if more bytes are needed, -1 for an unknown type.
+        """
+        packet_type = buffer[0]
+        if packet_type == PACKET_TYPE_FRAME:
+            if len(buffer) < FRAME_HEADER_LEN:
+                return None
+            count, version = split_count(buffer[FRAME_HEADER_LEN - 1])
+            return FRAME_HEADER_LEN + count * MACHINE_RECORD_LEN[version] + 4
+        if packet_type == PACKET_TYPE_TELEMETRY:
+            return TELEMETRY_PACKET_LEN
+        if packet_type == PACKET_TYPE_OTA_REQUEST:
+            return OTA_REQUEST_PACKET_LEN
+        if packet_type == PACKET_TYPE_OFFLINE:
+            if len(buffer) < TYPED_HEADER_LEN + 1:
+                return None
+            return TYPED_HEADER_LEN + 1 + buffer[TYPED_HEADER_LEN] * OFFLINE_RECORD_LEN + 4
+        if packet_type in (PACKET_TYPE_READINGS, PACKET_TYPE_EVENTS):
+            if len(buffer) < TYPED_HEADER_LEN + 1:
+                return None
+            count, version = split_count(buffer[TYPED_HEADER_LEN])
+            return TYPED_HEADER_LEN + 1 + count * MACHINE_RECORD_LEN[version] + 4
+        if packet_type == PACKET_TYPE_KEYFRAME:
+            if len(buffer) < TYPED_HEADER_LEN + 2:
+                return None
+            count, version = split_count(buffer[TYPED_HEADER_LEN + 1])
+            return TYPED_HEADER_LEN + 2 + count * MACHINE_RECORD_LEN[version] + 4
+        if packet_type == PACKET_TYPE_DELTA:
+            start = TYPED_HEADER_LEN + 2
+            if len(buffer) < start:
+                return None
+            count, version = split_count(buffer[TYPED_HEADER_LEN + 1])
+            bitmap_len = (count + 7) // 8
+            if len(buffer) < start + 2 * bitmap_len:
+                return None
+            changed = buffer[start + bitmap_len:start + 2 * bitmap_len]
+            records = sum(bin(b).count("1") for b in changed)
+            return start + 2 * bitmap_len + records * DELTA_RECORD_LEN[version] + 4
+        if packet_type == PACKET_TYPE_RELAYED:
+            offset = TYPED_HEADER_LEN + 1
+            if len(buffer) < offset:
+                return None
+            for _ in range(buffer[TYPED_HEADER_LEN]):
+                if len(buffer) < offset + RELAY_GROUP_LEN:
+                    return None
+                count, version = split_count(unpack_record(RELAY_GROUP, buffer, offset)["count"])
+                offset += RELAY_GROUP_LEN + count * MACHINE_RECORD_LEN[version]
+            return offset + 4
+        return -1
+    
+    def _emit_reading(self, aggregator_id: int, record: MachineRecord, timestamp: float):
+        """Build a MachineReading and hand it to the callback"""
+        reading = MachineReading(
+            aggregator_id=aggregator_id,
+            machine_type=record.machine_type,
+            machine_id=record.machine_id,
+            rms=record.rms_x100 / 100.0,
+            dominant_freq=record.freq_x10 / 10.0,
+            battery_percent=record.battery,
+            timestamp=timestamp,
+            mean=record.mean_x100 / 100.0,
+            flags=record.flags
+        )
+        logger.info(
+            f"Machine {aggregator_id}/{record.machine_id}: "
+            f"RMS={reading.rms:.2f} m/s², "
+            f"Freq={reading.dominant_freq:.1f} Hz, "
+            f"Batt={reading.battery_percent}%"
+        )
+        if self.callback:
+            self.callback(reading)
+    
+    def _parse_typed_packet(self, packet: bytes) -> int:
+        """Parse a typed packet (byte 0 >= 0xF0), returns readings delivered"""
+        if len(packet) < TYPED_HEADER_LEN + 4:
+            logger.warning("Typed packet too short")
+            return 0
+        
+        crc = struct.unpack('<I', packet[-4:])[0]
+        if binascii.crc32(packet[:-4]) != crc:
+            self.crc_errors += 1
+            logger.warning(f"CRC mismatch in packet type {packet[0]:#x}, dropped")
+            return 0
+        
+        packet_type = packet[0]
+        aggregator_id = packet[1]
+        if packet_type in DOWNLINK_PACKET_TYPES:
+            # A relay's ACK to its source: byte 1 and the sequence are the source's
+            logger.debug(f"Downlink packet type {packet_type:#x} to aggregator {aggregator_id} ignored")
+            return 0
+        seq = struct.unpack_from('<H', packet, 2)[0]
+        body = packet[TYPED_HEADER_LEN:-4]
+        self._track_sequence(aggregator_id, seq)
+        
+        if packet_type in (PACKET_TYPE_READINGS, PACKET_TYPE_EVENTS):
+            return self._parse_readings(aggregator_id, body)
+        if packet_type == PACKET_TYPE_FRAME:
+            return self._parse_frame(aggregator_id, body)
+        if packet_type == PACKET_TYPE_TELEMETRY:
+            self._parse_telemetry(aggregator_id, body)
+            return 0
+        if packet_type == PACKET_TYPE_OFFLINE:
+            self._parse_offline(aggregator_id, body)
+            return 0
+        if packet_type == PACKET_TYPE_OTA_REQUEST:
+            self._parse_ota_request(aggregator_id, body)
+            return 0
+        if packet_type == PACKET_TYPE_KEYFRAME:
+            return self._parse_keyframe(aggregator_id, body)
+        if packet_type == PACKET_TYPE_DELTA:
+            return self._parse_delta(aggregator_id, body)
+        if packet_type == PACKET_TYPE_RELAYED:
+            return self._parse_relayed(aggregator_id, body)
+        
+        logger.warning(f"Unknown packet type {packet_type:#x} from aggregator {aggregator_id}")
+        return 0
+    
+    def _parse_frame(self, aggregator_id: int, body: bytes) -> int:
+        """Frame: round id, index, total, count N, N machine records.
+        
+        Frames are held until their round is complete, then the whole set
+        is delivered at once. When the next frame shows that a round was
+        superseded by a newer one (or is older than FRAME_ROUND_TIMEOUT_S),
+        the incomplete round is delivered as far as it got.
+        """
+        round_id, index, total = body[0], body[1], body[2]
+        machine_count, version = split_count(body[3])
+        record_len = MACHINE_RECORD_LEN[version]
+        if index >= total or len(body) < 4 + machine_count * record_len:
+            logger.warning("Invalid or truncated frame")
+            return 0
+        
+        records = []
+        for i in range(machine_count):
+            record = MachineRecord.unpack(body, 4 + i * record_len, version)
+            self._track_latency(record.age_ms)
+            records.append(record)
+        
+        now = time.time()
+        delivered = 0
+        current = self.frame_rounds.get(aggregator_id)
+        if current is not None and (current.round_id != round_id or
+                                    now - current.started > FRAME_ROUND_TIMEOUT_S):
+            delivered += self._deliver_round(aggregator_id, current, complete=False)
+            current = None
+        if current is None:
+            current = FrameRound(round_id=round_id, total=total, started=now)
+            self.frame_rounds[aggregator_id] = current
+        
+        current.frames[index] = records
+        if len(current.frames) == current.total:
+            delivered += self._deliver_round(aggregator_id, current, complete=True)
+        return delivered
+    
+    def _deliver_round(self, aggregator_id: int, frame_round: FrameRound, complete: bool) -> int:
+        """Hand all records of a (possibly incomplete) round to the callback"""
+        del self.frame_rounds[aggregator_id]
+        if not complete:
+            self.incomplete_rounds += 1
+            logger.warning(f"Round {frame_round.round_id} from aggregator {aggregator_id} "
+                           f"incomplete ({len(frame_round.frames)}/{frame_round.total} frames)")
+        
+        timestamp = time.time()
+        delivered = 0
+        for index in sorted(frame_round.frames):
+            for record in frame_round.frames[index]:
+                self._emit_reading(aggregator_id, record, timestamp)
+                delivered += 1
+        return delivered
+    
+    def _parse_telemetry(self, aggregator_id: int, body: bytes):
+        """Telemetry: fixed set of health counters, kept per aggregator"""
+        if len(body) < TELEMETRY_LEN:
+            logger.warning("Telemetry packet truncated")
+            return
+        
+        report = unpack_record(TELEMETRY, body)
+        report["received_at"] = time.time()
+        self.telemetry[aggregator_id] = report
+        logger.info(
+            f"Telemetry from aggregator {aggregator_id}: "
+            f"up {report['uptime_s']} s, {report['adverts_matched']}/{report['adverts_seen']} adverts matched, "
+            f"{report['packets_sent']} packets, queue high-water {report['tx_queue_high_water']}, "
+            f"callback p99 {report['callback_p99_us']} µs, min heap {report['min_free_heap']}, "
+            f"{report['missed_scan_windows']} scan windows given up to TX ({report['missed_due_windows']} due), "
+            f"{report['relayed_records']} records relayed ({report['relay_merged']} merged), "
+            f"TX stack free {report['tx_stack_free']} B"
+        )
+        if self.telemetry_callback:
+            self.telemetry_callback(aggregator_id, report)
+    
+    def _parse_ota_request(self, aggregator_id: int, body: bytes):
+        """Firmware update progress: session, status, patch bytes received"""
+        if len(body) < OTA_REQUEST_LEN:
+            logger.warning("OTA request packet truncated")
+            return
+        request = unpack_record(OTA_REQUEST, body)
+        if self.ota_callback:
+            self.ota_callback(aggregator_id, request["session_id"], request["status"], request["offset"])
+    
+    def _parse_offline(self, aggregator_id: int, body: bytes):
+        """Offline: count N, N × (machine ID, seconds since last heard)"""
+        machine_count = body[0]
+        if len(body) < 1 + machine_count * OFFLINE_RECORD_LEN:
+            logger.warning("Offline packet truncated")
+            return
+        
+        for i in range(machine_count):
+            record = unpack_record(OFFLINE_RECORD, body, 1 + i * OFFLINE_RECORD_LEN)
+            machine_id, silent_s = record["machine_id"], record["silent_s"]
+            logger.info(f"Machine {aggregator_id}/{machine_id} offline "
+                        f"(silent for {silent_s}s)")
+            if self.offline_callback:
+                self.offline_callback(aggregator_id, machine_id, silent_s)
+    
+    def _parse_readings(self, aggregator_id: int, body: bytes) -> int:
+        """Readings: count N, N machine records"""
+        machine_count, version = split_count(body[0])
+        record_len = MACHINE_RECORD_LEN[version]
+        if len(body) < 1 + machine_count * record_len:
+            logger.warning("Readings packet truncated")
+            return 0
+        
+        timestamp = time.time()
+        for i in range(machine_count):
+            record = MachineRecord.unpack(body, 1 + i * record_len, version)
+            self._track_latency(record.age_ms)
+            self._emit_reading(aggregator_id, record, timestamp)
+        return machine_count
+    
+    def _parse_keyframe(self, aggregator_id: int, body: bytes) -> int:
+        """Keyframe: id, count K, K machine records"""
+        keyframe_id = body[0]
+        machine_count, version = split_count(body[1])
+        record_len = MACHINE_RECORD_LEN[version]
+        if len(body) < 2 + machine_count * record_len:
+            logger.warning("Keyframe truncated")
+            return 0
+        
+        timestamp = time.time()
+        keyframe = Keyframe(keyframe_id=keyframe_id, machine_ids=[], record_version=version)
+        for i in range(machine_count):
+            record = MachineRecord.unpack(body, 2 + i * record_len, version)
+            self._track_latency(record.age_ms)
+            keyframe.machine_ids.append(record.machine_id)
+            keyframe.values[record.machine_id] = record
+            self._emit_reading(aggregator_id, record, timestamp)
+        
+        self.keyframes[(aggregator_id, keyframe_id)] = keyframe
+        logger.debug(f"Keyframe {keyframe_id} from aggregator {aggregator_id}: {machine_count} machines")
+        return machine_count
+    
+    def _parse_delta(self, aggregator_id: int, body: bytes) -> int:
+        """Delta: keyframe id, K, presence bitmap, change bitmap, delta records"""
+        keyframe_id = body[0]
+        machine_count, version = split_count(body[1])
+        keyframe = self.keyframes.get((aggregator_id, keyframe_id))
+        if (keyframe is None or len(keyframe.machine_ids) != machine_count or
+                keyframe.record_version != version):
+            logger.info(f"Delta for unknown keyframe {keyframe_id} from aggregator "
+                        f"{aggregator_id}, waiting for next keyframe")
+            return 0
+        
+        bitmap_len = (machine_count + 7) // 8
+        present = body[2:2 + bitmap_len]
+        changed = body[2 + bitmap_len:2 + 2 * bitmap_len]
+        offset = 2 + 2 * bitmap_len
+        record_len = DELTA_RECORD_LEN[version]
+        timestamp = time.time()
+        delivered = 0
+        
+        for i, machine_id in enumerate(keyframe.machine_ids):
+            if not present[i // 8] & (1 << (i % 8)):
+                continue
+            record = keyframe.values[machine_id]
+            if changed[i // 8] & (1 << (i % 8)):
+                if offset + record_len > len(body):
+                    logger.warning("Delta truncated")
+                    break
+                record.apply_delta(body, offset, version)
+                offset += record_len
+                self._track_latency(record.age_ms)
+            self._emit_reading(aggregator_id, record, timestamp)
+            delivered += 1
+        
+        return delivered
+    
+    def _parse_relayed(self, relay_id: int, body: bytes) -> int:
+        """Relayed: group count G, G × (source aggregator ID, source sequence, count N,
+        N machine records).
+        
+        The records are delivered as the source aggregator's, their ages
+        include the time the relay held them. Groups of a source packet
+        already heard (directly or through another relay) are dropped.
+        """
+        timestamp = time.time()
+        offset = 1
+        delivered = 0
+        for _ in range(body[0]):
+            if len(body) < offset + RELAY_GROUP_LEN:
+                logger.warning("Relayed packet truncated")
+                break
+            group = unpack_record(RELAY_GROUP, body, offset)
+            machine_count, version = split_count(group["count"])
+            record_len = MACHINE_RECORD_LEN[version]
+            offset += RELAY_GROUP_LEN
+            if len(body) < offset + machine_count * record_len:
+                logger.warning("Relayed packet truncated")
+                break
+            if self._relayed_seen(group["source_id"], group["source_seq"]):
+                logger.debug(f"Aggregator {relay_id} relayed packet {group['source_seq']} "
+                             f"of aggregator {group['source_id']}, already heard")
+                offset += machine_count * record_len
+                continue
+            
+            for i in range(machine_count):
+                record = MachineRecord.unpack(body, offset + i * record_len, version)
+                self._track_latency(record.age_ms)
+                self._emit_reading(group["source_id"], record, timestamp)
+            offset += machine_count * record_len
+            delivered += machine_count
+            logger.debug(f"Aggregator {relay_id} relayed {machine_count} machines of aggregator {group['source_id']}")
+        return delivered
+    
     def _parse_packet(self, packet: bytes):
         """Parse a complete LoRa packet (Protocol v2)"""
+        if packet and packet[0] >= PACKET_TYPE_MIN:
+            try:
+                return self._parse_typed_packet(packet)
+            except Exception as e:
+                logger.exception(f"Failed to parse typed packet: {e}")
+                return 0
+        
         try:
             aggregator_id = packet[0]
             machine_count = packet[1]
@@ -13,10 +13,12 @@ from pathlib import Path
 
 from flask import Flask, render_template, jsonify, request, abort
 
-from lora_receiver import MachineReading
+from lora_receiver import MachineReading, LoRaReceiver, PACKET_TYPE_MIN
 from state_machine import StateMachine, Thresholds, MachineState
 from database import Database
 from notifications import NotificationManager, Subscription
+from downlinks import DownlinkQueue
+from ota_patch import parse_patch
 
 # ============================================================================
 # Logging Setup
@@ -45,6 +47,8 @@ app = Flask(__name__)
 state_machine: StateMachine = None
 database: Database = None
 notification_manager: NotificationManager = None
+packet_decoder: LoRaReceiver = None  # Decodes typed packets (keeps keyframe state)
+downlink_queue: DownlinkQueue = None  # Commands and updates the bridge sends over LoRa
 config: dict = None
 
 
@@ -86,6 +90,12 @@ def api_status():
     return jsonify(state_machine.get_all_status())
 
 
+@app.route('/api/lora-stats')
+def api_lora_stats():
+    """API endpoint - packet loss, latency and aggregator telemetry (typed packets via HTTP)"""
+    return jsonify(packet_decoder.get_stats())
+
+
 @app.route('/api/aggregator/<int:aggregator_id>')
 def api_aggregator(aggregator_id: int):
     """API endpoint - single aggregator status"""
@@ -145,12 +155,62 @@ def api_unsubscribe(subscription_id: str):
     abort(404)
 
 
+@app.route('/api/aggregator/<int:aggregator_id>/settings', methods=['POST'])
+def api_aggregator_settings(aggregator_id: int):
+    """Queue setting changes, e.g. {"forward_interval_ms": 60000, "tx_power": 14}.
+    aggregator_id and spreading_factor take effect after a restart."""
+    data = request.json
+    if not data:
+        return jsonify({'error': 'Expected settings as JSON object'}), 400
+    try:
+        commands = [downlink_queue.add_command(aggregator_id, setting, int(value))
+                    for setting, value in data.items()]
+    except (TypeError, ValueError) as e:
+        return jsonify({'error': str(e)}), 400
+    return jsonify({'success': True, 'command_ids': [c.command_id for c in commands]})
+
+
+@app.route('/api/aggregator/<int:aggregator_id>/restart', methods=['POST'])
+def api_aggregator_restart(aggregator_id: int):
+    """Queue a restart"""
+    command = downlink_queue.add_restart(aggregator_id)
+    return jsonify({'success': True, 'command_ids': [command.command_id]})
+
+
+@app.route('/api/aggregator/<int:aggregator_id>/ota', methods=['POST'])
+def api_aggregator_ota(aggregator_id: int):
+    """Queue a firmware update, body is a patch file from ota_patch.py"""
+    try:
+        patch = parse_patch(request.get_data())
+    except ValueError as e:
+        return jsonify({'error': str(e)}), 400
+    session = downlink_queue.add_ota(aggregator_id, patch)
+    return jsonify({'success': True, 'session_id': session.session_id})
+
+
+@app.route('/api/aggregator/<int:aggregator_id>/downlinks')
+def api_aggregator_downlinks(aggregator_id: int):
+    """API endpoint - pending commands and recent firmware updates"""
+    return jsonify(downlink_queue.get_status(aggregator_id))
+
+
+@app.route('/api/ota/<int:session_id>')
+def api_ota_stream(session_id: int):
+    """Compressed patch of a pending update, fetched by the bridge"""
+    stream = downlink_queue.get_stream(session_id)
+    if stream is None:
+        abort(404)
+    return stream, 200, {'Content-Type': 'application/octet-stream'}
+
+
 @app.route('/api/lora-data', methods=['POST'])
 def api_lora_data():
     """HTTP endpoint to receive LoRa data from WiFi bridge"""
     try:
         # Expect JSON with hex encoded packet data
         data = request.json
+        if data and data.get('keepalive'):
+            return jsonify({'success': True, 'type': 'keepalive', 'downlinks': downlink_queue.pending()})
         if not data or 'packet_data' not in data:
             return jsonify({'error': 'Missing packet_data'}), 400
         
@@ -164,6 +224,16 @@ def api_lora_data():
         if len(packet_data) < 2:
             return jsonify({'error': 'Packet too short'}), 400
             
+        # Typed packets (keyframe/delta...) go through the shared decoder
+        if packet_data[0] >= PACKET_TYPE_MIN:
+            readings_processed = packet_decoder.handle_packet(packet_data)
+            return jsonify({
+                'success': True,
+                'type': f'typed-{packet_data[0]:#x}',
+                'readings_processed': readings_processed,
+                'downlinks': downlink_queue.pending()
+            })
+            
         aggregator_id = packet_data[0]
         machine_count = packet_data[1]
         
@@ -195,7 +265,6 @@ def api_lora_data():
             freq_x10 = struct.unpack('<H', packet_data[offset+4:offset+6])[0]
             battery = packet_data[offset+6]
             
-            from lora_receiver import MachineReading
             reading = MachineReading(
                 aggregator_id=aggregator_id,
                 machine_type=machine_type,
@@ -267,8 +336,23 @@ def on_reading_received(reading: MachineReading):
         notification_manager.on_state_change(machine, old_state, new_state)
 
 
+def on_machine_offline(aggregator_id: int, machine_id: int, silent_seconds: int):
+    """Callback when an aggregator reports a machine offline"""
+    state_change = state_machine.mark_offline(aggregator_id, machine_id, silent_seconds)
+    
+    if state_change:
+        machine, old_state, new_state = state_change
+        database.store_state_change(
+            machine.aggregator_id,
+            machine.machine_id,
+            old_state,
+            new_state
+        )
+
+
 def offline_check_loop():
-    """Periodically check for offline machines"""
+    """Periodically check for offline machines (fallback when an aggregator
+    itself goes silent and cannot report its machines offline)"""
     while True:
         time.sleep(60)  # Check every minute
         state_changes = state_machine.check_offline()
@@ -294,7 +378,7 @@ def cleanup_loop():
 # ============================================================================
 
 def main():
-    global state_machine, database, notification_manager, config
+    global state_machine, database, notification_manager, packet_decoder, downlink_queue, config
     
     parser = argparse.ArgumentParser(description='Washing Machine Monitoring Server')
     parser.add_argument('--config', default='config.json', help='Config file path')
@@ -329,6 +413,16 @@ def main():
     database = Database(config.get('database_path', 'washing_machines.db'))
     notification_manager = NotificationManager(config)
     
+    # Decoder for typed packets arriving over HTTP (no serial port is opened)
+    packet_decoder = LoRaReceiver("http", configure=False)
+    packet_decoder.set_callback(on_reading_received)
+    packet_decoder.set_offline_callback(on_machine_offline)
+    
+    # Downlinks leave the queue once telemetry or update progress confirms them
+    downlink_queue = DownlinkQueue()
+    packet_decoder.set_telemetry_callback(downlink_queue.on_telemetry)
+    packet_decoder.set_ota_callback(downlink_queue.on_ota_progress)
+    
     # Start background threads
     offline_thread = threading.Thread(target=offline_check_loop, daemon=True)
     offline_thread.start()
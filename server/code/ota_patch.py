@@ -0,0 +1,181 @@
+"""
+OTA Patch Tool
+Builds delta firmware patches for aggregators and queues them on the server
+
+A patch turns the firmware an aggregator runs (the base) into a new
+firmware image. It is a list of operations that write the new image front
+to back (see aggregator/platformio/include/ota.h):
+
+- ADD: u32 base offset, u32 length, then length bytes each added (mod 256)
+  to the base byte there. Code that only moved a little differs from the
+  base in a few bytes (addresses), so these bytes are mostly zeros.
+- INSERT: u32 length, then length bytes of the new image as they are.
+
+The operations are compressed as one zlib stream. The patch file adds a
+header the server reads to start the update:
+"WMP1", base size, base CRC-32, image size, image CRC-32 (u32 LE each).
+
+Usage:
+    python ota_patch.py old_firmware.bin new_firmware.bin patch.wmp
+    python ota_patch.py old.bin new.bin patch.wmp --upload http://server:8080 --aggregator 3
+"""
+
+import argparse
+import binascii
+import struct
+import sys
+import urllib.request
+import zlib
+
+PATCH_MAGIC = b"WMP1"
+PATCH_HEADER = struct.Struct("<4sIIII")
+
+OP_ADD = 0x01
+OP_INSERT = 0x02
+
+# Base blocks are indexed every INDEX_STRIDE bytes; a new position needs one
+# of BLOCK_LEN bytes (so at least BLOCK_LEN - INDEX_STRIDE aligned) to match
+BLOCK_LEN = 16
+INDEX_STRIDE = 4
+# An ADD carries on across differing bytes until no longer paying for them
+EXTEND_LOOKAHEAD = 64
+
+
+def _extend(base: bytes, new: bytes, base_pos: int, new_pos: int) -> int:
+    """Length of the ADD starting here: best 2 × matches - length (as bsdiff)"""
+    best_len = 0
+    best_score = 0
+    score = 0
+    length = 0
+    limit = min(len(base) - base_pos, len(new) - new_pos)
+    while length < limit and length - best_len <= EXTEND_LOOKAHEAD:
+        score += 1 if base[base_pos + length] == new[new_pos + length] else -1
+        length += 1
+        if score > best_score:
+            best_score = score
+            best_len = length
+    return best_len
+
+
+def _similar(base: bytes, new: bytes, base_pos: int, new_pos: int) -> bool:
+    """More than half of the next BLOCK_LEN bytes equal at this alignment"""
+    if base_pos < 0 or base_pos + BLOCK_LEN > len(base) or new_pos + BLOCK_LEN > len(new):
+        return False
+    same = sum(1 for k in range(BLOCK_LEN) if base[base_pos + k] == new[new_pos + k])
+    return same * 2 > BLOCK_LEN
+
+
+def diff(base: bytes, new: bytes) -> bytes:
+    """Uncompressed patch operations that turn base into new"""
+    index = {}
+    for pos in range(0, len(base) - BLOCK_LEN + 1, INDEX_STRIDE):
+        index.setdefault(base[pos:pos + BLOCK_LEN], pos)
+
+    ops = bytearray()
+    literal_start = 0
+    shift = 0  # base offset - new offset of the last ADD
+    pos = 0
+
+    def insert(end):
+        if end > literal_start:
+            ops.extend(struct.pack("<BI", OP_INSERT, end - literal_start))
+            ops.extend(new[literal_start:end])
+
+    while pos + BLOCK_LEN <= len(new):
+        # Stay on the last alignment while it still fits, else look it up
+        base_pos = pos + shift
+        if not _similar(base, new, base_pos, pos):
+            base_pos = index.get(new[pos:pos + BLOCK_LEN])
+            if base_pos is None:
+                pos += 1
+                continue
+        length = _extend(base, new, base_pos, pos)
+        if length == 0:
+            pos += 1
+            continue
+
+        insert(pos)
+        ops.extend(struct.pack("<BII", OP_ADD, base_pos, length))
+        ops.extend((new[pos + k] - base[base_pos + k]) & 0xFF for k in range(length))
+        shift = base_pos - pos
+        pos += length
+        literal_start = pos
+    insert(len(new))
+    return bytes(ops)
+
+
+def apply(base: bytes, ops: bytes) -> bytes:
+    """Inverse of diff(), the way the aggregator applies a patch"""
+    image = bytearray()
+    pos = 0
+    while pos < len(ops):
+        opcode = ops[pos]
+        if opcode == OP_ADD:
+            base_pos, length = struct.unpack_from("<II", ops, pos + 1)
+            pos += 9
+            image.extend((base[base_pos + k] + ops[pos + k]) & 0xFF for k in range(length))
+        elif opcode == OP_INSERT:
+            length = struct.unpack_from("<I", ops, pos + 1)[0]
+            pos += 5
+            image.extend(ops[pos:pos + length])
+        else:
+            raise ValueError(f"Unknown patch operation {opcode:#x} at {pos}")
+        pos += length
+    return bytes(image)
+
+
+def make_patch(base: bytes, new: bytes) -> bytes:
+    """Patch file: header and the compressed operations"""
+    ops = diff(base, new)
+    if apply(base, ops) != new:
+        raise RuntimeError("Patch does not reproduce the new image")
+    header = PATCH_HEADER.pack(PATCH_MAGIC, len(base), binascii.crc32(base),
+                               len(new), binascii.crc32(new))
+    return header + zlib.compress(ops, 9)
+
+
+def parse_patch(patch: bytes) -> dict:
+    """Header fields and compressed stream of a patch file (ValueError if it is none)"""
+    if len(patch) <= PATCH_HEADER.size or patch[:4] != PATCH_MAGIC:
+        raise ValueError("Not an aggregator firmware patch")
+    _, base_size, base_crc, image_size, image_crc = PATCH_HEADER.unpack_from(patch)
+    return {
+        "base_size": base_size,
+        "base_crc": base_crc,
+        "image_size": image_size,
+        "image_crc": image_crc,
+        "stream": patch[PATCH_HEADER.size:],
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Build a delta firmware patch for aggregators")
+    parser.add_argument("base", help="Firmware the aggregator runs now (.bin)")
+    parser.add_argument("new", help="Firmware to update to (.bin)")
+    parser.add_argument("patch", help="Patch file to write")
+    parser.add_argument("--upload", metavar="URL", help="Server to queue the update on, e.g. http://server:8080")
+    parser.add_argument("--aggregator", type=int, help="Aggregator ID to update (with --upload)")
+    args = parser.parse_args()
+
+    with open(args.base, "rb") as f:
+        base = f.read()
+    with open(args.new, "rb") as f:
+        new = f.read()
+    patch = make_patch(base, new)
+    with open(args.patch, "wb") as f:
+        f.write(patch)
+    print(f"{len(base)} -> {len(new)} bytes, patch {len(patch)} bytes "
+          f"({100 * len(patch) / len(new):.1f}% of the image)")
+
+    if args.upload:
+        if args.aggregator is None:
+            sys.exit("--upload needs --aggregator")
+        url = f"{args.upload.rstrip('/')}/api/aggregator/{args.aggregator}/ota"
+        req = urllib.request.Request(url, data=patch, method="POST",
+                                     headers={"Content-Type": "application/octet-stream"})
+        with urllib.request.urlopen(req, timeout=10) as response:
+            print(f"Queued: {response.read().decode()}")
+
+
+if __name__ == "__main__":
+    main()
@@ -211,8 +211,11 @@ class StateMachine:
             machine.battery_percent = reading.battery_percent
             machine.last_reading_time = reading.timestamp
             
-            # Determine new state
-            is_running = reading.rms >= self.thresholds.running_rms
+            # Determine new state, preferring the aggregator's classification
+            # (it has every sample and hysteresis, the server may only get events)
+            is_running = reading.edge_running
+            if is_running is None:
+                is_running = reading.rms >= self.thresholds.running_rms
             
             if is_running:
                 new_state = MachineState.RUNNING
@@ -262,16 +265,28 @@ class StateMachine:
                     if machine.last_reading_time > 0:
                         time_since = now - machine.last_reading_time
                         if time_since > offline_threshold:
-                            old_state = machine.state
-                            machine.state = MachineState.OFFLINE
-                            machine.state_change_time = now
-                            logger.warning(
-                                f"Machine {machine.aggregator_id}/{machine.machine_id} "
-                                f"went offline (no data for {time_since:.0f}s)"
-                            )
-                            state_changes.append((machine, old_state, MachineState.OFFLINE))
+                            state_changes.append(self._go_offline(machine, now, time_since))
                             
         return state_changes
+    
+    def mark_offline(self, aggregator_id: int, machine_id: int, silent_seconds: float):
+        """Mark a machine offline right away (reported by its aggregator)"""
+        with self.lock:
+            machine = self.machines.get((aggregator_id, machine_id))
+            if machine is None or machine.state == MachineState.OFFLINE:
+                return None
+            return self._go_offline(machine, time.time(), silent_seconds)
+    
+    def _go_offline(self, machine: MachineStatus, now: float, silent_seconds: float) -> tuple:
+        """Switch a machine to OFFLINE (lock held), returns the state change"""
+        old_state = machine.state
+        machine.state = MachineState.OFFLINE
+        machine.state_change_time = now
+        logger.warning(
+            f"Machine {machine.aggregator_id}/{machine.machine_id} "
+            f"went offline (no data for {silent_seconds:.0f}s)"
+        )
+        return (machine, old_state, MachineState.OFFLINE)
         
     def get_all_status(self) -> Dict[str, list]:
         """Get status of all machines grouped by aggregator"""
@@ -3,7 +3,10 @@ WiFi Bridge for Washing Machine Monitoring System
 
 This component:
 1. Receives LoRa packets from aggregators
-2. Forwards them to the server via HTTP POST
+2. Acknowledges state-change event packets over LoRa
+3. Forwards them to the server via HTTP POST
+4. Sends the server's downlinks (setting commands, firmware update chunks)
+   to aggregators over LoRa
 
 Hardware: Seeed XIAO ESP32S3 Sense with SX1262 LoRa module
 or
@@ -42,8 +45,16 @@ import binascii
 import wifi
 import ssl
 import socketpool
+import struct
 import adafruit_requests as requests
 from sx1262 import SX1262
+from packet_schema import (PACKET_TYPE_MIN, PACKET_TYPE_EVENTS, PACKET_TYPE_ACK, ACK, CRC_LEN,
+                           ACK_CLOCK_UNKNOWN, DOWNLINK_PACKET_TYPES,
+                           PACKET_TYPE_TELEMETRY, PACKET_TYPE_COMMAND, PACKET_TYPE_OTA_BEGIN,
+                           PACKET_TYPE_OTA_CHUNK, PACKET_TYPE_OTA_REQUEST, TELEMETRY, COMMAND,
+                           OTA_BEGIN, OTA_CHUNK, OTA_REQUEST, OTA_REQUEST_PACKET_LEN, OTA_STATUS_RECEIVING,
+                           OTA_CHUNK_DATA_MAX, TYPED_HEADER_LEN, LORA_PREAMBLE_LENGTH,
+                           pack_record, unpack_record)
 
 import busio
 import displayio
@@ -108,7 +119,7 @@ lora.begin(
     syncWord=config["lora"]["sync_word"],
     power=config["lora"]["power"],
     currentLimit=60.0,
-    preambleLength=8,
+    preambleLength=LORA_PREAMBLE_LENGTH,
     implicit=False,
     implicitLen=0xFF,
     crcOn=True,
@@ -176,7 +187,8 @@ def connect_wifi():
 # HTTP request setup
 pool = socketpool.SocketPool(wifi.radio)
 requests = requests.Session(pool, ssl.create_default_context())
-server_url = f"http://{config['server']['host']}:{config['server']['port']}{config['server']['endpoint']}"
+server_base = f"http://{config['server']['host']}:{config['server']['port']}"
+server_url = server_base + config['server']['endpoint']
 
 def send_to_server(packet_data):
     """Send LoRa packet to server via HTTP POST"""
@@ -197,6 +209,7 @@ def send_to_server(packet_data):
         if response.status_code == 200:
             result = response.json()
             print(f"Server response: {result}")
+            update_downlinks(result.get("downlinks"))
             return True
         else:
             print(f"Server error: {response.status_code}")
@@ -214,6 +227,7 @@ def send_keepalive():
         response = requests.post(server_url, json=payload, timeout=3)
         if response.status_code == 200:
             print("✓ Keepalive sent")
+            update_downlinks(response.json().get("downlinks"))
             return True
         else:
             print(f"✗ Keepalive failed: {response.status_code}")
@@ -223,6 +237,162 @@ def send_keepalive():
         print(f"✗ Keepalive error: {e}")
         return False
 
+# LoRa ACKs for typed packets (byte 0 >= 0xF0, aggregator ID, u16 sequence,
+# CRC-32 at the end). Per aggregator: the latest sequence received and a
+# bitmap of the 16 before it (bit i = sequence - 1 - i), so one ACK also
+# confirms events whose own ACK the aggregator missed. The ACK also carries
+# the bridge clock in ms, which aggregators use to align their TDMA slots,
+# and the packet's SNR and RSSI, from which they adapt their TX power.
+# Layouts are in lib/packet_schema.py, generated from the aggregator source.
+ACK_SNR_UNKNOWN = 127
+ACK_BITMAP_BITS = 16
+
+received_seqs = {}  # aggregator ID -> [latest sequence, bitmap]
+
+def track_sequence(packet):
+    """Record a typed aggregator packet with a valid CRC, returns its aggregator ID or None"""
+    if len(packet) < 8 or packet[0] < PACKET_TYPE_MIN or packet[0] in DOWNLINK_PACKET_TYPES:
+        return None
+    if binascii.crc32(packet[:-CRC_LEN]) != struct.unpack('<I', packet[-CRC_LEN:])[0]:
+        return None
+
+    aggregator_id = packet[1]
+    seq = struct.unpack_from('<H', packet, 2)[0]
+    if aggregator_id not in received_seqs:
+        received_seqs[aggregator_id] = [seq, 0]
+        return aggregator_id
+
+    state = received_seqs[aggregator_id]
+    ahead = (seq - state[0]) & 0xFFFF
+    if 0 < ahead < 0x8000:
+        # Newer packet: shift the old latest into the bitmap
+        if ahead > ACK_BITMAP_BITS:
+            bitmap = 0
+        else:
+            bitmap = ((state[1] << ahead) | (1 << (ahead - 1))) & 0xFFFF
+        state[0] = seq
+        state[1] = bitmap
+    elif ahead != 0:
+        behind = 0x10000 - ahead
+        if behind <= ACK_BITMAP_BITS:
+            state[1] |= 1 << (behind - 1)
+        else:
+            # Far behind: the aggregator restarted, start over
+            received_seqs[aggregator_id] = [seq, 0]
+    return aggregator_id
+
+def link_quality():
+    """SNR × 4 and negated RSSI of the last received packet"""
+    try:
+        snr_x4 = max(-128, min(126, int(lora.getSNR() * 4)))
+        rssi = max(0, min(255, int(-lora.getRSSI())))
+        return snr_x4, rssi
+    except Exception as e:
+        print(f"Packet status unavailable: {e}")
+        return ACK_SNR_UNKNOWN, 0
+
+def send_ack(aggregator_id, snr_x4, rssi):
+    """Reply with the aggregator's latest sequence, bitmap, our clock and link quality"""
+    seq, bitmap = received_seqs[aggregator_id]
+    clock_ms = (time.monotonic_ns() // 1000000) & 0xFFFFFFFF
+    if clock_ms == ACK_CLOCK_UNKNOWN:
+        clock_ms = 0  # Would read as a relay without a clock, 1 ms off every 49 days
+    ack = bytes([PACKET_TYPE_ACK, aggregator_id]) + struct.pack('<H', seq) + pack_record(ACK, {
+        "received_bitmap": bitmap,
+        "bridge_clock_ms": clock_ms,
+        "snr_x4": snr_x4 & 0xFF,
+        "rssi_neg": rssi,
+    })
+    ack += struct.pack('<I', binascii.crc32(ack))
+    try:
+        lora.send(ack)
+        print(f"ACK sent to aggregator {aggregator_id} (seq {seq}, SNR {snr_x4 / 4} dB)")
+    except Exception as e:
+        print(f"ACK failed: {e}")
+
+# Downlinks from the server: setting commands and firmware updates. The
+# aggregators only listen right after they transmit, so a command or update
+# start goes out in the window after an aggregator's next telemetry or
+# events packet (ahead of the ACK), until telemetry confirms the command ID
+# or the aggregator reports on the update. During an update each OTA_REQUEST
+# is answered with the chunk at the offset it asks for; the patch is
+# downloaded from the server once, when the update first shows up.
+downlinks = []      # As in the server's responses, commands first
+ota_patches = {}    # session ID -> compressed patch
+ota_started = set() # Sessions an aggregator already asked chunks for
+
+def update_downlinks(pending):
+    """Take the server's pending downlinks, fetching the patches of new updates"""
+    global downlinks
+    if pending is None:
+        return
+    downlinks = pending
+    sessions = [d["session_id"] for d in pending if d["type"] == "ota"]
+    for session_id in list(ota_patches):
+        if session_id not in sessions:
+            del ota_patches[session_id]
+            ota_started.discard(session_id)
+    for session_id in sessions:
+        if session_id not in ota_patches:
+            try:
+                response = requests.get(f"{server_base}/api/ota/{session_id}", timeout=10)
+                if response.status_code == 200:
+                    ota_patches[session_id] = response.content
+                    print(f"Firmware update {session_id}: {len(response.content)} byte patch downloaded")
+            except Exception as e:
+                print(f"Patch download failed: {e}")
+
+def drop_downlink(aggregator_id, kind, key, value):
+    """Forget a downlink the aggregator has dealt with (the server drops it too)"""
+    global downlinks
+    downlinks = [d for d in downlinks
+                 if not (d["aggregator_id"] == aggregator_id and d["type"] == kind and d[key] == value)]
+
+def send_downlink(packet_type, aggregator_id, body):
+    """Typed downlink with the aggregator's latest sequence in the header"""
+    seq = received_seqs[aggregator_id][0]
+    packet = bytes([packet_type, aggregator_id]) + struct.pack('<H', seq) + body
+    packet += struct.pack('<I', binascii.crc32(packet))
+    try:
+        lora.send(packet)
+        return True
+    except Exception as e:
+        print(f"Downlink failed: {e}")
+        return False
+
+def send_pending_downlink(aggregator_id):
+    """The aggregator's first pending command, else an update it has not started"""
+    for d in downlinks:
+        if d["aggregator_id"] != aggregator_id:
+            continue
+        if d["type"] == "command":
+            send_downlink(PACKET_TYPE_COMMAND, aggregator_id, pack_record(COMMAND, d))
+            print(f"Command {d['command_id']} sent to aggregator {aggregator_id}")
+            return
+        if d["type"] == "ota" and d["session_id"] in ota_patches and d["session_id"] not in ota_started:
+            send_downlink(PACKET_TYPE_OTA_BEGIN, aggregator_id, pack_record(OTA_BEGIN, d))
+            print(f"Firmware update {d['session_id']} started on aggregator {aggregator_id}")
+            return
+
+def handle_ota_request(aggregator_id, packet):
+    """Answer an update progress packet with the chunk it asks for"""
+    if len(packet) != OTA_REQUEST_PACKET_LEN:
+        return
+    request = unpack_record(OTA_REQUEST, packet, TYPED_HEADER_LEN)
+    session_id = request["session_id"]
+    if request["status"] != OTA_STATUS_RECEIVING:
+        drop_downlink(aggregator_id, "ota", "session_id", session_id)
+        ota_started.discard(session_id)
+        return
+    patch = ota_patches.get(session_id)
+    if patch is None:
+        return  # Not ours (any more), the aggregator gives up after a while
+    ota_started.add(session_id)
+    offset = request["offset"]
+    chunk = pack_record(OTA_CHUNK, request) + patch[offset:offset + OTA_CHUNK_DATA_MAX]
+    if send_downlink(PACKET_TYPE_OTA_CHUNK, aggregator_id, chunk):
+        print(f"Firmware update {session_id}: chunk at {offset}/{len(patch)} sent")
+
 # Statistics
 packets_received = 0
 packets_sent = 0
@@ -289,8 +459,24 @@ try:
                 packet_hex = binascii.hexlify(packet).decode()
                 print(f"LoRa RX ({len(packet)} bytes): {packet_hex}")
 
+                # Downlinks and ACK before the HTTP forward, the aggregator only listens briefly
+                aggregator_id = track_sequence(packet)
+                if aggregator_id is not None:
+                    if packet[0] == PACKET_TYPE_TELEMETRY:
+                        confirmed = unpack_record(TELEMETRY, packet, TYPED_HEADER_LEN)["command_id"]
+                        drop_downlink(aggregator_id, "command", "command_id", confirmed)
+                    if packet[0] == PACKET_TYPE_OTA_REQUEST:
+                        handle_ota_request(aggregator_id, packet)
+                    if packet[0] in (PACKET_TYPE_TELEMETRY, PACKET_TYPE_EVENTS):
+                        send_pending_downlink(aggregator_id)
+                    if packet[0] == PACKET_TYPE_EVENTS:
+                        snr_x4, rssi = link_quality()
+                        send_ack(aggregator_id, snr_x4, rssi)
+
                 # Forward to server if WiFi connected
-                if wifi_connected and wifi.radio.connected:
+                if packet[0] in DOWNLINK_PACKET_TYPES:
+                    print("Downlink (a relay's ACK), not forwarded")
+                elif wifi_connected and wifi.radio.connected:
                     success = send_to_server(packet)
                     if success:
                         packets_sent += 1
@@ -0,0 +1,215 @@
+"""
+LoRa packet schema, generated from aggregator/platformio/include/packet_schema.h
+and config.h by aggregator/platformio/scripts/gen_packet_schema.py. Do not edit.
+"""
+
+PACKET_TYPE_KEYFRAME = 0xF0
+PACKET_TYPE_DELTA = 0xF1
+PACKET_TYPE_READINGS = 0xF2
+PACKET_TYPE_TELEMETRY = 0xF3
+PACKET_TYPE_FRAME = 0xF4
+PACKET_TYPE_OFFLINE = 0xF5
+PACKET_TYPE_EVENTS = 0xF6
+PACKET_TYPE_OTA_REQUEST = 0xF7
+PACKET_TYPE_ACK = 0xF8
+PACKET_TYPE_COMMAND = 0xF9
+PACKET_TYPE_OTA_BEGIN = 0xFA
+PACKET_TYPE_OTA_CHUNK = 0xFB
+PACKET_TYPE_RELAYED = 0xFC
+PACKET_TYPE_MIN = 0xF0
+
+# Body bytes before the records, the last of them is the record count
+PACKET_PREFIX_LEN = {
+    PACKET_TYPE_KEYFRAME: 2,
+    PACKET_TYPE_DELTA: 2,
+    PACKET_TYPE_READINGS: 1,
+    PACKET_TYPE_TELEMETRY: 0,
+    PACKET_TYPE_FRAME: 4,
+    PACKET_TYPE_OFFLINE: 1,
+    PACKET_TYPE_EVENTS: 1,
+    PACKET_TYPE_OTA_REQUEST: 0,
+    PACKET_TYPE_ACK: 0,
+    PACKET_TYPE_COMMAND: 0,
+    PACKET_TYPE_OTA_BEGIN: 0,
+    PACKET_TYPE_OTA_CHUNK: 0,
+    PACKET_TYPE_RELAYED: 1,
+}
+
+TYPED_HEADER_LEN = 4
+CRC_LEN = 4
+RECORD_V2_FLAG = 0x80
+LORA_MAX_PAYLOAD = 255
+ACK_CLOCK_UNKNOWN = 0xFFFFFFFF
+
+# Record layouts: (field, bits), least significant bit first, little-endian
+MACHINE_RECORD_V1 = (
+    ("machine_id", 8),
+    ("rms_x100", 16),
+    ("freq_x10", 16),
+    ("battery_percent", 8),
+    ("age_ms", 16),
+)
+MACHINE_RECORD_V2 = (
+    ("machine_id", 8),
+    ("rms_x100", 11),
+    ("freq_code", 8),
+    ("battery_code", 4),
+    ("mean_x10", 8),
+    ("dryer", 1),
+    ("age_code", 5),
+    ("flags", 3),
+)
+DELTA_RECORD_V1 = (
+    ("rms_x100", 16),
+    ("battery_percent", 8),
+    ("age_ms", 16),
+)
+DELTA_RECORD_V2 = (
+    ("rms_x100", 11),
+    ("battery_code", 4),
+    ("reserved", 1),
+    ("age_code", 5),
+    ("flags", 3),
+)
+OFFLINE_RECORD = (
+    ("machine_id", 8),
+    ("silent_s", 16),
+)
+RELAY_GROUP = (
+    ("source_id", 8),
+    ("source_seq", 16),
+    ("count", 8),
+)
+TELEMETRY = (
+    ("uptime_s", 32),
+    ("adverts_seen", 32),
+    ("adverts_matched", 32),
+    ("dedup_hits", 32),
+    ("cache_full_drops", 32),
+    ("tx_queue_drops", 32),
+    ("tx_queue_depth", 8),
+    ("tx_queue_high_water", 8),
+    ("airtime_window_ms", 32),
+    ("airtime_total_ms", 32),
+    ("packets_sent", 32),
+    ("callback_p50_us", 16),
+    ("callback_p90_us", 16),
+    ("callback_p99_us", 16),
+    ("callback_max_us", 16),
+    ("min_free_heap", 32),
+    ("tx_timeouts", 16),
+    ("active_sensors", 8),
+    ("command_id", 8),
+    ("missed_scan_windows", 32),
+    ("missed_due_windows", 32),
+    ("relayed_records", 32),
+    ("relay_merged", 32),
+    ("tx_stack_free", 16),
+)
+ACK = (
+    ("received_bitmap", 16),
+    ("bridge_clock_ms", 32),
+    ("snr_x4", 8),
+    ("rssi_neg", 8),
+)
+COMMAND = (
+    ("command_id", 8),
+    ("setting", 8),
+    ("value", 32),
+)
+OTA_BEGIN = (
+    ("session_id", 8),
+    ("patch_size", 32),
+    ("base_size", 32),
+    ("base_crc", 32),
+    ("image_size", 32),
+    ("image_crc", 32),
+)
+OTA_CHUNK = (
+    ("session_id", 8),
+    ("offset", 32),
+)
+OTA_REQUEST = (
+    ("session_id", 8),
+    ("status", 8),
+    ("offset", 32),
+)
+
+# Downlink command settings and their accepted ranges
+SETTING_RESTART = 0
+SETTING_AGGREGATOR_ID = 1
+SETTING_FORWARD_MODE = 2
+SETTING_FORWARD_INTERVAL_MS = 3
+SETTING_SPREADING_FACTOR = 4
+SETTING_TX_POWER = 5
+SETTING_RANGES = {
+    SETTING_RESTART: (0, 0),
+    SETTING_AGGREGATOR_ID: (1, 239),
+    SETTING_FORWARD_MODE: (0, 3),
+    SETTING_FORWARD_INTERVAL_MS: (5000, 86400000),
+    SETTING_SPREADING_FACTOR: (7, 12),
+    SETTING_TX_POWER: (2, 14),
+}
+
+# Firmware update states in OTA_REQUEST packets
+OTA_STATUS_RECEIVING = 0
+OTA_STATUS_DONE = 1
+OTA_STATUS_FAILED = 2
+
+# LoRa modulation (config.h)
+LORA_FREQUENCY = 868.0
+LORA_BANDWIDTH = 125000
+LORA_SPREADING_FACTOR = 10
+LORA_CODING_RATE = 5
+LORA_PREAMBLE_LENGTH = 8
+LORA_SYNC_WORD = 0x12
+
+
+def layout_len(layout):
+    """Bytes of one record"""
+    return sum(bits for _, bits in layout) // 8
+
+
+def unpack_record(layout, data, offset=0):
+    """Fields of the record at offset, as a dict"""
+    value = int.from_bytes(bytes(data[offset:offset + layout_len(layout)]), "little")
+    fields = {}
+    for name, bits in layout:
+        fields[name] = value & ((1 << bits) - 1)
+        value >>= bits
+    return fields
+
+
+def pack_record(layout, fields):
+    """Bytes of one record, missing fields are 0"""
+    value = 0
+    shift = 0
+    for name, bits in layout:
+        value |= (fields.get(name, 0) & ((1 << bits) - 1)) << shift
+        shift += bits
+    return value.to_bytes(shift // 8, "little")
+
+
+MACHINE_RECORD = {1: MACHINE_RECORD_V1, 2: MACHINE_RECORD_V2}
+DELTA_RECORD = {1: DELTA_RECORD_V1, 2: DELTA_RECORD_V2}
+# *_LEN: bytes of one record (or body); *_PACKET_LEN: whole packet with
+# header and CRC, like *_PACKET_SIZE in packet_schema.h
+MACHINE_RECORD_LEN = {version: layout_len(layout) for version, layout in MACHINE_RECORD.items()}
+DELTA_RECORD_LEN = {version: layout_len(layout) for version, layout in DELTA_RECORD.items()}
+OFFLINE_RECORD_LEN = layout_len(OFFLINE_RECORD)
+RELAY_GROUP_LEN = layout_len(RELAY_GROUP)
+TELEMETRY_LEN = layout_len(TELEMETRY)
+ACK_LEN = layout_len(ACK)
+COMMAND_LEN = layout_len(COMMAND)
+OTA_BEGIN_LEN = layout_len(OTA_BEGIN)
+OTA_REQUEST_LEN = layout_len(OTA_REQUEST)
+TELEMETRY_PACKET_LEN = TYPED_HEADER_LEN + TELEMETRY_LEN + CRC_LEN
+ACK_PACKET_LEN = TYPED_HEADER_LEN + ACK_LEN + CRC_LEN
+COMMAND_PACKET_LEN = TYPED_HEADER_LEN + COMMAND_LEN + CRC_LEN
+OTA_BEGIN_PACKET_LEN = TYPED_HEADER_LEN + OTA_BEGIN_LEN + CRC_LEN
+OTA_REQUEST_PACKET_LEN = TYPED_HEADER_LEN + OTA_REQUEST_LEN + CRC_LEN
+OTA_CHUNK_DATA_MAX = LORA_MAX_PAYLOAD - TYPED_HEADER_LEN - layout_len(OTA_CHUNK) - CRC_LEN
+
+# Bridge -> aggregator packets; heard on the air they come from a relay
+# acknowledging its sources (or another bridge), byte 1 is the receiver
+DOWNLINK_PACKET_TYPES = (PACKET_TYPE_ACK, PACKET_TYPE_COMMAND, PACKET_TYPE_OTA_BEGIN, PACKET_TYPE_OTA_CHUNK)